@@ -0,0 +1,17 @@
+#pragma once
+
+// Protection of the mapped pages. These values are just like Linux.
+#define PROT_READ 0x1
+#define PROT_WRITE 0x2
+#define PROT_EXEC 0x4
+
+// Type of the mapping. Exactly one of MAP_SHARED or MAP_PRIVATE must be set.
+// Shared mappings see the writes to the file but can only be read only.
+// Writes to private mappings are copied on write and never reach the file.
+#define MAP_SHARED 0x01
+#define MAP_PRIVATE 0x02
+// Read the pages of the file in the mmap call instead of the first access
+#define MAP_POPULATE 0x8000
+
+// Returned from mmap on error
+#define MAP_FAILED ((void *)-1)
\ No newline at end of file
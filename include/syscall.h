@@ -14,4 +14,12 @@
 #define SYSCALL_UNLINK  13
 #define SYSCALL_MKDIR   14
 #define SYSCALL_CHDIR   15
-#define SYSCALL_READDIR 16
\ No newline at end of file
+#define SYSCALL_READDIR 16
+#define SYSCALL_FORK    17
+#define SYSCALL_MMAP    18
+#define SYSCALL_MUNMAP  19
+#define SYSCALL_SHM_CREATE 20
+#define SYSCALL_SHM_MAP    21
+#define SYSCALL_SHM_UNMAP  22
+#define SYSCALL_SYNC       23
+#define SYSCALL_FSYNC      24
\ No newline at end of file
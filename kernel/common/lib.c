@@ -1,4 +1,85 @@
 #include "lib.h"
+#include "cpu/asm.h"
+
+/**
+ * The kernel is compiled with -O0 thus byte by byte loops are very slow. The
+ * memory functions use the string instructions for big buffers and 8 byte
+ * loads/stores for small buffers instead.
+ *
+ * If the CPU supports ERMS (Enhanced REP MOVSB/STOSB), rep movsb/stosb is the
+ * fastest way to copy or fill a big buffer. Otherwise, we use rep movsq/stosq
+ * and copy the tail with rep movsb/stosb. If the CPU supports FSRM (Fast Short
+ * REP MOV), rep movsb is fast even for small buffers.
+ */
+
+// Buffers smaller than this are handled with the 8 byte loops unless FSRM is
+// supported
+#define SMALL_BUFFER_SIZE 64
+
+// CPUID.(EAX=7,ECX=0):EBX and EDX bits
+#define CPUID_7_EBX_ERMS (1U << 9)
+#define CPUID_7_EDX_FSRM (1U << 4)
+
+// A 64 bit integer which might not be aligned and might alias anything
+typedef uint64_t __attribute__((may_alias, aligned(1))) unaligned_uint64_t;
+
+// Features of the CPU which are set in lib_init
+static bool erms_supported, fsrm_supported;
+
+/**
+ * Checks the CPU features which the memory functions can use. The memory
+ * functions work before this function is called, just slower.
+ */
+void lib_init(void) {
+  uint32_t eax, ebx, ecx, edx;
+  cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+  if (eax < 7) // no extended features leaf
+    return;
+  cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+  erms_supported = (ebx & CPUID_7_EBX_ERMS) != 0;
+  fsrm_supported = (edx & CPUID_7_EDX_FSRM) != 0;
+}
+
+static inline void rep_movsb(void *dest, const void *src, size_t n) {
+  asm volatile("rep movsb" : "+D"(dest), "+S"(src), "+c"(n) : : "memory");
+}
+
+static inline void rep_movsq(void *dest, const void *src, size_t n) {
+  asm volatile("rep movsq" : "+D"(dest), "+S"(src), "+c"(n) : : "memory");
+}
+
+static inline void rep_stosb(void *dest, uint8_t value, size_t n) {
+  asm volatile("rep stosb" : "+D"(dest), "+c"(n) : "a"(value) : "memory");
+}
+
+static inline void rep_stosq(void *dest, uint64_t value, size_t n) {
+  asm volatile("rep stosq" : "+D"(dest), "+c"(n) : "a"(value) : "memory");
+}
+
+/**
+ * Copies from the start to the end in 8 byte chunks. This is safe for
+ * overlapping buffers if dest is before src.
+ */
+static inline void copy_words_forward(uint8_t *dest, const uint8_t *src,
+                                      size_t n) {
+  for (; n >= 8; n -= 8, dest += 8, src += 8)
+    *(unaligned_uint64_t *)dest = *(const unaligned_uint64_t *)src;
+  for (; n > 0; n--)
+    *dest++ = *src++;
+}
+
+/**
+ * Copies from the end to the start in 8 byte chunks. This is safe for
+ * overlapping buffers if dest is after src.
+ */
+static inline void copy_words_backward(uint8_t *dest, const uint8_t *src,
+                                       size_t n) {
+  for (; n >= 8; n -= 8)
+    *(unaligned_uint64_t *)(dest + n - 8) =
+        *(const unaligned_uint64_t *)(src + n - 8);
+  for (; n > 0; n--)
+    dest[n - 1] = src[n - 1];
+}
 
 // GCC and Clang reserve the right to generate calls to the following
 // 4 functions even if they are not directly called.
@@ -6,40 +87,44 @@
 // DO NOT remove or rename these functions, or stuff will eventually break!
 // They CAN be moved to a different .c file.
 void *memcpy(void *dest, const void *src, size_t n) {
-  uint8_t *pdest = (uint8_t *)dest;
-  const uint8_t *psrc = (const uint8_t *)src;
-
-  for (size_t i = 0; i < n; i++) {
-    pdest[i] = psrc[i];
+  if (n < SMALL_BUFFER_SIZE && !fsrm_supported) {
+    copy_words_forward(dest, src, n);
+  } else if (erms_supported) {
+    rep_movsb(dest, src, n);
+  } else {
+    rep_movsq(dest, src, n / 8);
+    rep_movsb((uint8_t *)dest + (n & ~7UL), (const uint8_t *)src + (n & ~7UL),
+              n % 8);
   }
-
   return dest;
 }
 
 void *memset(void *s, int c, size_t n) {
-  uint8_t *p = (uint8_t *)s;
-
-  for (size_t i = 0; i < n; i++) {
-    p[i] = (uint8_t)c;
+  const uint64_t pattern = 0x0101010101010101ULL * (uint8_t)c;
+  if (n < SMALL_BUFFER_SIZE) {
+    uint8_t *p = (uint8_t *)s;
+    for (; n >= 8; n -= 8, p += 8)
+      *(unaligned_uint64_t *)p = pattern;
+    for (; n > 0; n--)
+      *p++ = (uint8_t)c;
+  } else if (erms_supported) {
+    rep_stosb(s, (uint8_t)c, n);
+  } else {
+    rep_stosq(s, pattern, n / 8);
+    rep_stosb((uint8_t *)s + (n & ~7UL), (uint8_t)c, n % 8);
   }
-
   return s;
 }
 
 void *memmove(void *dest, const void *src, size_t n) {
-  uint8_t *pdest = (uint8_t *)dest;
-  const uint8_t *psrc = (const uint8_t *)src;
-
-  if (src > dest) {
-    for (size_t i = 0; i < n; i++) {
-      pdest[i] = psrc[i];
-    }
-  } else if (src < dest) {
-    for (size_t i = n; i > 0; i--) {
-      pdest[i - 1] = psrc[i - 1];
-    }
-  }
-
+  // If dest is before src or the buffers do not overlap, a forward copy is
+  // safe. The forward copy of memcpy only reads the bytes before writing over
+  // them.
+  if ((uintptr_t)dest - (uintptr_t)src >= n)
+    return memcpy(dest, src, n);
+  // Otherwise, copy backward. We avoid std + rep movs because the interrupt
+  // handlers expect the direction flag to be clear.
+  copy_words_backward(dest, src, n);
   return dest;
 }
 
@@ -88,4 +173,87 @@ size_t strlen(const char *s) {
   for (n = 0; s[n]; n++)
     ;
   return n;
-}
\ No newline at end of file
+}
+
+#ifdef LIB_BENCHMARK
+#include "mem/mem.h"
+#include "printf.h"
+
+/**
+ * The byte by byte memory functions which we used before. Only used to
+ * compare the new functions with.
+ */
+static void *bytewise_memcpy(void *dest, const void *src, size_t n) {
+  uint8_t *pdest = (uint8_t *)dest;
+  const uint8_t *psrc = (const uint8_t *)src;
+  for (size_t i = 0; i < n; i++)
+    pdest[i] = psrc[i];
+  return dest;
+}
+
+static void *bytewise_memset(void *s, int c, size_t n) {
+  uint8_t *p = (uint8_t *)s;
+  for (size_t i = 0; i < n; i++)
+    p[i] = (uint8_t)c;
+  return s;
+}
+
+static void *bytewise_memmove(void *dest, const void *src, size_t n) {
+  uint8_t *pdest = (uint8_t *)dest;
+  const uint8_t *psrc = (const uint8_t *)src;
+  for (size_t i = n; i > 0; i--) // we only benchmark dest > src
+    pdest[i - 1] = psrc[i - 1];
+  return dest;
+}
+
+/**
+ * Runs each memory function with the given size and prints the average TSC
+ * cycles of the old and new function. For memmove, dest is 64 bytes after src.
+ * Buffers must be at least size + 64 bytes.
+ */
+static void lib_benchmark_size(uint8_t *src, uint8_t *dest, size_t size,
+                               int iterations) {
+  uint64_t start, old_cycles, new_cycles;
+#define BENCH(name, old_call, new_call)                                        \
+  start = get_tsc();                                                           \
+  for (int i = 0; i < iterations; i++)                                         \
+    old_call;                                                                  \
+  old_cycles = (get_tsc() - start) / iterations;                               \
+  start = get_tsc();                                                           \
+  for (int i = 0; i < iterations; i++)                                         \
+    new_call;                                                                  \
+  new_cycles = (get_tsc() - start) / iterations;                               \
+  kprintf("lib_benchmark: %s %lu bytes: old %lu cycles, new %lu cycles\n",     \
+          name, size, old_cycles, new_cycles);
+  BENCH("memcpy", bytewise_memcpy(dest, src, size), memcpy(dest, src, size));
+  BENCH("memset", bytewise_memset(dest, i, size), memset(dest, i, size));
+  BENCH("memmove", bytewise_memmove(src + 64, src, size),
+        memmove(src + 64, src, size));
+#undef BENCH
+}
+
+/**
+ * Compares the memory functions with the old byte by byte loops for 64 byte,
+ * 4KB and framebuffer sized buffers. The framebuffer (if not NULL) is used as
+ * the destination of the biggest run just like fb_write and will be filled
+ * with junk.
+ */
+void lib_benchmark(void *framebuffer, size_t framebuffer_size) {
+  kprintf("lib_benchmark: ERMS %d, FSRM %d\n", erms_supported, fsrm_supported);
+  uint8_t *src = kalloc_pages(1), *dest = kalloc_pages(1);
+  if (src == NULL || dest == NULL)
+    panic("lib_benchmark: OOM");
+  lib_benchmark_size(src, dest, 64, 10000);
+  lib_benchmark_size(src, dest, PAGE_SIZE, 1000);
+  kfree_pages(src, 1);
+  kfree_pages(dest, 1);
+  // The framebuffer is both the source and destination (halves) of the
+  // biggest run
+  if (framebuffer != NULL) {
+    const size_t half = (framebuffer_size / 2) & ~63UL;
+    lib_benchmark_size(framebuffer, (uint8_t *)framebuffer + half, half - 64,
+                       4);
+    memset(framebuffer, 0, framebuffer_size);
+  }
+}
+#endif
\ No newline at end of file
@@ -15,6 +15,10 @@
     _a < _b ? _a : _b;                                                         \
   })
 
+void lib_init(void);
+#ifdef LIB_BENCHMARK
+void lib_benchmark(void *framebuffer, size_t framebuffer_size);
+#endif
 void *memcpy(void *dest, const void *src, size_t n);
 void *memset(void *s, int c, size_t n);
 void *memmove(void *dest, const void *src, size_t n);
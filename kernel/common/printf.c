@@ -14,7 +14,29 @@ static struct spinlock print_lock;
 
 static const char *digits = "0123456789abcdef";
 
-static void printint(long long xx, int base, int sign) {
+/**
+ * Where the formatted output goes. If buffer is NULL, the output goes to the
+ * serial port. Otherwise, at most size - 1 characters are written in the
+ * buffer and the rest are dropped.
+ */
+struct printf_sink {
+  char *buffer;
+  size_t size;
+  // Number of characters written in the buffer
+  size_t written;
+};
+
+static void sink_putc(struct printf_sink *sink, char c) {
+  if (sink->buffer == NULL) {
+    serial_putc(c);
+    return;
+  }
+  if (sink->written + 1 < sink->size)
+    sink->buffer[sink->written++] = c;
+}
+
+static void printint(struct printf_sink *sink, long long xx, int base,
+                     int sign) {
   char buf[20];
   int i;
   unsigned long long x;
@@ -33,28 +55,25 @@ static void printint(long long xx, int base, int sign) {
     buf[i++] = '-';
 
   while (--i >= 0)
-    serial_putc(buf[i]);
+    sink_putc(sink, buf[i]);
 }
 
-static void printptr(uint64_t x) {
-  serial_putc('0');
-  serial_putc('x');
+static void printptr(struct printf_sink *sink, uint64_t x) {
+  sink_putc(sink, '0');
+  sink_putc(sink, 'x');
   for (size_t i = 0; i < (sizeof(uint64_t) * 2); i++, x <<= 4)
-    serial_putc(digits[x >> (sizeof(uint64_t) * 8 - 4)]);
+    sink_putc(sink, digits[x >> (sizeof(uint64_t) * 8 - 4)]);
 }
 
-// Print to the console.
-int kprintf(const char *fmt, ...) {
-  va_list ap;
+// Format the fmt in the sink.
+static void vprintf_sink(struct printf_sink *sink, const char *fmt,
+                         va_list ap) {
   int i, cx, c0, c1, c2;
   char *s;
 
-  spinlock_lock(&print_lock);
-
-  va_start(ap, fmt);
   for (i = 0; (cx = fmt[i] & 0xff) != 0; i++) {
     if (cx != '%') {
-      serial_putc(cx);
+      sink_putc(sink, cx);
       continue;
     }
     i++;
@@ -65,52 +84,81 @@ int kprintf(const char *fmt, ...) {
     if (c1)
       c2 = fmt[i + 2] & 0xff;
     if (c0 == 'd') {
-      printint(va_arg(ap, int), 10, 1);
+      printint(sink, va_arg(ap, int), 10, 1);
     } else if (c0 == 'l' && c1 == 'd') {
-      printint(va_arg(ap, uint64_t), 10, 1);
+      printint(sink, va_arg(ap, uint64_t), 10, 1);
       i += 1;
     } else if (c0 == 'l' && c1 == 'l' && c2 == 'd') {
-      printint(va_arg(ap, uint64_t), 10, 1);
+      printint(sink, va_arg(ap, uint64_t), 10, 1);
       i += 2;
     } else if (c0 == 'u') {
-      printint(va_arg(ap, int), 10, 0);
+      printint(sink, va_arg(ap, int), 10, 0);
     } else if (c0 == 'l' && c1 == 'u') {
-      printint(va_arg(ap, uint64_t), 10, 0);
+      printint(sink, va_arg(ap, uint64_t), 10, 0);
       i += 1;
     } else if (c0 == 'l' && c1 == 'l' && c2 == 'u') {
-      printint(va_arg(ap, uint64_t), 10, 0);
+      printint(sink, va_arg(ap, uint64_t), 10, 0);
       i += 2;
     } else if (c0 == 'x') {
-      printint(va_arg(ap, int), 16, 0);
+      printint(sink, va_arg(ap, int), 16, 0);
     } else if (c0 == 'l' && c1 == 'x') {
-      printint(va_arg(ap, uint64_t), 16, 0);
+      printint(sink, va_arg(ap, uint64_t), 16, 0);
       i += 1;
     } else if (c0 == 'l' && c1 == 'l' && c2 == 'x') {
-      printint(va_arg(ap, uint64_t), 16, 0);
+      printint(sink, va_arg(ap, uint64_t), 16, 0);
       i += 2;
     } else if (c0 == 'p') {
-      printptr(va_arg(ap, uint64_t));
+      printptr(sink, va_arg(ap, uint64_t));
     } else if (c0 == 's') {
       if ((s = va_arg(ap, char *)) == 0)
         s = "(null)";
       for (; *s; s++)
-        serial_putc(*s);
+        sink_putc(sink, *s);
     } else if (c0 == '%') {
-      serial_putc('%');
+      sink_putc(sink, '%');
     } else if (c0 == 0) {
       break;
     } else {
       // Print unknown % sequence to draw attention.
-      serial_putc('%');
-      serial_putc(c0);
+      sink_putc(sink, '%');
+      sink_putc(sink, c0);
     }
   }
+}
+
+// Print to the console.
+int kprintf(const char *fmt, ...) {
+  va_list ap;
+  struct printf_sink sink = {0};
+
+  spinlock_lock(&print_lock);
+
+  va_start(ap, fmt);
+  vprintf_sink(&sink, fmt, ap);
   va_end(ap);
 
   spinlock_unlock(&print_lock);
   return 0;
 }
 
+/**
+ * Formats the fmt in the buffer just like kprintf. At most size - 1 characters
+ * are written and the buffer is always null terminated if size is not zero.
+ * Returns the number of characters written excluding the null terminator.
+ */
+int ksnprintf(char *buffer, size_t size, const char *fmt, ...) {
+  va_list ap;
+  struct printf_sink sink = {.buffer = buffer, .size = size, .written = 0};
+
+  va_start(ap, fmt);
+  vprintf_sink(&sink, fmt, ap);
+  va_end(ap);
+
+  if (size != 0)
+    buffer[sink.written] = '\0';
+  return (int)sink.written;
+}
+
 void khexdump(const char *buf, size_t size) {
   for (size_t i = 0; i < size; i++) {
     uint8_t data = buf[i];
@@ -1,5 +1,6 @@
 #include <stddef.h>
 
 int kprintf(const char *fmt, ...);
+int ksnprintf(char *buffer, size_t size, const char *fmt, ...);
 void khexdump(const char *buf, size_t size);
 void panic(const char *s) __attribute__ ((noreturn));
\ No newline at end of file
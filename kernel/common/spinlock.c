@@ -9,7 +9,7 @@
 /**
  * Saves if the interrupts where enabled before and disables them
  */
-static void save_and_disable_interrupts() {
+void save_and_disable_interrupts(void) {
   bool interrupts_were_enabled = is_interrupts_enabled();
   cli();
   struct cpu_local_data *cpu = cpu_local();
@@ -22,7 +22,7 @@ static void save_and_disable_interrupts() {
  * Restores the interrupts enabled register which was saved with
  * save_and_disable_interrupts function.
  */
-static void restore_interrupts() {
+void restore_interrupts(void) {
   struct cpu_local_data *cpu = cpu_local();
   cpu->interrupt_enable_stack.depth--;
   if (cpu->interrupt_enable_stack.depth == 0 &&
@@ -15,4 +15,6 @@ struct spinlock {
 
 void spinlock_lock(struct spinlock *lock);
 void spinlock_unlock(struct spinlock *lock);
-bool spinlock_locked(struct spinlock *lock);
\ No newline at end of file
+bool spinlock_locked(struct spinlock *lock);
+void save_and_disable_interrupts(void);
+void restore_interrupts(void);
\ No newline at end of file
@@ -20,6 +20,14 @@
 #define FLAGS_VIP (1UL << 20)  // Virtual interrupt pending
 #define FLAGS_ID (1UL << 21)   // Able to use CPUID instruction
 
+#define CR0_WP (1UL << 16) // Write protect read-only pages in ring 0
+
+#define CR4_PGE (1UL << 7)    // Page global enable
+#define CR4_PCIDE (1UL << 17) // Process-context identifiers enable
+
+#define CR3_NOFLUSH (1ULL << 63) // Keep the TLB entries of the new PCID
+#define CR3_PCID_MASK 0xFFFULL   // Bits of the PCID in CR3
+
 #define MSR_FS_BASE        0xC0000100
 #define MSR_GS_BASE        0xC0000101
 #define MSR_KERNEL_GS_BASE 0xC0000102
@@ -75,6 +83,27 @@ static inline void install_pagetable(uint64_t pagetable_address) {
                    : "a"(pagetable_address & 0xFFFFFFFFFFFFF000ULL));
 }
 
+/**
+ * Install a new pagetable with the given PCID. If keep_tlb is true, the TLB
+ * entries tagged with this PCID are not flushed. CR4.PCIDE must be set.
+ */
+static inline void install_pagetable_pcid(uint64_t pagetable_address,
+                                          uint16_t pcid, bool keep_tlb) {
+  uint64_t cr3 = (pagetable_address & 0xFFFFFFFFFFFFF000ULL) |
+                 (pcid & CR3_PCID_MASK);
+  if (keep_tlb)
+    cr3 |= CR3_NOFLUSH;
+  __asm__ volatile("mov cr3, rax" : : "a"(cr3) : "memory");
+}
+
+/**
+ * Invalidates the TLB entries of a virtual address in the current address
+ * space
+ */
+static inline void invlpg(uint64_t va) {
+  __asm__ volatile("invlpg [%0]" : : "r"(va) : "memory");
+}
+
 /**
  * Gets the physical address of installed current page table.
  */
@@ -84,6 +113,56 @@ static inline uint64_t get_installed_pagetable() {
   return cr3 & 0xFFFFFFFFFFFFF000ULL;
 }
 
+/**
+ * Reads the CR3 control register. This contains the PCID as well.
+ */
+static inline uint64_t read_cr3(void) {
+  uint64_t cr3;
+  __asm__ volatile("mov rax, cr3" : "=a"(cr3));
+  return cr3;
+}
+
+/**
+ * Reads the CR0 control register
+ */
+static inline uint64_t read_cr0(void) {
+  uint64_t cr0;
+  __asm__ volatile("mov rax, cr0" : "=a"(cr0));
+  return cr0;
+}
+
+/**
+ * Writes the CR0 control register
+ */
+static inline void write_cr0(uint64_t cr0) {
+  __asm__ volatile("mov cr0, rax" : : "a"(cr0));
+}
+
+/**
+ * Reads the CR4 control register
+ */
+static inline uint64_t read_cr4(void) {
+  uint64_t cr4;
+  __asm__ volatile("mov rax, cr4" : "=a"(cr4));
+  return cr4;
+}
+
+/**
+ * Writes the CR4 control register
+ */
+static inline void write_cr4(uint64_t cr4) {
+  __asm__ volatile("mov cr4, rax" : : "a"(cr4));
+}
+
+/**
+ * Gets the linear address which caused the last page fault
+ */
+static inline uint64_t get_cr2(void) {
+  uint64_t cr2;
+  __asm__ volatile("mov rax, cr2" : "=a"(cr2));
+  return cr2;
+}
+
 /**
  * Reads the module specific register
  */
@@ -131,9 +210,37 @@ static inline uint64_t get_tsc(void) {
   return ((uint64_t)timestamp_high << 32) | ((uint64_t)timestamp_low);
 }
 
+/**
+ * Runs the CPUID instruction with the given leaf and subleaf
+ */
+static inline void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *eax,
+                         uint32_t *ebx, uint32_t *ecx, uint32_t *edx) {
+  asm volatile("cpuid"
+               : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+               : "a"(leaf), "c"(subleaf));
+}
+
 /**
  * Returns true if interrupts are enabled
  */
 static inline bool is_interrupts_enabled(void) {
   return (read_rflags() & FLAGS_IF) != 0;
+}
+
+/**
+ * Flushes every TLB entry of every PCID including the global pages. This is
+ * done by toggling CR4.PGE.
+ */
+static inline void flush_tlb_all(void) {
+  const uint64_t cr4 = read_cr4();
+  write_cr4(cr4 & ~CR4_PGE);
+  write_cr4(cr4);
+}
+
+/**
+ * Flushes the non-global TLB entries of the current address space by
+ * reloading CR3.
+ */
+static inline void flush_tlb(void) {
+  __asm__ volatile("mov cr3, rax" : : "a"(read_cr3()) : "memory");
 }
\ No newline at end of file
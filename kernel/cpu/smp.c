@@ -15,6 +15,12 @@ struct cpu_local_data *cpu_local(void) {
 
 uint8_t get_processor_id(void) { return cpu_local()->cpuid; }
 
+struct cpu_local_data *cpu_local_of(uint8_t cpuid) {
+  if (cpuid >= __atomic_load_n(&next_cpuid, __ATOMIC_RELAXED))
+    return NULL;
+  return &cpu_locals[cpuid];
+}
+
 void cpu_local_setup(void) {
   uint8_t cpuid = __atomic_fetch_add(&next_cpuid, 1, __ATOMIC_RELAXED);
   if (cpuid > MAX_CORES)
@@ -1,4 +1,6 @@
+#pragma once
 #include <stdint.h>
+#include "mem/mem.h"
 #include "userspace/proc.h"
 
 // Maximum number of cores we support
@@ -50,6 +52,18 @@ struct cpu_local_data {
   // in memory if the running process is not equal to the last running
   // process.
   struct process *last_running_process;
+
+  // Free pages cached on this core. Managed by mem.c
+  struct page_magazine page_magazine;
+
+  // Free pages of this core which are zeroed ahead of time. Managed by mem.c
+  struct zeroed_pool zeroed_pool;
+
+  // Memory statistics of this core. Managed by mem.c
+  struct mem_counters mem_counters;
+
+  // Warm page tables of exited processes. Managed by proc.c
+  struct process_pool process_pool;
 };
 
 /**
@@ -62,6 +76,12 @@ struct cpu_local_data *cpu_local(void);
  */
 uint8_t get_processor_id(void);
 
+/**
+ * Gets the local CPU structure of the core with the given ID. Returns NULL if
+ * the core has not been setup yet.
+ */
+struct cpu_local_data *cpu_local_of(uint8_t cpuid);
+
 /**
  * When each core is starting up, they shall call this function with
  */
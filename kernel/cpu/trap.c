@@ -1,4 +1,5 @@
 #include "common/printf.h"
+#include "cpu/asm.h"
 #include "device/serial_port.h"
 #include "traps.h"
 #include "userspace/proc.h"
@@ -9,7 +10,6 @@
  * interrupt_handler_asm will call this function
  */
 void handle_trap(uint64_t irq, uint64_t error_code) {
-  (void)error_code;
   switch (irq) {
   case T_IRQ0 + IRQ_COM1:
     serial_received_char();
@@ -21,6 +21,23 @@ void handle_trap(uint64_t irq, uint64_t error_code) {
     scheduler_switch_back();
     condvar_unlock(&proc->lock);
   } break;
+  case T_PGFLT: {
+    const uint64_t fault_address = get_cr2();
+    if (proc_page_fault(fault_address, error_code) == 0)
+      break;
+    if (fault_address >= USER_STACK_GUARD && fault_address < USER_STACK_LIMIT)
+      kprintf("stack overflow\n");
+    kprintf("page fault: address %lx - error: %llx\n", fault_address,
+            error_code);
+    // Kill the program if it's the faulty one. Syscalls check the user
+    // buffers with proc_fault_in first, thus the kernel faulting on a user
+    // address is a last resort which should not happen.
+    if ((error_code & PF_USER) ||
+        (my_process() != NULL && fault_address >= VA_MIN &&
+         fault_address < USER_STACK_TOP))
+      proc_exit(-1);
+    panic("page fault");
+  }
   default:
     kprintf("irq: %llu - error: %llx\n", irq, error_code);
     panic("irq");
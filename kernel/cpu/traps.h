@@ -24,6 +24,12 @@
 #define T_VMERR         20      // Virtualization Exception
 #define T_CFERR         21      // Control Protection Exception
 
+// Error code bits of a page fault
+#define PF_PRESENT  (1 << 0)    // page was present (protection violation)
+#define PF_WRITE    (1 << 1)    // caused by a write
+#define PF_USER     (1 << 2)    // caused in user mode
+#define PF_FETCH    (1 << 4)    // caused by an instruction fetch
+
 
 // These are arbitrarily chosen, but with care not to overlap
 // processor defined exceptions or interrupt vectors.
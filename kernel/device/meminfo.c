@@ -0,0 +1,81 @@
+#include "meminfo.h"
+#include "common/lib.h"
+#include "common/printf.h"
+#include "mem/mem.h"
+#include "userspace/proc.h"
+
+/**
+ * A read only device which reports the memory counters of the kernel as text.
+ * Each line is a "name: value" pair. The pages of each process are reported
+ * at last as "pid <pid>: <resident pages>".
+ *
+ * The report is generated on each read and the part after the offset of the
+ * file descriptor is copied to the user. Thus, reading the device in small
+ * chunks might result in a mix of two different snapshots.
+ */
+
+/**
+ * Writes the memory report in the buffer. Returns the size of the report.
+ */
+static size_t meminfo_report(char *buffer, size_t size) {
+  struct mem_stats stats;
+  kalloc_stats(&stats);
+  size_t written = ksnprintf(
+      buffer, size,
+      "total_pages: %lu\n"
+      "free_pages: %lu\n"
+      "zeroed_pages: %lu\n"
+      "pagetable_pages: %lu\n"
+      "pagecache_resident: %lu\n"
+      "pagecache_dirty: %lu\n"
+      "pagecache_evictions: %lu\n"
+      "pagecache_steals: %lu\n"
+      "pagecache_writebacks: %lu\n"
+      "pagecache_hits: %lu\n"
+      "pagecache_misses: %lu\n"
+      "pagecache_lookup_cycles: %lu\n"
+      "pagecache_readahead_pages: %lu\n"
+      "pagecache_readahead_hits: %lu\n"
+      "pagecache_ghost_hits: %lu\n"
+      "filemap_resident: %lu\n"
+      "filemap_hits: %lu\n"
+      "filemap_misses: %lu\n"
+      "process_pool_hits: %lu\n"
+      "process_pool_misses: %lu\n"
+      "kalloc_failures: %lu\n"
+      "magazine_refills: %lu\n"
+      "magazine_drains: %lu\n",
+      stats.total_pages, stats.free_pages, stats.zeroed_pages,
+      stats.counters.pagetable_pages, stats.counters.pagecache_resident,
+      stats.counters.pagecache_dirty, stats.counters.pagecache_evictions,
+      stats.counters.pagecache_steals, stats.counters.pagecache_writebacks,
+      stats.counters.pagecache_hits, stats.counters.pagecache_misses,
+      stats.counters.pagecache_lookup_cycles,
+      stats.counters.pagecache_readahead_pages,
+      stats.counters.pagecache_readahead_hits,
+      stats.counters.pagecache_ghost_hits,
+      stats.counters.filemap_resident,
+      stats.counters.filemap_hits, stats.counters.filemap_misses,
+      stats.counters.process_pool_hits, stats.counters.process_pool_misses,
+      stats.counters.kalloc_failures,
+      stats.magazine_refills, stats.magazine_drains);
+  written += proc_memory_report(buffer + written, size - written);
+  return written;
+}
+
+/**
+ * Reads the memory report from the given offset.
+ */
+int meminfo_read(char *buffer, size_t len, uint32_t offset) {
+  // The syscall stack is small so the report is generated in a page
+  char *report = kalloc();
+  if (report == NULL)
+    return -1;
+  const size_t report_size = meminfo_report(report, PAGE_SIZE);
+  size_t to_copy = 0;
+  if (offset < report_size)
+    to_copy = MIN_SAFE(len, report_size - offset);
+  memcpy(buffer, report + offset, to_copy);
+  kfree(report);
+  return (int)to_copy;
+}
\ No newline at end of file
@@ -0,0 +1,7 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#define MEMINFO_DEVICE_NAME "meminfo"
+
+int meminfo_read(char *buffer, size_t len, uint32_t offset);
\ No newline at end of file
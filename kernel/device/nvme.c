@@ -42,6 +42,9 @@ static uint16_t next_command_id = 0;
 #define NVME_CAP_DSTRD(x) (1 << (2 + (((x) >> 32) & 0xf)))
 // We default to the first namespace of each device
 #define NVME_NAMESPACE_INDEX 1
+// Maximum size of each read or write is 2^(this_value) pages. This is well
+// below the MDTS of the NVMe devices which we care about.
+#define NVME_MAX_TRANSFER_ORDER 5
 
 /*
  * These register offsets are defined as 0x1000 + (N * (DSTRD bytes))
@@ -210,8 +213,9 @@ static void nvme_enable_device(void) {
  * Submit and complete 1 command by polling CQ for phase change.
  * Rings SQ doorbell, polls waiting for completion, rings CQ doorbell.
  * The command must be already in the submission queue.
+ * Returns the status of the command which is zero on success.
  */
-static void nvme_do_one_cmd_synchronous(struct nvme_queue *queue) {
+static uint16_t nvme_do_one_cmd_synchronous(struct nvme_queue *queue) {
   // Increment the submission queue tail
   queue->submission_queue_tail++;
   if (queue->submission_queue_tail > (queue->queue_size - 1)) // wrap around?
@@ -230,6 +234,7 @@ static void nvme_do_one_cmd_synchronous(struct nvme_queue *queue) {
     left_commands = (queue->queue_size - queue->completion_queue_head) +
                     queue->submission_queue_tail;
 
+  uint16_t status = 0;
   while (left_commands--) {
     // Wait for this completion queue entry to complete
     volatile NVME_CQ_ENTRY *cq =
@@ -237,6 +242,7 @@ static void nvme_do_one_cmd_synchronous(struct nvme_queue *queue) {
     while ((cq->flags & NVME_CQ_FLAGS_PHASE) ==
            queue->completion_queue_current_phase)
       ;
+    status = (NVME_CQ_FLAGS_SCT(cq->flags) << 8) | NVME_CQ_FLAGS_SC(cq->flags);
     // Advance the completion queue head
     queue->completion_queue_head++;
     if (queue->completion_queue_head >
@@ -250,6 +256,7 @@ static void nvme_do_one_cmd_synchronous(struct nvme_queue *queue) {
   NVME_REG4(
       NVME_CQHDBL_OFFSET(queue->queue_index, NVME_CAP_DSTRD(nvme_device.cap))) =
       queue->completion_queue_head;
+  return status;
 }
 
 /**
@@ -334,6 +341,45 @@ static void nvme_setup_namespaces(void) {
   kfree(namespace_data);
 }
 
+/**
+ * Gets the smallest buddy allocator order which can hold the given number of
+ * bytes. Panics if the transfer is bigger than what we support.
+ */
+static int nvme_transfer_order(uint64_t size) {
+  int order = 0;
+  while (((uint64_t)PAGE_SIZE << order) < size)
+    order++;
+  if (order > NVME_MAX_TRANSFER_ORDER)
+    panic("nvme: huge transfer");
+  return order;
+}
+
+/**
+ * Fills the PRP entries of a command which transfers size bytes from/to the
+ * physically contiguous buffer. If more than two pages are transferred, a PRP
+ * list is needed which is allocated and returned. The caller must free the PRP
+ * list (if not NULL) after the command is done.
+ */
+static uint64_t *nvme_fill_prps(volatile NVME_SQ_ENTRY *sq, const char *buffer,
+                                uint64_t size) {
+  const uint64_t page_count = (size + NVME_PAGE_SIZE - 1) / NVME_PAGE_SIZE;
+  sq->prp[0] = V2P(buffer);
+  if (page_count <= 1)
+    return NULL;
+  if (page_count == 2) {
+    sq->prp[1] = V2P(buffer) + NVME_PAGE_SIZE;
+    return NULL;
+  }
+  // PRP list contains every page except the first one
+  uint64_t *prp_list = kalloc();
+  if (prp_list == NULL)
+    panic("nvme: prp list OOM");
+  for (uint64_t i = 1; i < page_count; i++)
+    prp_list[i - 1] = V2P(buffer) + i * NVME_PAGE_SIZE;
+  sq->prp[1] = V2P(prp_list);
+  return prp_list;
+}
+
 /**
  * Write some blocks in the NVMe device.
  * lba is the starting logical block of the device.
@@ -343,18 +389,28 @@ static void nvme_setup_namespaces(void) {
  * The size of buffer must be block_count * nvme_device.block_size bytes.
  */
 void nvme_write(uint64_t lba, uint32_t block_count, const char *buffer) {
-  // Writes should be at most one memory page
-  if (block_count * nvme_device.block_size > PAGE_SIZE)
-    panic("nvme: huge write");
-  // Because the block count is set in a way that the write
-  // size is at last a page, we can do this in one command.
+  const uint64_t size = (uint64_t)block_count * nvme_device.block_size;
+  // Because the transfer is at most 2^NVME_MAX_TRANSFER_ORDER pages, we can
+  // do this in one command.
   // Also because I really don't care about the speed and stuff,
-  // I'll allocate a frame in memory and pass that to the NVMe
+  // I'll allocate contiguous frames in memory and pass them to the NVMe
   // instead of passing the buffer. Passing the buffer would have
   // been VERY cool because that is basically zero copy. But now,
-  // I need to copy at last one page.
-  char *aligned_buffer = kalloc();
-  memcpy(aligned_buffer, buffer, block_count * nvme_device.block_size);
+  // I need to copy the data once.
+  const int order = nvme_transfer_order(size);
+  char *aligned_buffer = kalloc_pages(order);
+  if (aligned_buffer == NULL && order > 0) {
+    // The memory is too fragmented for a contiguous bounce buffer. Write one
+    // page at a time instead.
+    const uint32_t page_blocks = PAGE_SIZE / nvme_device.block_size;
+    for (uint32_t done = 0; done < block_count; done += page_blocks)
+      nvme_write(lba + done, MIN_SAFE(page_blocks, block_count - done),
+                 buffer + (uint64_t)done * nvme_device.block_size);
+    return;
+  }
+  if (aligned_buffer == NULL)
+    panic("nvme: write OOM");
+  memcpy(aligned_buffer, buffer, size);
   // Allocate a submission request from the queue
   volatile NVME_SQ_ENTRY *sq =
       &nvme_device.io_queue
@@ -366,11 +422,13 @@ void nvme_write(uint64_t lba, uint32_t block_count, const char *buffer) {
   sq->cdw10 = lba;
   sq->cdw11 = (lba >> 32);
   sq->cdw12 = (block_count - 1) & 0xFFFF;
-  sq->prp[0] = V2P(aligned_buffer);
+  uint64_t *prp_list = nvme_fill_prps(sq, aligned_buffer, size);
   // Submit and wait
   nvme_do_one_cmd_synchronous(&nvme_device.io_queue);
   // Cleanup
-  kfree(aligned_buffer);
+  if (prp_list != NULL)
+    kfree(prp_list);
+  kfree_pages(aligned_buffer, order);
 }
 
 /**
@@ -382,17 +440,20 @@ void nvme_write(uint64_t lba, uint32_t block_count, const char *buffer) {
  * The size of buffer must be block_count * nvme_device.block_size bytes.
  */
 void nvme_read(uint64_t lba, uint32_t block_count, char *buffer) {
-  // Writes should be at most one memory page
-  if (block_count * nvme_device.block_size > PAGE_SIZE)
-    panic("nvme: huge write");
-  // Because the block count is set in a way that the write
-  // size is at last a page, we can do this in one command.
-  // Also because I really don't care about the speed and stuff,
-  // I'll allocate a frame in memory and pass that to the NVMe
-  // instead of passing the buffer. Passing the buffer would have
-  // been VERY cool because that is basically zero copy. But now,
-  // I need to copy at last one page.
-  char *aligned_buffer = kalloc();
+  const uint64_t size = (uint64_t)block_count * nvme_device.block_size;
+  // See nvme_write for why we use a bounce buffer.
+  const int order = nvme_transfer_order(size);
+  char *aligned_buffer = kalloc_pages(order);
+  if (aligned_buffer == NULL && order > 0) {
+    // Just like nvme_write, read one page at a time
+    const uint32_t page_blocks = PAGE_SIZE / nvme_device.block_size;
+    for (uint32_t done = 0; done < block_count; done += page_blocks)
+      nvme_read(lba + done, MIN_SAFE(page_blocks, block_count - done),
+                buffer + (uint64_t)done * nvme_device.block_size);
+    return;
+  }
+  if (aligned_buffer == NULL)
+    panic("nvme: read OOM");
   // Allocate a submission request from the queue
   volatile NVME_SQ_ENTRY *sq =
       &nvme_device.io_queue
@@ -404,13 +465,59 @@ void nvme_read(uint64_t lba, uint32_t block_count, char *buffer) {
   sq->cdw10 = lba;
   sq->cdw11 = (lba >> 32);
   sq->cdw12 = block_count - 1;
-  sq->prp[0] = V2P(aligned_buffer);
+  uint64_t *prp_list = nvme_fill_prps(sq, aligned_buffer, size);
   // Submit and wait
   nvme_do_one_cmd_synchronous(&nvme_device.io_queue);
   // Read back data
-  memcpy(buffer, aligned_buffer, block_count * nvme_device.block_size);
+  memcpy(buffer, aligned_buffer, size);
   // Cleanup
-  kfree(aligned_buffer);
+  if (prp_list != NULL)
+    kfree(prp_list);
+  kfree_pages(aligned_buffer, order);
+}
+
+/**
+ * Reads page_count pages starting at the given logical block directly into
+ * the given frames. The frames do not have to be contiguous because each of
+ * them gets its own PRP entry, thus no bounce buffer is needed.
+ *
+ * page_count must be at most 2^NVME_MAX_TRANSFER_ORDER. If it is more than
+ * two, prp_list must be a page which holds the PRP list. The caller allocates
+ * and frees it, thus this function never allocates memory.
+ *
+ * Returns false if the device failed the command.
+ */
+bool nvme_read_pages(uint64_t lba, void *const *pages, uint32_t page_count,
+                     uint64_t *prp_list) {
+  _Static_assert(PAGE_SIZE == NVME_PAGE_SIZE, "one PRP entry per page");
+  if (page_count == 0 || page_count > (1U << NVME_MAX_TRANSFER_ORDER))
+    panic("nvme: huge transfer");
+  const uint32_t block_count =
+      (uint64_t)page_count * PAGE_SIZE / nvme_device.block_size;
+  // Allocate a submission request from the queue
+  volatile NVME_SQ_ENTRY *sq =
+      &nvme_device.io_queue
+           .submission_queue[nvme_device.io_queue.submission_queue_tail];
+  memset((void *)sq, 0, sizeof(NVME_SQ_ENTRY));
+  sq->opc = NVME_IO_READ_OPC;
+  sq->cid = NEXT_COMMAND_ID();
+  sq->nsid = NVME_NAMESPACE_INDEX;
+  sq->cdw10 = lba;
+  sq->cdw11 = (lba >> 32);
+  sq->cdw12 = block_count - 1;
+  // Just like nvme_fill_prps, but every page is its own frame
+  sq->prp[0] = V2P(pages[0]);
+  if (page_count == 2) {
+    sq->prp[1] = V2P(pages[1]);
+  } else if (page_count > 2) {
+    if (prp_list == NULL)
+      panic("nvme: no prp list");
+    for (uint32_t i = 1; i < page_count; i++)
+      prp_list[i - 1] = V2P(pages[i]);
+    sq->prp[1] = V2P(prp_list);
+  }
+  // Submit and wait
+  return nvme_do_one_cmd_synchronous(&nvme_device.io_queue) == 0;
 }
 
 /**
@@ -420,6 +527,13 @@ uint32_t nvme_block_size(void) {
   return nvme_device.block_size;
 }
 
+/**
+ * Gets the number of blocks of the NVMe device
+ */
+uint64_t nvme_total_blocks(void) {
+  return nvme_device.total_blocks;
+}
+
 /**
  * Initialize NVMe driver
  *
@@ -1,6 +1,10 @@
+#include <stdbool.h>
 #include <stdint.h>
 
 void nvme_init(void);
 uint32_t nvme_block_size(void);
 void nvme_write(uint64_t lba, uint32_t block_count, const char *buffer);
-void nvme_read(uint64_t lba, uint32_t block_count, char *buffer);
\ No newline at end of file
+void nvme_read(uint64_t lba, uint32_t block_count, char *buffer);
+bool nvme_read_pages(uint64_t lba, void *const *pages, uint32_t page_count,
+                     uint64_t *prp_list);
+uint64_t nvme_total_blocks(void);
\ No newline at end of file
@@ -1,6 +1,7 @@
 #include "device.h"
 #include "common/lib.h"
 #include "device/fb.h"
+#include "device/meminfo.h"
 #include "device/serial_port.h"
 #include "userspace/proc.h"
 #include <stddef.h>
@@ -31,6 +32,14 @@ static struct device devices[] = {
         .lseek = NULL,
         .control = fb_control,
     },
+    {
+        .name = MEMINFO_DEVICE_NAME,
+        .read = NULL,
+        .read_at = meminfo_read,
+        .write = NULL,
+        .lseek = NULL,
+        .control = NULL,
+    },
 };
 
 // Number of devices which we support
@@ -61,7 +70,8 @@ int device_open(const char *name) {
   p->open_files[fd].type = FD_DEVICE;
   p->open_files[fd].structures.device = device_index_result;
   p->open_files[fd].offset = 0;
-  p->open_files[fd].readble = devices[device_index_result].read != NULL;
+  p->open_files[fd].readble = devices[device_index_result].read != NULL ||
+                              devices[device_index_result].read_at != NULL;
   p->open_files[fd].writable = devices[device_index_result].write != NULL;
   return fd;
 }
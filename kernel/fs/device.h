@@ -10,6 +10,10 @@ struct device {
   const char *name;
   // What we should do on the read from this device
   int (*read)(char *, size_t);
+  // Read from a device which has contents like a file (instead of being a
+  // stream). The offset of the file descriptor is given and it is advanced by
+  // the number of bytes read. Used instead of read if not NULL.
+  int (*read_at)(char *, size_t, uint32_t);
   // What we should do on the write to this device
   int (*write)(const char *, size_t);
   // Seek while reading or writing to this device
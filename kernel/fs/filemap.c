@@ -0,0 +1,266 @@
+#include "filemap.h"
+#include "common/lib.h"
+#include "common/printf.h"
+#include "common/spinlock.h"
+#include "cpu/smp.h"
+#include "mem/mem.h"
+#include "mem/slab.h"
+
+/**
+ * The file page cache. It keeps the pages of the files which are mapped in
+ * processes, such as the code of the programs. The page cache of
+ * mem/pagecache.c caches disk blocks which are not aligned with the pages of
+ * the files. Each page here instead holds a page aligned part of a file, thus
+ * it can be mapped directly in the processes.
+ *
+ * Pages are found with a hash table keyed by the dnode of the file and the
+ * index of the page in the file. The cache owns a share of each frame (see
+ * kpage_share) and each process which maps the frame owns another share. When
+ * the cache is full, the least recently used page is dropped from it; The
+ * processes which map that page keep the frame alive until they unmap it.
+ *
+ * Writes to a file are copied into its cached pages which are not mapped in
+ * any process. The mapped pages are dropped from the cache instead, because
+ * they might be the code or the private data of a running program. Those
+ * mappings keep the old data and the later faults read the new data.
+ */
+
+/**
+ * Maximum number of pages in the cache
+ */
+#define FILEMAP_MAX_PAGES 1024
+
+/**
+ * Number of buckets in the hash table. Must be a power of two.
+ */
+#define FILEMAP_BUCKETS 256
+
+/**
+ * A page of a file which is in the cache
+ */
+struct filemap_page {
+  // The frame which holds the data
+  void *frame;
+  // The file which this page belongs to
+  uint32_t dnode;
+  // Index of the page in the file
+  uint32_t index;
+  // Next page in the same hash bucket
+  struct filemap_page *hash_next;
+  // The least recently used list. lru_head is the most recently used page.
+  struct filemap_page *lru_next;
+  struct filemap_page *lru_prev;
+};
+
+// Where the filemap_page structs are allocated from
+static struct kmem_cache *filemap_page_cache;
+
+// The hash table of the cached pages
+static struct filemap_page *buckets[FILEMAP_BUCKETS];
+
+// Both ends of the least recently used list
+static struct filemap_page *lru_head, *lru_tail;
+
+// Number of pages in the cache
+static uint32_t cached_pages;
+
+// Incremented on each write or invalidation. A page which is read from the
+// disk is not cached if this changes while it is being read.
+static uint64_t filemap_generation;
+
+// Guards everything above
+static struct spinlock filemap_lock;
+
+/**
+ * Creates the caches which the file page cache needs
+ */
+void filemap_init(void) {
+  filemap_page_cache = kmem_cache_create(
+      "filemap_page", sizeof(struct filemap_page), NULL, 0);
+  if (filemap_page_cache == NULL)
+    panic("filemap_init");
+}
+
+/**
+ * Gets the hash bucket of a page of a file
+ */
+static inline struct filemap_page **bucket_of(uint32_t dnode, uint32_t index) {
+  const uint32_t hash = dnode * 2654435761U ^ index * 40503U;
+  return &buckets[hash & (FILEMAP_BUCKETS - 1)];
+}
+
+/**
+ * Looks for a page in the cache. filemap_lock must be held.
+ */
+static struct filemap_page *filemap_lookup(uint32_t dnode, uint32_t index) {
+  for (struct filemap_page *page = *bucket_of(dnode, index); page != NULL;
+       page = page->hash_next)
+    if (page->dnode == dnode && page->index == index)
+      return page;
+  return NULL;
+}
+
+/**
+ * Removes a page from the least recently used list. filemap_lock must be
+ * held.
+ */
+static void lru_remove(struct filemap_page *page) {
+  if (page->lru_prev != NULL)
+    page->lru_prev->lru_next = page->lru_next;
+  else
+    lru_head = page->lru_next;
+  if (page->lru_next != NULL)
+    page->lru_next->lru_prev = page->lru_prev;
+  else
+    lru_tail = page->lru_prev;
+}
+
+/**
+ * Puts a page at the head of the least recently used list. filemap_lock must
+ * be held.
+ */
+static void lru_push(struct filemap_page *page) {
+  page->lru_prev = NULL;
+  page->lru_next = lru_head;
+  if (lru_head != NULL)
+    lru_head->lru_prev = page;
+  else
+    lru_tail = page;
+  lru_head = page;
+}
+
+/**
+ * Drops a page from the cache. The frame is freed if no process maps it.
+ * filemap_lock must be held.
+ */
+static void filemap_remove(struct filemap_page *page) {
+  struct filemap_page **link = bucket_of(page->dnode, page->index);
+  while (*link != page)
+    link = &(*link)->hash_next;
+  *link = page->hash_next;
+  lru_remove(page);
+  cached_pages--;
+  MEM_COUNTER_ADD(filemap_resident, -1);
+  kpage_put(page->frame, 0);
+  kmem_cache_free(filemap_page_cache, page);
+}
+
+/**
+ * Gets the page of a file which starts at the given offset. offset must be
+ * page aligned. The bytes after the end of the file are zero. The caller owns
+ * a share of the returned frame and must drop it with kpage_put. The frame
+ * is shared with other processes, thus it must never be written to.
+ *
+ * Returns NULL if we are out of memory or the file cannot be read.
+ */
+void *filemap_get_page(struct fs_inode *inode, uint64_t offset) {
+  if (offset % PAGE_SIZE != 0)
+    panic("filemap_get_page: offset");
+  const uint32_t index = offset / PAGE_SIZE;
+  spinlock_lock(&filemap_lock);
+  struct filemap_page *page = filemap_lookup(inode->dnode, index);
+  if (page != NULL) { // hit
+    void *cached_frame = page->frame;
+    lru_remove(page);
+    lru_push(page);
+    kpage_share(cached_frame);
+    spinlock_unlock(&filemap_lock);
+    MEM_COUNTER_ADD(filemap_hits, 1);
+    return cached_frame;
+  }
+  const uint64_t generation = filemap_generation;
+  spinlock_unlock(&filemap_lock);
+
+  // Read the page without holding the lock
+  MEM_COUNTER_ADD(filemap_misses, 1);
+  char *frame = kalloc();
+  if (frame == NULL)
+    return NULL;
+  int read_bytes = 0;
+  if (offset < inode->size) {
+    read_bytes = fs_read(inode, frame,
+                         MIN_SAFE(inode->size - offset, (uint64_t)PAGE_SIZE),
+                         offset);
+    if (read_bytes < 0) {
+      kfree(frame);
+      return NULL;
+    }
+  }
+  memset(frame + read_bytes, 0, PAGE_SIZE - read_bytes);
+
+  // Cache it
+  struct filemap_page *new_page = kmem_cache_alloc(filemap_page_cache);
+  spinlock_lock(&filemap_lock);
+  page = filemap_lookup(inode->dnode, index);
+  if (page != NULL) { // someone else has read it in the meantime
+    void *cached_frame = page->frame;
+    kpage_share(cached_frame);
+    spinlock_unlock(&filemap_lock);
+    kfree(frame);
+    if (new_page != NULL)
+      kmem_cache_free(filemap_page_cache, new_page);
+    return cached_frame;
+  }
+  if (new_page == NULL || generation != filemap_generation) {
+    // Either OOM or our data might be stale. The caller is the only owner.
+    spinlock_unlock(&filemap_lock);
+    if (new_page != NULL)
+      kmem_cache_free(filemap_page_cache, new_page);
+    return frame;
+  }
+  if (cached_pages == FILEMAP_MAX_PAGES)
+    filemap_remove(lru_tail);
+  new_page->frame = frame;
+  new_page->dnode = inode->dnode;
+  new_page->index = index;
+  struct filemap_page **bucket = bucket_of(inode->dnode, index);
+  new_page->hash_next = *bucket;
+  *bucket = new_page;
+  lru_push(new_page);
+  cached_pages++;
+  MEM_COUNTER_ADD(filemap_resident, 1);
+  kpage_share(frame); // one for the cache and one for the caller
+  spinlock_unlock(&filemap_lock);
+  return frame;
+}
+
+/**
+ * Copies the data which is written to a file into the cached pages of the
+ * file. The pages which are mapped in processes are dropped instead. Must be
+ * called after the data is written to the file system.
+ */
+void filemap_write(uint32_t dnode, const char *buffer, size_t len,
+                   size_t offset) {
+  spinlock_lock(&filemap_lock);
+  filemap_generation++;
+  while (len > 0) {
+    const size_t page_offset = offset % PAGE_SIZE;
+    const size_t n = MIN_SAFE(len, PAGE_SIZE - page_offset);
+    struct filemap_page *page = filemap_lookup(dnode, offset / PAGE_SIZE);
+    if (page != NULL && kpage_shared(page->frame))
+      filemap_remove(page); // do not change the pages of the processes
+    else if (page != NULL)
+      memcpy((char *)page->frame + page_offset, buffer, n);
+    buffer += n;
+    offset += n;
+    len -= n;
+  }
+  spinlock_unlock(&filemap_lock);
+}
+
+/**
+ * Drops every cached page of a file. Must be called when a file is deleted
+ * because its dnode might be reused.
+ */
+void filemap_invalidate(uint32_t dnode) {
+  spinlock_lock(&filemap_lock);
+  filemap_generation++;
+  struct filemap_page *page = lru_head;
+  while (page != NULL) {
+    struct filemap_page *next = page->lru_next;
+    if (page->dnode == dnode)
+      filemap_remove(page);
+    page = next;
+  }
+  spinlock_unlock(&filemap_lock);
+}
\ No newline at end of file
@@ -0,0 +1,10 @@
+#pragma once
+#include "fs/fs.h"
+#include <stddef.h>
+#include <stdint.h>
+
+void filemap_init(void);
+void *filemap_get_page(struct fs_inode *inode, uint64_t offset);
+void filemap_write(uint32_t dnode, const char *buffer, size_t len,
+                   size_t offset);
+void filemap_invalidate(uint32_t dnode);
\ No newline at end of file
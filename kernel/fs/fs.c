@@ -3,11 +3,14 @@
 #include "common/lib.h"
 #include "common/printf.h"
 #include "common/spinlock.h"
+#include "cpu/smp.h"
 #include "device/nvme.h"
 #include "device/rtc.h"
+#include "filemap.h"
 #include "include/file.h"
 #include "mem/mem.h"
 #include "mem/pagecache.h"
+#include "mem/slab.h"
 
 // Hardcoded values of GPT table which we make.
 // TODO: Parse the GPT table and find these values.
@@ -15,14 +18,49 @@
 #define PARTITION_SIZE (204766 - PARTITION_OFFSET)
 
 /**
- * Allocates a block from the standard kernel allocator
+ * The cache which the scratch blocks of the file system are allocated from.
+ * File system allocates and frees these blocks all the time, thus we keep them
+ * in a slab cache to reuse the warm blocks of each core.
  */
-static union CrowFSBlock *allocate_mem_block(void) { return kcalloc(); }
+static struct kmem_cache *mem_block_cache;
+
+/**
+ * Allocates a zeroed block from the block cache
+ */
+static union CrowFSBlock *allocate_mem_block(void) {
+  union CrowFSBlock *block = kmem_cache_alloc(mem_block_cache);
+  if (block != NULL)
+    memset(block, 0, sizeof(union CrowFSBlock));
+  return block;
+}
 
 /**
  * Frees a block which is allocated by allocate_mem_block
  */
-static void free_mem_block(union CrowFSBlock *block) { kfree(block); }
+static void free_mem_block(union CrowFSBlock *block) {
+  kmem_cache_free(mem_block_cache, block);
+}
+
+/**
+ * Set while a core reads or writes the data of a file. CrowFS does not tell
+ * us what a block holds, thus every other block which is accessed is
+ * considered metadata (directories, dnodes and such) and kept in the page
+ * cache longer. The blocks which point to the data of a file are accessed
+ * while this is set as well, but we cannot tell them apart.
+ */
+static bool accessing_file_data[MAX_CORES];
+
+// Each block is cached in a page of the page cache
+_Static_assert(CROWFS_BLOCK_SIZE == PAGE_SIZE, "block must be a page");
+
+/**
+ * Gets the first logical block of the NVMe device which a block of the file
+ * system is stored in.
+ */
+static inline uint32_t block_lba(uint32_t block_index) {
+  return PARTITION_OFFSET +
+         (uint64_t)block_index * (CROWFS_BLOCK_SIZE / nvme_block_size());
+}
 
 /**
  * Writes a single block on the NVMe device. This can be done by writing
@@ -33,10 +71,17 @@ static void free_mem_block(union CrowFSBlock *block) { kfree(block); }
  * This function always succeeds because the NVMe always does (for now!).
  */
 static int write_block(uint32_t block_index, const union CrowFSBlock *block) {
-  pagecache_write(PARTITION_OFFSET +
-                      (uint64_t)block_index *
-                          (CROWFS_BLOCK_SIZE / nvme_block_size()),
-                  (const char *)block);
+  const uint32_t lba = block_lba(block_index);
+  // The whole block is overwritten, thus it is not read from the disk
+  struct pagecache_entry *entry =
+      pagecache_get(lba, false, !accessing_file_data[get_processor_id()]);
+  if (entry == NULL) { // no memory to cache it
+    nvme_write(lba, CROWFS_BLOCK_SIZE / nvme_block_size(),
+               (const char *)block);
+    return 0;
+  }
+  memcpy(pagecache_data(entry), block, CROWFS_BLOCK_SIZE);
+  pagecache_put(entry, true);
   return 0;
 }
 
@@ -44,9 +89,15 @@ static int write_block(uint32_t block_index, const union CrowFSBlock *block) {
  * Works mostly like write_block function but reads a block. Always succeeds.
  */
 static int read_block(uint32_t block_index, union CrowFSBlock *block) {
-  pagecache_read(PARTITION_OFFSET + (uint64_t)block_index *
-                                        (CROWFS_BLOCK_SIZE / nvme_block_size()),
-                 (char *)block);
+  const uint32_t lba = block_lba(block_index);
+  struct pagecache_entry *entry =
+      pagecache_get(lba, true, !accessing_file_data[get_processor_id()]);
+  if (entry == NULL) { // no memory to cache it
+    nvme_read(lba, CROWFS_BLOCK_SIZE / nvme_block_size(), (char *)block);
+    return 0;
+  }
+  memcpy(block, pagecache_data(entry), CROWFS_BLOCK_SIZE);
+  pagecache_put(entry, false);
   return 0;
 }
 
@@ -187,13 +238,18 @@ void fs_close(struct fs_inode *inode) {
 /**
  * Writes a chunk of data in the disk.
  *
+ * The buffer must not fault because the lock of the inode is held while it is
+ * read. User buffers must be faulted in with proc_fault_in first.
+ *
  * Returns the number of bytes written or -1 on error.
  */
 int fs_write(struct fs_inode *inode, const char *buffer, size_t len,
              size_t offset) {
   spinlock_lock(&inode->lock);
+  accessing_file_data[get_processor_id()] = true;
   int result =
       crowfs_write(&main_filesystem, inode->dnode, buffer, len, offset);
+  accessing_file_data[get_processor_id()] = false;
   if (result != CROWFS_OK) { // Error
     spinlock_unlock(&inode->lock);
     return -1;
@@ -201,6 +257,7 @@ int fs_write(struct fs_inode *inode, const char *buffer, size_t len,
   // Increase the file size if needed
   if (offset + len > inode->size)
     inode->size = offset + len;
+  filemap_write(inode->dnode, buffer, len, offset);
   spinlock_unlock(&inode->lock);
   return (int)len;
 }
@@ -208,11 +265,15 @@ int fs_write(struct fs_inode *inode, const char *buffer, size_t len,
 /**
  * Reads a chunk of data from the disk.
  *
+ * Just like fs_write, the buffer must not fault.
+ *
  * Returns the number of bytes written or -1 on error.
  */
 int fs_read(struct fs_inode *inode, char *buffer, size_t len, size_t offset) {
   spinlock_lock(&inode->lock);
+  accessing_file_data[get_processor_id()] = true;
   int result = crowfs_read(&main_filesystem, inode->dnode, buffer, len, offset);
+  accessing_file_data[get_processor_id()] = false;
   spinlock_unlock(&inode->lock);
   if (result < 0)
     return -1;
@@ -243,6 +304,7 @@ int fs_delete(const char *path, const struct fs_inode *relative_to) {
   result = crowfs_delete(&main_filesystem, dnode, parent_dnode);
   if (result != CROWFS_OK)
     return -1;
+  filemap_invalidate(dnode);
   return 0;
 }
 
@@ -316,6 +378,12 @@ void fs_init(void) {
   // Block size of the CrowFS must be divisible by the NVMe block size
   if (CROWFS_BLOCK_SIZE % nvme_block_size() != 0)
     panic("fs/nvme indivisible block size");
+  // Create the cache of the scratch blocks
+  mem_block_cache = kmem_cache_create("crowfs_block", sizeof(union CrowFSBlock),
+                                      NULL, 0);
+  if (mem_block_cache == NULL)
+    panic("fs: block cache");
+  filemap_init();
   // Initialize the file system
   int result = crowfs_init(&main_filesystem);
   if (result != CROWFS_OK)
@@ -4,6 +4,7 @@
 #include "device.h"
 #include "file.h"
 #include "include/file.h"
+#include "mem/pagecache.h"
 #include "userspace/proc.h"
 
 /**
@@ -28,6 +29,8 @@ int sys_read(int fd, char *buffer, size_t len) {
   // Is this fd readable?
   if (!p->open_files[fd].readble)
     return -1;
+  if (proc_fault_in(buffer, len, true) == -1)
+    return -1;
   // Read from the file/device
   switch (p->open_files[fd].type) {
   case FD_INODE:
@@ -36,6 +39,12 @@ int sys_read(int fd, char *buffer, size_t len) {
     struct device *dev = device_get(p->open_files[fd].structures.device);
     if (dev == NULL)
       return -1;
+    if (dev->read_at != NULL) {
+      int bytes_read = dev->read_at(buffer, len, p->open_files[fd].offset);
+      if (bytes_read > 0)
+        p->open_files[fd].offset += bytes_read;
+      return bytes_read;
+    }
     return dev->read(buffer, len);
   default: // not implemented
     return -1;
@@ -53,6 +62,8 @@ int sys_write(int fd, const char *buffer, size_t len) {
   // Is this fd writable?
   if (!p->open_files[fd].writable)
     return -1;
+  if (proc_fault_in(buffer, len, false) == -1)
+    return -1;
   // Write to the file/device
   switch (p->open_files[fd].type) {
   case FD_INODE:
@@ -202,6 +213,8 @@ int sys_readdir(int fd, void *buffer, size_t len) {
     panic("sys_readdir: no process");
   if (fd < 0 || fd >= MAX_OPEN_FILES || p->open_files[fd].type != FD_INODE)
     panic("sys_readdir: fd");
+  if (proc_fault_in(buffer, len, true) == -1)
+    return -1;
   // Read the directories
   int result = fs_readdir(p->open_files[fd].structures.inode, buffer, len,
                           p->open_files[fd].offset);
@@ -210,4 +223,24 @@ int sys_readdir(int fd, void *buffer, size_t len) {
   // Save how many entries we have read
   p->open_files[fd].offset += result;
   return result;
+}
+
+/**
+ * Writes back every dirty block in the page cache to the disk
+ */
+int sys_sync(void) {
+  pagecache_sync();
+  return 0;
+}
+
+/**
+ * Writes back the dirty blocks of a file to the disk. CrowFS does not tell us
+ * which blocks belong to a file, thus the whole page cache is written back.
+ */
+int sys_fsync(int fd) {
+  struct process *p = my_process();
+  if (fd < 0 || fd >= MAX_OPEN_FILES || p->open_files[fd].type != FD_INODE)
+    return -1;
+  pagecache_sync();
+  return 0;
 }
\ No newline at end of file
@@ -11,4 +11,6 @@ int sys_rename(const char *old_path, const char *new_path);
 int sys_unlink(const char *path);
 int sys_mkdir(const char *directory);
 int sys_chdir(const char *directory);
-int sys_readdir(int fd, void *buffer, size_t len);
\ No newline at end of file
+int sys_readdir(int fd, void *buffer, size_t len);
+int sys_sync(void);
+int sys_fsync(int fd);
\ No newline at end of file
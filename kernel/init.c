@@ -13,6 +13,8 @@
 #include "fs/fs.h"
 #include "limine.h"
 #include "mem/mem.h"
+#include "mem/pagecache.h"
+#include "mem/slab.h"
 #include "mem/vmm.h"
 #include "userspace/proc.h"
 #include "userspace/syscall.h"
@@ -81,8 +83,13 @@ void kmain(void) {
     halt(); // well shit...
   kprintf("Serial port initialized\n");
 
+  // Use the fast string instructions if possible
+  lib_init();
+
   // Initialize memory
   init_mem(hhdm_request.response->offset, memmap_request.response);
+  slab_init();
+  pagecache_init();
   vmm_init_kernel(*kernel_address_request.response);
   kprintf("Kernel memory layout changed\n");
 
@@ -96,6 +103,17 @@ void kmain(void) {
   if (framebuffer_request.response != NULL && framebuffer_request.response->framebuffer_count > 0)
     fb_init(framebuffer_request.response->framebuffers[0]);
 
+#ifdef LIB_BENCHMARK
+  if (framebuffer_request.response != NULL &&
+      framebuffer_request.response->framebuffer_count > 0) {
+    struct limine_framebuffer *fb =
+        framebuffer_request.response->framebuffers[0];
+    lib_benchmark(fb->address, fb->pitch * fb->height);
+  } else {
+    lib_benchmark(NULL, 0);
+  }
+#endif
+
   // Setup IOAPIC to get interrupts. PIC is disabled via Limine spec
   ioapic_init();
   serial_init_interrupt();
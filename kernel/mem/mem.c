@@ -2,6 +2,7 @@
 #include "common/lib.h"
 #include "common/spinlock.h"
 #include "common/printf.h"
+#include "cpu/smp.h"
 #include "pagecache.h"
 
 /**
@@ -10,46 +11,333 @@
 volatile uint64_t hhdm_offset;
 
 /**
- * Represents a free page which is linked to next page
+ * Free memory is managed with a buddy allocator. Each free block of 2^order
+ * pages is represented by the metadata of its first page which is linked in
+ * free_lists[order]. When a block is freed, we look at its buddy (the block
+ * which only differs in bit "order" of the page number) and if it's free and
+ * has the same order, we merge them into a block with one bigger order.
  */
-struct freepage_t {
-  // Next page which is free or null if this is last page
-  struct freepage_t *next;
-};
 
 /**
- * List of free pages
+ * List of free blocks of each order
+ */
+static struct page_t *free_lists[PAGE_MAX_ORDER];
+
+/**
+ * Guards the free lists and the metadata of free pages. Also guards the
+ * unseeded ranges.
  */
-static struct freepage_t *freepages = NULL;
 static struct spinlock freepages_lock;
 
 /**
- * Initialize memory stuff. This means to first initialize each page and then
- * save the HHDM offset.
+ * Memory is given to the buddy allocator lazily. At boot, we only remember the
+ * usable regions of the memory map and when the free lists run dry, we carve
+ * one more chunk out of these ranges. A chunk is a naturally aligned block of
+ * the biggest buddy order; Because merging never goes past this order, the
+ * buddy allocator never looks at the metadata of a chunk which is not seeded.
+ */
+#define CHUNK_ORDER (PAGE_MAX_ORDER - 1)
+#define CHUNK_PAGES (1ULL << CHUNK_ORDER)
+
+/**
+ * Maximum number of usable memory map regions which we seed lazily. The rest
+ * of the regions are seeded at boot.
+ */
+#define MAX_UNSEEDED_RANGES 64
+
+/**
+ * A range of usable page frame numbers [start, end) which is not yet given to
+ * the buddy allocator.
+ */
+struct unseeded_range {
+  uint64_t start;
+  uint64_t end;
+};
+
+/**
+ * Usable memory which is not seeded. Ranges before next_unseeded_range are
+ * fully seeded.
+ */
+static struct unseeded_range unseeded_ranges[MAX_UNSEEDED_RANGES];
+static uint64_t unseeded_range_count;
+static uint64_t next_unseeded_range;
+
+/**
+ * A bitmap with one bit for each chunk. The bit is set if the metadata of the
+ * pages in the chunk is initialized. Two memory map regions might share a
+ * chunk thus we must not initialize a metadata twice.
+ */
+static uint64_t *chunk_initialized;
+
+/**
+ * Maximum number of pages which each core zeroes ahead of time
+ */
+#define ZERO_POOL_TARGET 64
+
+/**
+ * Number of pages which we zero in each idle step. We keep this small because
+ * a process might become runnable meanwhile.
+ */
+#define ZERO_POOL_BATCH 8
+
+/**
+ * Metadata of all pages. Indexed with the page frame number.
+ */
+static struct page_t *pages;
+
+/**
+ * Number of entries in the pages array. Any physical address at or above
+ * page_count * PAGE_SIZE is not managed by us.
+ */
+static uint64_t page_count;
+
+/**
+ * Number of usable pages in the system
+ */
+static uint64_t total_usable_pages;
+
+/**
+ * Number of pages in the free lists of the buddy allocator. Guarded by
+ * freepages_lock.
+ */
+static uint64_t buddy_free_pages;
+
+/**
+ * Gets the metadata of the page which the given virtual address is in
+ */
+struct page_t *page_of(const void *address) {
+  return &pages[V2P(address) / PAGE_SIZE];
+}
+
+/**
+ * Gets the virtual address of a page from its metadata
+ */
+void *page_address(const struct page_t *page) {
+  return (void *)P2V((uint64_t)(page - pages) * PAGE_SIZE);
+}
+
+/**
+ * Adds a free block to the head of the free list of the given order.
+ * freepages_lock must be held.
+ */
+static void free_list_push(struct page_t *page, int order) {
+  page->order = order;
+  page->flags |= PAGE_FLAG_FREE;
+  page->prev = NULL;
+  page->next = free_lists[order];
+  if (free_lists[order] != NULL)
+    free_lists[order]->prev = page;
+  free_lists[order] = page;
+}
+
+/**
+ * Removes a free block from the free list of its order.
+ * freepages_lock must be held.
+ */
+static void free_list_remove(struct page_t *page) {
+  if (page->prev != NULL)
+    page->prev->next = page->next;
+  else
+    free_lists[page->order] = page->next;
+  if (page->next != NULL)
+    page->next->prev = page->prev;
+  page->flags &= ~PAGE_FLAG_FREE;
+  page->next = NULL;
+  page->prev = NULL;
+}
+
+static bool seed_next_chunk(void);
+
+/**
+ * Allocates a block of 2^order pages from the buddy allocator. Returns NULL if
+ * there is no free block big enough. freepages_lock must be held.
+ */
+static struct page_t *buddy_alloc(int order) {
+  int current_order;
+  for (;;) {
+    // Look for the smallest free block which can hold our request
+    current_order = order;
+    while (current_order < PAGE_MAX_ORDER && free_lists[current_order] == NULL)
+      current_order++;
+    if (current_order < PAGE_MAX_ORDER)
+      break;
+    // Get more memory from the memory map
+    if (!seed_next_chunk()) // OOM
+      return NULL;
+  }
+  struct page_t *page = free_lists[current_order];
+  free_list_remove(page);
+  // Split the block until we reach the requested order. The upper half of
+  // each split goes back to the free lists.
+  while (current_order > order) {
+    current_order--;
+    free_list_push(page + (1ULL << current_order), current_order);
+  }
+  page->order = order;
+  buddy_free_pages -= 1ULL << order;
+  return page;
+}
+
+/**
+ * Returns a block of 2^order pages to the buddy allocator and merges it with
+ * its buddies as much as possible. freepages_lock must be held.
+ */
+static void buddy_free(struct page_t *page, int order) {
+  uint64_t page_number = page - pages;
+  buddy_free_pages += 1ULL << order;
+  while (order < PAGE_MAX_ORDER - 1) {
+    const uint64_t buddy_number = page_number ^ (1ULL << order);
+    if (buddy_number >= page_count)
+      break;
+    struct page_t *buddy = &pages[buddy_number];
+    if (!(buddy->flags & PAGE_FLAG_FREE) || buddy->order != order)
+      break;
+    // Merge with the buddy. The merged block starts at the lower page.
+    free_list_remove(buddy);
+    page_number &= ~(1ULL << order);
+    order++;
+  }
+  free_list_push(&pages[page_number], order);
+}
+
+/**
+ * Gives the pages of a range up to the end of the first chunk of it to the
+ * buddy allocator. Initializes the metadata of that chunk if needed.
+ * freepages_lock must be held.
+ */
+static void seed_chunk(struct unseeded_range *range) {
+  const uint64_t chunk = range->start / CHUNK_PAGES;
+  const uint64_t chunk_start = chunk * CHUNK_PAGES;
+  const uint64_t end_page = MIN_SAFE(range->end, chunk_start + CHUNK_PAGES);
+  if ((chunk_initialized[chunk / 64] & (1ULL << (chunk % 64))) == 0) {
+    memset(&pages[chunk_start], 0,
+           MIN_SAFE(CHUNK_PAGES, page_count - chunk_start) *
+               sizeof(struct page_t));
+    chunk_initialized[chunk / 64] |= 1ULL << (chunk % 64);
+  }
+  // Free the biggest aligned blocks which fit in the chunk
+  uint64_t current_page = range->start;
+  while (current_page < end_page) {
+    int order = 0;
+    while (order < CHUNK_ORDER && current_page % (1ULL << (order + 1)) == 0 &&
+           current_page + (1ULL << (order + 1)) <= end_page)
+      order++;
+    buddy_free(&pages[current_page], order);
+    current_page += 1ULL << order;
+  }
+  range->start = end_page;
+}
+
+/**
+ * Seeds the next chunk of the unseeded ranges. Returns false if all of the
+ * usable memory is already seeded. freepages_lock must be held.
+ */
+static bool seed_next_chunk(void) {
+  while (next_unseeded_range < unseeded_range_count &&
+         unseeded_ranges[next_unseeded_range].start ==
+             unseeded_ranges[next_unseeded_range].end)
+    next_unseeded_range++;
+  if (next_unseeded_range == unseeded_range_count)
+    return false;
+  seed_chunk(&unseeded_ranges[next_unseeded_range]);
+  return true;
+}
+
+/**
+ * Initialize memory stuff. This means to save the HHDM offset and remember the
+ * usable regions of the memory. The pages themselves are not touched here; They
+ * are given to the buddy allocator on demand.
  */
 void init_mem(uint64_t hhdm_offset_local,
               const struct limine_memmap_response *memory_map) {
   hhdm_offset = hhdm_offset_local;
-  // Setup the free pages
-  uint64_t total_free_pages = 0;
+  // Find out how many pages we must keep the metadata of
   for (uint64_t i = 0; i < memory_map->entry_count; i++) {
     const struct limine_memmap_entry *entry = memory_map->entries[i];
     if (entry->type == LIMINE_MEMMAP_USABLE) {
       // Sanity check
       if (entry->base % PAGE_SIZE != 0 || entry->length % PAGE_SIZE != 0)
         panic("init_mem align");
-      // Free each page
-      const uint64_t free_page_count = entry->length / PAGE_SIZE;
-      uint64_t current_page = entry->base;
-      for (uint64_t page_number = 0; page_number < free_page_count;
-           page_number++, current_page += PAGE_SIZE) {
-        kfree((void *)P2V(current_page));
-        total_free_pages++;
-      }
+      page_count =
+          MAX_SAFE(page_count, (entry->base + entry->length) / PAGE_SIZE);
+    }
+  }
+  // Steal the metadata array and the chunk bitmap from the first usable region
+  // which can hold them. The metadata is initialized lazily when each chunk
+  // is seeded.
+  const uint64_t metadata_size =
+      PAGE_ROUND_UP(page_count * sizeof(struct page_t));
+  const uint64_t chunk_count = (page_count + CHUNK_PAGES - 1) / CHUNK_PAGES;
+  const uint64_t bitmap_size =
+      PAGE_ROUND_UP((chunk_count + 63) / 64 * sizeof(uint64_t));
+  const struct limine_memmap_entry *metadata_entry = NULL;
+  for (uint64_t i = 0; i < memory_map->entry_count; i++) {
+    const struct limine_memmap_entry *entry = memory_map->entries[i];
+    if (entry->type == LIMINE_MEMMAP_USABLE &&
+        entry->length >= metadata_size + bitmap_size) {
+      metadata_entry = entry;
+      break;
+    }
+  }
+  if (metadata_entry == NULL)
+    panic("init_mem: no space for page metadata");
+  const uint64_t metadata_base = metadata_entry->base;
+  pages = (struct page_t *)P2V(metadata_base);
+  chunk_initialized = (uint64_t *)P2V(metadata_base + metadata_size);
+  memset(chunk_initialized, 0, bitmap_size);
+  // Remember the usable regions. We are the only running core thus there is
+  // no need to lock anything.
+  for (uint64_t i = 0; i < memory_map->entry_count; i++) {
+    const struct limine_memmap_entry *entry = memory_map->entries[i];
+    if (entry->type != LIMINE_MEMMAP_USABLE)
+      continue;
+    struct unseeded_range range = {
+        .start = entry->base / PAGE_SIZE,
+        .end = (entry->base + entry->length) / PAGE_SIZE,
+    };
+    if (entry == metadata_entry) // skip the metadata
+      range.start += (metadata_size + bitmap_size) / PAGE_SIZE;
+    if (range.start == range.end)
+      continue;
+    total_usable_pages += range.end - range.start;
+    if (unseeded_range_count < MAX_UNSEEDED_RANGES) {
+      unseeded_ranges[unseeded_range_count++] = range;
+    } else { // no space to keep it; seed it right now
+      while (range.start < range.end)
+        seed_chunk(&range);
     }
   }
   // Log
-  kprintf("Memory initialized with %lu free pages\n", total_free_pages);
+  kprintf("Memory initialized with %lu free pages\n", total_usable_pages);
+}
+
+/**
+ * Moves a batch of pages from the buddy allocator into the magazine of this
+ * core. Interrupts must be disabled. The magazine might still be empty after
+ * this function if we are out of memory.
+ */
+static void magazine_refill(struct page_magazine *magazine) {
+  spinlock_lock(&freepages_lock);
+  while (magazine->count < PAGE_MAGAZINE_BATCH) {
+    struct page_t *page = buddy_alloc(0);
+    if (page == NULL)
+      break;
+    magazine->pages[magazine->count++] = page_address(page);
+  }
+  spinlock_unlock(&freepages_lock);
+  magazine->refills++;
+}
+
+/**
+ * Moves a batch of pages from the magazine of this core back to the buddy
+ * allocator. Interrupts must be disabled.
+ */
+static void magazine_drain(struct page_magazine *magazine) {
+  spinlock_lock(&freepages_lock);
+  while (magazine->count > PAGE_MAGAZINE_SIZE - PAGE_MAGAZINE_BATCH)
+    buddy_free(page_of(magazine->pages[--magazine->count]), 0);
+  spinlock_unlock(&freepages_lock);
+  magazine->drains++;
 }
 
 /**
@@ -58,17 +346,76 @@ void init_mem(uint64_t hhdm_offset_local,
 void kfree(void *page) {
   // Some sanity checks
   const uint64_t physical_address = V2P(page);
-  if (physical_address % PAGE_SIZE != 0)
+  if (physical_address % PAGE_SIZE != 0 ||
+      physical_address / PAGE_SIZE >= page_count)
     panic("kfree");
-  // Lock the list
-  spinlock_lock(&freepages_lock);
+#ifdef DEBUG_MEM
   // Fill with junk to catch dangling refs.
-  //memset(page, 1, PAGE_SIZE);
-  // In this page, we only store the reference to next page
-  struct freepage_t *current_page = (struct freepage_t *)page;
-  current_page->next = freepages;
-  freepages = current_page;
-  spinlock_unlock(&freepages_lock);
+  memset(page, 1, PAGE_SIZE);
+#endif
+  // The magazine is local to this core. We only need to make sure that an
+  // interrupt handler does not use it while we are working with it.
+  save_and_disable_interrupts();
+  struct page_magazine *magazine = &cpu_local()->page_magazine;
+  if (magazine->count == PAGE_MAGAZINE_SIZE)
+    magazine_drain(magazine);
+  magazine->pages[magazine->count++] = page;
+  restore_interrupts();
+}
+
+/**
+ * Takes a page from the zeroed pool of this core. Returns NULL if the pool is
+ * empty.
+ */
+static void *zero_pool_pop(void) {
+  struct page_t *page = NULL;
+  save_and_disable_interrupts();
+  struct zeroed_pool *pool = &cpu_local()->zeroed_pool;
+  if (pool->head != NULL) {
+    page = pool->head;
+    pool->head = page->next;
+    pool->count--;
+  }
+  restore_interrupts();
+  if (page == NULL)
+    return NULL;
+  // The new owner will dirty the page
+  page->next = NULL;
+  page->flags &= ~PAGE_FLAG_ZEROED;
+  return page_address(page);
+}
+
+/**
+ * Zeroes some free pages ahead of time and puts them in the zeroed pool of
+ * this core. This must be called when the CPU has nothing better to do (for
+ * example, when the scheduler has no runnable process).
+ */
+void kalloc_zero_idle_pages(void) {
+  struct zeroed_pool *pool = &cpu_local()->zeroed_pool;
+  // Zero a batch of pages and then add all of them to the pool at once
+  struct page_t *head = NULL, *tail = NULL;
+  uint32_t count = 0;
+  while (count < ZERO_POOL_BATCH && pool->count + count < ZERO_POOL_TARGET) {
+    // Do not steal from the page cache only to zero the page
+    void *page = kalloc_for_page_cache();
+    if (page == NULL)
+      break;
+    memset(page, 0, PAGE_SIZE);
+    struct page_t *metadata = page_of(page);
+    metadata->flags |= PAGE_FLAG_ZEROED;
+    metadata->next = head;
+    head = metadata;
+    if (tail == NULL)
+      tail = metadata;
+    count++;
+  }
+  if (count == 0)
+    return;
+  save_and_disable_interrupts();
+  tail->next = pool->head;
+  pool->head = head;
+  pool->count += count;
+  restore_interrupts();
 }
 
 /**
@@ -76,16 +423,19 @@ void kfree(void *page) {
  * Will return NULL if we are out of space.
  */
 void *kalloc_for_page_cache(void) {
-  spinlock_lock(&freepages_lock);
   void *page = NULL;
-  if (freepages != NULL) { // OOM check
-    // Allocate one page
-    page = freepages;
-    freepages = freepages->next;
-    // We do not need to "overwrite" the page because it will be
-    // overwritten just after.
-  }
-  spinlock_unlock(&freepages_lock);
+  save_and_disable_interrupts();
+  struct page_magazine *magazine = &cpu_local()->page_magazine;
+  if (magazine->count == 0)
+    magazine_refill(magazine);
+  if (magazine->count != 0) // OOM check
+    page = magazine->pages[--magazine->count];
+  // We do not need to "overwrite" the page because it will be
+  // overwritten just after.
+  restore_interrupts();
+  // The zeroed pages are free pages as well
+  if (page == NULL)
+    page = zero_pool_pop();
   return page;
 }
 
@@ -98,18 +448,170 @@ void *kalloc(void) {
   // Try to allocate a page from the page cache if needed
   if (page == NULL)
     page = pagecache_steal();
+  if (page == NULL)
+    MEM_COUNTER_ADD(kalloc_failures, 1);
+#ifdef DEBUG_MEM
   // Safely: Override with gibberish to see these pattern in the gdb
   if (page != NULL)
     memset(page, 2, PAGE_SIZE);
+#endif
   return page;
 }
 
 /**
- * Same as kalloc but writes all zero to the page
+ * Allocates 2^order physically contiguous pages. Returns the virtual address of
+ * the first page or NULL if there is no free block big enough.
+ *
+ * Unlike kalloc, pages are not stolen from the page cache because the page
+ * cache frames are not contiguous.
+ */
+void *kalloc_pages(int order) {
+  if (order < 0 || order >= PAGE_MAX_ORDER)
+    panic("kalloc_pages: order");
+  if (order == 0)
+    return kalloc();
+  spinlock_lock(&freepages_lock);
+  struct page_t *page = buddy_alloc(order);
+  spinlock_unlock(&freepages_lock);
+  if (page == NULL) {
+    MEM_COUNTER_ADD(kalloc_failures, 1);
+    return NULL;
+  }
+  void *result = page_address(page);
+#ifdef DEBUG_MEM
+  // Safely: Override with gibberish to see these pattern in the gdb
+  memset(result, 2, PAGE_SIZE << order);
+#endif
+  return result;
+}
+
+/**
+ * Frees 2^order pages which were allocated with kalloc_pages(order).
+ */
+void kfree_pages(void *page, int order) {
+  if (order < 0 || order >= PAGE_MAX_ORDER)
+    panic("kfree_pages: order");
+  if (order == 0) {
+    kfree(page);
+    return;
+  }
+  if (V2P(page) % (PAGE_SIZE << order) != 0)
+    panic("kfree_pages: align");
+  spinlock_lock(&freepages_lock);
+  buddy_free(page_of(page), order);
+  spinlock_unlock(&freepages_lock);
+}
+
+/**
+ * Adds an owner to a block of pages. The block must be freed with kpage_put
+ * by each of its owners.
+ */
+void kpage_share(void *page) {
+  __atomic_add_fetch(&page_of(page)->share_count, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Does this block of pages have more than one owner?
+ */
+bool kpage_shared(const void *page) {
+  return __atomic_load_n(&page_of(page)->share_count, __ATOMIC_ACQUIRE) != 0;
+}
+
+/**
+ * Drops one owner of a block of 2^order pages. The block is freed once its
+ * last owner drops it.
+ */
+void kpage_put(void *page, int order) {
+  struct page_t *metadata = page_of(page);
+  uint32_t shares = __atomic_load_n(&metadata->share_count, __ATOMIC_ACQUIRE);
+  while (shares != 0) {
+    if (__atomic_compare_exchange_n(&metadata->share_count, &shares,
+                                    shares - 1, false, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_ACQUIRE))
+      return;
+  }
+  kfree_pages(page, order);
+}
+
+/**
+ * Same as kalloc but the page is all zero. Pages which are zeroed ahead of time
+ * are preferred in order to skip the memset.
  */
 void *kcalloc(void) {
-  void *page = kalloc();
+  void *page = zero_pool_pop();
+  if (page != NULL)
+    return page;
+  page = kalloc();
   if (page != NULL)
     memset(page, 0, PAGE_SIZE);
   return page;
+}
+
+/**
+ * Takes a snapshot of the memory counters. The counters of other cores are
+ * read without any lock thus the result is only approximate.
+ */
+void kalloc_stats(struct mem_stats *stats) {
+  memset(stats, 0, sizeof(*stats));
+  stats->total_pages = total_usable_pages;
+  // Pages in the buddy allocator and the pages which are not seeded yet
+  spinlock_lock(&freepages_lock);
+  stats->free_pages = buddy_free_pages;
+  for (uint64_t i = next_unseeded_range; i < unseeded_range_count; i++)
+    stats->free_pages += unseeded_ranges[i].end - unseeded_ranges[i].start;
+  spinlock_unlock(&freepages_lock);
+  // Per core stuff
+  for (int i = 0; i < MAX_CORES; i++) {
+    const struct cpu_local_data *cpu = cpu_local_of(i);
+    if (cpu == NULL)
+      break;
+    stats->free_pages +=
+        __atomic_load_n(&cpu->page_magazine.count, __ATOMIC_RELAXED);
+    // The zeroed pages are free pages as well
+    const uint32_t zeroed =
+        __atomic_load_n(&cpu->zeroed_pool.count, __ATOMIC_RELAXED);
+    stats->zeroed_pages += zeroed;
+    stats->free_pages += zeroed;
+    stats->magazine_refills +=
+        __atomic_load_n(&cpu->page_magazine.refills, __ATOMIC_RELAXED);
+    stats->magazine_drains +=
+        __atomic_load_n(&cpu->page_magazine.drains, __ATOMIC_RELAXED);
+    const struct mem_counters *counters = &cpu->mem_counters;
+    stats->counters.kalloc_failures +=
+        __atomic_load_n(&counters->kalloc_failures, __ATOMIC_RELAXED);
+    stats->counters.pagetable_pages +=
+        __atomic_load_n(&counters->pagetable_pages, __ATOMIC_RELAXED);
+    stats->counters.pagecache_resident +=
+        __atomic_load_n(&counters->pagecache_resident, __ATOMIC_RELAXED);
+    stats->counters.pagecache_dirty +=
+        __atomic_load_n(&counters->pagecache_dirty, __ATOMIC_RELAXED);
+    stats->counters.pagecache_evictions +=
+        __atomic_load_n(&counters->pagecache_evictions, __ATOMIC_RELAXED);
+    stats->counters.pagecache_steals +=
+        __atomic_load_n(&counters->pagecache_steals, __ATOMIC_RELAXED);
+    stats->counters.pagecache_writebacks +=
+        __atomic_load_n(&counters->pagecache_writebacks, __ATOMIC_RELAXED);
+    stats->counters.pagecache_hits +=
+        __atomic_load_n(&counters->pagecache_hits, __ATOMIC_RELAXED);
+    stats->counters.pagecache_misses +=
+        __atomic_load_n(&counters->pagecache_misses, __ATOMIC_RELAXED);
+    stats->counters.pagecache_lookup_cycles +=
+        __atomic_load_n(&counters->pagecache_lookup_cycles, __ATOMIC_RELAXED);
+    stats->counters.pagecache_readahead_pages +=
+        __atomic_load_n(&counters->pagecache_readahead_pages, __ATOMIC_RELAXED);
+    stats->counters.pagecache_readahead_hits +=
+        __atomic_load_n(&counters->pagecache_readahead_hits, __ATOMIC_RELAXED);
+    stats->counters.pagecache_ghost_hits +=
+        __atomic_load_n(&counters->pagecache_ghost_hits, __ATOMIC_RELAXED);
+    stats->counters.filemap_resident +=
+        __atomic_load_n(&counters->filemap_resident, __ATOMIC_RELAXED);
+    stats->counters.filemap_hits +=
+        __atomic_load_n(&counters->filemap_hits, __ATOMIC_RELAXED);
+    stats->counters.filemap_misses +=
+        __atomic_load_n(&counters->filemap_misses, __ATOMIC_RELAXED);
+    stats->counters.process_pool_hits +=
+        __atomic_load_n(&counters->process_pool_hits, __ATOMIC_RELAXED);
+    stats->counters.process_pool_misses +=
+        __atomic_load_n(&counters->process_pool_misses, __ATOMIC_RELAXED);
+  }
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 #pragma once
 #ifndef __ASSEMBLER__
 #include "limine.h"
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #endif
@@ -15,6 +16,11 @@
  */
 #define PAGE_ROUND_UP(sz) (((sz)+PAGE_SIZE-1) & ~(PAGE_SIZE-1))
 
+/**
+ * Gets the lower boundry of the page which we are trying to access.
+ */
+#define PAGE_ROUND_DOWN(a) ((a) & ~(PAGE_SIZE - 1))
+
 #ifndef __ASSEMBLER__
 /**
  * The HHDM offset with current Limine works with. Defined in mem.c
@@ -33,10 +39,170 @@ extern volatile uint64_t hhdm_offset;
  */
 #define P2V(ptr) ((uint64_t)(ptr) + (hhdm_offset))
 
+/**
+ * The buddy allocator can allocate blocks of 2^0 to 2^(PAGE_MAX_ORDER-1)
+ * contiguous pages. 2^9 pages is 2MB which is the size of a huge page.
+ */
+#define PAGE_MAX_ORDER 10
+
+/**
+ * Number of free pages which each CPU core can keep in its local cache
+ */
+#define PAGE_MAGAZINE_SIZE 64
+
+/**
+ * Number of pages moved between the global free list and a local cache in
+ * each refill or drain.
+ */
+#define PAGE_MAGAZINE_BATCH (PAGE_MAGAZINE_SIZE / 2)
+
+/**
+ * A small per-CPU stack of free pages which sits in front of the global free
+ * list. Allocations and frees are served from here without any shared lock
+ * and the global list is only touched in batches.
+ */
+struct page_magazine {
+  // The free pages in this magazine. Only the first count pages are valid.
+  void *pages[PAGE_MAGAZINE_SIZE];
+  // Number of pages in this magazine
+  uint32_t count;
+  // How many times we have refilled this magazine from the global list
+  uint64_t refills;
+  // How many times we have drained this magazine into the global list
+  uint64_t drains;
+};
+
+/**
+ * Free pages of a CPU core which are zeroed ahead of time. The scheduler of the
+ * core fills this pool when there is nothing to run and kcalloc takes the pages
+ * from here in order to skip zeroing them on the hot path. The pages are linked
+ * with the next field of their metadata and all of them have the
+ * PAGE_FLAG_ZEROED flag.
+ */
+struct zeroed_pool {
+  // The first page in this pool or NULL if it's empty
+  struct page_t *head;
+  // Number of pages in this pool
+  uint32_t count;
+};
+
+/**
+ * Memory counters of a single CPU core. Each core only adds to its own
+ * counters and the readers sum the counters of all cores. Gauges (like the
+ * resident pages) might be incremented on one core and decremented on another;
+ * Because of the unsigned wrap around, the sum is still correct.
+ */
+struct mem_counters {
+  // Number of kalloc/kalloc_pages calls which returned NULL
+  uint64_t kalloc_failures;
+  // Number of pages used as page tables
+  uint64_t pagetable_pages;
+  // Number of pages which hold a disk block in the page cache
+  uint64_t pagecache_resident;
+  // Number of pages in the page cache which are not written back yet
+  uint64_t pagecache_dirty;
+  // Number of pages evicted from the page cache
+  uint64_t pagecache_evictions;
+  // Number of page cache pages given back to kalloc
+  uint64_t pagecache_steals;
+  // Number of dirty pages written back to the disk
+  uint64_t pagecache_writebacks;
+  // Number of page cache lookups which found the block or not, and the TSC
+  // cycles spent looking up the blocks and free entries
+  uint64_t pagecache_hits;
+  uint64_t pagecache_misses;
+  uint64_t pagecache_lookup_cycles;
+  // Number of pages read ahead and how many of them were used afterwards
+  uint64_t pagecache_readahead_pages;
+  uint64_t pagecache_readahead_hits;
+  // Number of page cache misses on blocks which were evicted recently
+  uint64_t pagecache_ghost_hits;
+  // Number of file pages in the file page cache (fs/filemap.c)
+  uint64_t filemap_resident;
+  // Number of file page lookups which were found in the cache or not
+  uint64_t filemap_hits;
+  uint64_t filemap_misses;
+  // Number of new processes which got a warm page table from the process
+  // pool or built a new one (userspace/proc.c)
+  uint64_t process_pool_hits;
+  uint64_t process_pool_misses;
+};
+
+/**
+ * Adds a value to one of the memory counters of the current core. cpu/smp.h
+ * must be included.
+ */
+#define MEM_COUNTER_ADD(counter, value)                                        \
+  (cpu_local()->mem_counters.counter += (uint64_t)(value))
+
+/**
+ * A snapshot of the memory counters of the whole system
+ */
+struct mem_stats {
+  // Number of usable pages in the system
+  uint64_t total_pages;
+  // Number of free pages (including the seeded, cached and zeroed pages)
+  uint64_t free_pages;
+  // Number of free pages which are zeroed ahead of time
+  uint64_t zeroed_pages;
+  // Page magazine refills and drains of all cores
+  uint64_t magazine_refills;
+  uint64_t magazine_drains;
+  // Sum of the mem_counters of all cores
+  struct mem_counters counters;
+};
+
+// Defined in slab.h
+struct kmem_cache;
+
+/**
+ * Metadata of each physical frame in the system. The metadata of the frame
+ * with physical address pa is stored in the pa / PAGE_SIZE entry of an array
+ * managed by mem.c.
+ */
+struct page_t {
+  // Next block in the free list of the buddy allocator or the next slab in
+  // the list of slabs of a cache
+  struct page_t *next;
+  // Previous block in the same list as next
+  struct page_t *prev;
+  // If this page belongs to a slab, this is the cache which owns it.
+  // Otherwise, NULL.
+  struct kmem_cache *slab_cache;
+  // First free object of the slab. Only valid on the first page of a slab.
+  void *slab_freelist;
+  // Number of allocated objects of the slab. Only valid on the first page of
+  // a slab.
+  uint16_t slab_in_use;
+  // The order of the block which this page is the head of (either free or
+  // allocated)
+  uint8_t order;
+  // PAGE_FLAG_ flags
+  uint8_t flags;
+  // Number of owners of this block besides the first one. Frames which are
+  // shared copy-on-write between processes have a non-zero share count.
+  uint32_t share_count;
+};
+
+// This page is the head of a free block in the buddy allocator
+#define PAGE_FLAG_FREE (1 << 0)
+// This page is known to contain only zeros. Pages lose this flag as soon as
+// they are allocated because the owner might write to them.
+#define PAGE_FLAG_ZEROED (1 << 1)
+
 void init_mem(uint64_t hhdm_offset,
               const struct limine_memmap_response *memory_map);
 void kfree(void *page);
 void *kalloc(void);
 void *kalloc_for_page_cache(void);
 void *kcalloc(void);
+void *kalloc_pages(int order);
+void kfree_pages(void *page, int order);
+void kpage_share(void *page);
+bool kpage_shared(const void *page);
+void kpage_put(void *page, int order);
+struct page_t *page_of(const void *address);
+void *page_address(const struct page_t *page);
+void kalloc_zero_idle_pages(void);
+void kalloc_stats(struct mem_stats *stats);
 #endif
\ No newline at end of file
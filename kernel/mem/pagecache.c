@@ -2,8 +2,12 @@
 #include "common/lib.h"
 #include "common/printf.h"
 #include "common/spinlock.h"
+#include "cpu/asm.h"
+#include "cpu/smp.h"
 #include "device/nvme.h"
+#include "device/rtc.h"
 #include "mem.h"
+#include "slab.h"
 
 /**
  * The page cache. It sits between the file system and the disk.
@@ -14,30 +18,58 @@
  * It provides a transparent interface which can be used instead of accessing
  * the disk itself.
  *
- * Internally, it uses Clock algorithm to evict pages. It keeps a circular
- * buffer of pagecache_entries. The memory manager might call pagecache_steal at
- * any time in order to repurpose one of page cache pages into a normal memory
- * page (if the system is under the pressure). We should have a list of
- * pagecache_entries somewhere; i use each physical frame in order to handle a
- * list of entries. Each frame contains a lot of pagecache_entries and also a
- * pointer to the next frame.
+ * Internally, it uses the 2Q algorithm to evict pages. The memory manager
+ * might call pagecache_steal at any time in order to repurpose one of page
+ * cache pages into a normal memory page (if the system is under the pressure).
+ * We should have a list of pagecache_entries somewhere; i use each physical
+ * frame in order to handle a list of entries. Each frame contains a lot of
+ * pagecache_entries and also a pointer to the next frame.
  *
  * As the page cache grows, the pagecache_entries must also grow. To this
- * extend, we must get a page from the memory manager (kalloc) which might steal
+ * extend, we must get memory from the memory manager (kalloc) which might steal
  * a page back from the page cache itself! The problem here, however, is that we
  * will deadlock because the kalloc calls back to us. To this extend, a new
  * method which is called kalloc_for_page_cache is added which simply returns
  * NULL if the free page memory manager does not have a free page. This is also
- * used in page cache allocation itself. After that, we can safely release a
- * page which is occupied by cache itself and repurpose that. Note that there
+ * used in page cache allocation itself. The frames of pagecache_entries come
+ * from a slab cache with the SLAB_NO_RECLAIM flag which uses the same method.
+ * After that, we can safely release a page which is occupied by cache itself
+ * and repurpose that. Note that there
  * might be an edge case that involves system running out of the memory. In that
  * case, we simply do not cache and pass through the data in the disk.
  *
- * Dirty pages are not handled perfectly here. In modern operating systems, you
- * "age" the dirty pages and do not allow the dirty pages to fill up more than a
- * portion of your page cache. In this OS, however, we don't give a shit.
- * Bookkeeping dirty pages is WAY above my pay grade and lets just write them
- * back when we want to evict a page.
+ * Dirty pages are kept in a list in the order which they were dirtied. The
+ * scheduler calls pagecache_writeback_worker which writes back the pages which
+ * have been dirty for too long, and the writers are throttled by writing back
+ * the oldest pages if too much of the cache is dirty. sync writes back
+ * everything. Clean pages are simply dropped on eviction.
+ *
+ * pagecache_get gives out references to the cached pages. A referenced page
+ * is never evicted, thus the caller can use it without copying it first. Pages
+ * which are overwritten without being read stay locked until they are put
+ * back, so nobody sees their old data. The page is marked dirty when the
+ * reference is dropped, so a writeback which runs in the middle of a write
+ * is redone.
+ *
+ * Valid entries are found with a hash table keyed by the disk block and the
+ * entries which are not valid are kept in a free list. Thus, neither a lookup
+ * nor finding a free entry has to scan the entries.
+ *
+ * 2Q keeps two queues. New pages go in the a1in queue which is first in first
+ * out, thus a big sequential read only recycles the pages of a1in. When a page
+ * is evicted from a1in, its block is remembered in the ghost list. If the
+ * block is missed again while it is a ghost, it was not a one time access and
+ * it goes in the am queue which is least recently used. Pages are evicted from
+ * a1in while it holds more than 1 / PAGECACHE_A1IN_RATIO of the cache. The
+ * file system tags its metadata blocks which go in am directly and get one
+ * more round in am before being evicted.
+ *
+ * Reads are read ahead. A few streams remember where the last read ahead
+ * ended. A miss right after the end of a stream is sequential and doubles the
+ * window of the stream, while a miss in the pages that a stream has already
+ * read ahead means they were evicted before being used and halves it. Other
+ * misses start a new stream which does not read ahead at all. The pages of a
+ * window are read with a single NVMe command straight into their frames.
  *
  * Note to myself: The NVMe driver sucks ass and it's fucking blocking :)))))
  * Thus, no need to do sleep lock I guess?
@@ -57,12 +89,45 @@ struct pagecache_entry {
   bool dirty;
   // True if this entry is valid, otherwise false
   bool valid;
-  // Clock algorithm shenanigans
+  // Is this a metadata block of the file system?
+  bool metadata;
+  // Metadata entries are moved back to the head of am once instead of being
+  // evicted. Set if this has been done since the last access.
   bool second_chance;
+  // Was this entry read ahead and has not been used yet?
+  bool readahead;
+  // Number of the pagecache_get callers which use this entry. Referenced
+  // entries are never evicted.
+  uint32_t references;
+  // Set if a caller of pagecache_get which overwrites the page holds the lock
+  // until pagecache_put
+  bool overwriting;
+  // If valid, the next entry in the same hash bucket. Otherwise, the next
+  // entry in the free list.
+  struct pagecache_entry *next;
+  // The list of dirty entries. Only valid if dirty is set.
+  struct pagecache_entry *dirty_next;
+  struct pagecache_entry *dirty_prev;
+  // When this entry became dirty (see rtc_now)
+  uint64_t dirtied_at;
+  // The replacement queue which this entry is in (a1in or am) and its
+  // neighbours in it. The queue is NULL if not valid.
+  struct pagecache_queue *queue;
+  struct pagecache_entry *queue_next;
+  struct pagecache_entry *queue_prev;
+};
+
+/**
+ * A queue of entries. The head is the most recently inserted one.
+ */
+struct pagecache_queue {
+  struct pagecache_entry *head, *tail;
+  uint32_t count;
 };
 
 // Number of pages which can go into pagecache_entries
-#define PAGECACHE_ENTRY_COUNT 170
+#define PAGECACHE_ENTRY_COUNT                                                  \
+  ((PAGE_SIZE - sizeof(void *)) / sizeof(struct pagecache_entry))
 
 // A frame which contains the list of page cache entries
 struct pagecache_entries {
@@ -82,14 +147,294 @@ _Static_assert(
 // kalloc to allocate it when we can just use a global variable?
 static struct pagecache_entries first_pagecache_entries = {0};
 
-// We gotta lock the pagecache entries huh?
+// Where we allocate the pagecache_entries from
+static struct kmem_cache *pagecache_entries_cache;
+
+// The last frame of the list of entries. New frames are added after it.
+static struct pagecache_entries *last_pagecache_entries =
+    &first_pagecache_entries;
+
+// log2 of the number of buckets in the hash table of the entries
+#define PAGECACHE_BUCKET_BITS 14
+
+// Number of buckets in the hash table of the entries. It is big enough to
+// keep the chains short with tens of thousands of cached pages.
+#define PAGECACHE_BUCKETS (1U << PAGECACHE_BUCKET_BITS)
+
+// The hash table of the valid entries
+static struct pagecache_entry *pagecache_buckets[PAGECACHE_BUCKETS];
+
+// The list of the entries which are not valid
+static struct pagecache_entry *free_entries;
+
+// Both ends of the list of dirty entries. The head was dirtied first.
+static struct pagecache_entry *dirty_head, *dirty_tail;
+
+// Number of valid entries and the number of dirty entries
+static uint32_t cached_pages, dirty_pages;
+
+// Dirty pages are written back by pagecache_writeback_worker after this many
+// milliseconds
+#define PAGECACHE_DIRTY_EXPIRE_MS 5000
+
+// How often the pagecache_writeback_worker looks for expired dirty pages
+#define PAGECACHE_WRITEBACK_INTERVAL_MS 1000
+
+// At most 1 / PAGECACHE_DIRTY_RATIO of the cached pages can be dirty. But we
+// always allow PAGECACHE_DIRTY_MIN dirty pages, thus a small cache does not
+// write back on each write.
+#define PAGECACHE_DIRTY_RATIO 4
+#define PAGECACHE_DIRTY_MIN 64
+
+// When pagecache_writeback_worker should look for expired pages again
+static uint64_t next_writeback;
+
+// Number of the sequential streams which we keep track of
+#define PAGECACHE_READAHEAD_STREAMS 8
+
+// Maximum number of pages read at once. This is the biggest NVMe transfer.
+#define PAGECACHE_READAHEAD_MAX 32
+
+/**
+ * A sequential reader. The pages in [start, next_block) were read ahead last
+ * time. A miss on next_block or in the window after it continues the stream.
+ */
+struct readahead_stream {
+  uint32_t start;
+  uint32_t next_block;
+  // Number of the pages to read on the next miss. Zero if unused.
+  uint32_t window;
+  // When this stream was used the last time, for replacement
+  uint64_t last_used;
+};
+
+// The streams and a counter which orders their uses
+static struct readahead_stream readahead_streams[PAGECACHE_READAHEAD_STREAMS];
+static uint64_t readahead_clock;
+
+// We gotta lock the pagecache entries huh? This lock guards the hash table,
+// the free list and the dirty list as well.
 static struct spinlock pagecache_entries_lock;
 
-// Which entry should be evicted next?
-static struct {
-  struct pagecache_entries *entry_frames;
-  int entry_index;
-} next_eviction_victim;
+// The queues of 2Q. a1in holds the pages which were accessed once and am
+// holds the pages which were accessed again after being evicted.
+static struct pagecache_queue a1in, am;
+
+// Pages are evicted from a1in if it holds more than 1 / PAGECACHE_A1IN_RATIO
+// of the cached pages.
+#define PAGECACHE_A1IN_RATIO 4
+
+// Number of the blocks which are remembered after being evicted from a1in
+#define PAGECACHE_GHOST_COUNT 4096
+
+// log2 of the number of buckets in the hash table of the ghosts
+#define PAGECACHE_GHOST_BUCKET_BITS 10
+
+/**
+ * A block which was evicted from a1in recently
+ */
+struct pagecache_ghost {
+  uint32_t block;
+  bool valid;
+  // Next ghost in the same hash bucket
+  struct pagecache_ghost *next;
+};
+
+// The ghosts are a ring which the oldest ghost is replaced in. They are also
+// in a hash table to be found quickly.
+static struct pagecache_ghost ghosts[PAGECACHE_GHOST_COUNT];
+static struct pagecache_ghost *ghost_buckets[1U << PAGECACHE_GHOST_BUCKET_BITS];
+static uint32_t ghost_hand;
+
+/**
+ * Gets the hash bucket of a disk block
+ */
+static inline struct pagecache_entry **bucket_of(uint32_t disk_block) {
+  return &pagecache_buckets[(disk_block * 2654435761U) >>
+                            (32 - PAGECACHE_BUCKET_BITS)];
+}
+
+/**
+ * Finds the valid entry of a disk block or returns NULL.
+ * pagecache_entries_lock must be held.
+ */
+static struct pagecache_entry *hash_lookup(uint32_t disk_block) {
+  struct pagecache_entry *entry;
+  for (entry = *bucket_of(disk_block); entry != NULL; entry = entry->next)
+    if (entry->disk_block == disk_block)
+      break;
+  return entry;
+}
+
+/**
+ * Adds a valid entry to the hash table. pagecache_entries_lock must be held.
+ */
+static void hash_insert(struct pagecache_entry *entry) {
+  struct pagecache_entry **bucket = bucket_of(entry->disk_block);
+  entry->next = *bucket;
+  *bucket = entry;
+}
+
+/**
+ * Removes an entry from the hash table. pagecache_entries_lock must be held.
+ */
+static void hash_remove(struct pagecache_entry *entry) {
+  struct pagecache_entry **link = bucket_of(entry->disk_block);
+  while (*link != entry)
+    link = &(*link)->next;
+  *link = entry->next;
+}
+
+/**
+ * Marks an entry dirty and puts it at the end of the dirty list if it is not
+ * dirty already. pagecache_entries_lock must be held.
+ */
+static void dirty_list_add(struct pagecache_entry *entry) {
+  if (entry->dirty)
+    return;
+  entry->dirty = true;
+  entry->dirtied_at = rtc_now();
+  entry->dirty_next = NULL;
+  entry->dirty_prev = dirty_tail;
+  if (dirty_tail != NULL)
+    dirty_tail->dirty_next = entry;
+  else
+    dirty_head = entry;
+  dirty_tail = entry;
+  dirty_pages++;
+  MEM_COUNTER_ADD(pagecache_dirty, 1);
+}
+
+/**
+ * Marks a dirty entry clean and removes it from the dirty list. The caller
+ * must write back the data of the entry. pagecache_entries_lock must be held.
+ */
+static void dirty_list_remove(struct pagecache_entry *entry) {
+  if (entry->dirty_prev != NULL)
+    entry->dirty_prev->dirty_next = entry->dirty_next;
+  else
+    dirty_head = entry->dirty_next;
+  if (entry->dirty_next != NULL)
+    entry->dirty_next->dirty_prev = entry->dirty_prev;
+  else
+    dirty_tail = entry->dirty_prev;
+  entry->dirty = false;
+  dirty_pages--;
+  MEM_COUNTER_ADD(pagecache_dirty, -1);
+}
+
+/**
+ * Puts an entry at the head of a queue. pagecache_entries_lock must be held.
+ */
+static void queue_push(struct pagecache_queue *queue,
+                       struct pagecache_entry *entry) {
+  entry->queue = queue;
+  entry->queue_prev = NULL;
+  entry->queue_next = queue->head;
+  if (queue->head != NULL)
+    queue->head->queue_prev = entry;
+  else
+    queue->tail = entry;
+  queue->head = entry;
+  queue->count++;
+}
+
+/**
+ * Removes an entry from its queue. pagecache_entries_lock must be held.
+ */
+static void queue_remove(struct pagecache_entry *entry) {
+  struct pagecache_queue *queue = entry->queue;
+  if (entry->queue_prev != NULL)
+    entry->queue_prev->queue_next = entry->queue_next;
+  else
+    queue->head = entry->queue_next;
+  if (entry->queue_next != NULL)
+    entry->queue_next->queue_prev = entry->queue_prev;
+  else
+    queue->tail = entry->queue_prev;
+  queue->count--;
+  entry->queue = NULL;
+}
+
+/**
+ * Gets the hash bucket of a ghost block
+ */
+static inline struct pagecache_ghost **ghost_bucket_of(uint32_t block) {
+  return &ghost_buckets[(block * 2654435761U) >>
+                        (32 - PAGECACHE_GHOST_BUCKET_BITS)];
+}
+
+/**
+ * Removes a ghost from its hash bucket
+ */
+static void ghost_unlink(struct pagecache_ghost *ghost) {
+  struct pagecache_ghost **link = ghost_bucket_of(ghost->block);
+  while (*link != ghost)
+    link = &(*link)->next;
+  *link = ghost->next;
+  ghost->valid = false;
+}
+
+/**
+ * Remembers a block which is evicted from a1in. The oldest ghost is forgotten
+ * to make room for it. pagecache_entries_lock must be held.
+ */
+static void ghost_add(uint32_t block) {
+  struct pagecache_ghost *ghost = &ghosts[ghost_hand];
+  ghost_hand = (ghost_hand + 1) % PAGECACHE_GHOST_COUNT;
+  if (ghost->valid)
+    ghost_unlink(ghost);
+  struct pagecache_ghost **bucket = ghost_bucket_of(block);
+  ghost->block = block;
+  ghost->valid = true;
+  ghost->next = *bucket;
+  *bucket = ghost;
+}
+
+/**
+ * Forgets a ghost block. Returns true if the block was a ghost.
+ * pagecache_entries_lock must be held.
+ */
+static bool ghost_take(uint32_t block) {
+  for (struct pagecache_ghost *ghost = *ghost_bucket_of(block); ghost != NULL;
+       ghost = ghost->next)
+    if (ghost->block == block) {
+      ghost_unlink(ghost);
+      return true;
+    }
+  return false;
+}
+
+/**
+ * Puts an entry which is not valid in the free list. pagecache_entries_lock
+ * must be held.
+ */
+static void free_entry_push(struct pagecache_entry *entry) {
+  entry->next = free_entries;
+  free_entries = entry;
+}
+
+/**
+ * Puts every entry of a frame of entries in the free list.
+ * pagecache_entries_lock must be held.
+ */
+static void free_entries_push_frame(struct pagecache_entries *frame) {
+  // Backwards to use the entries in order
+  for (int i = PAGECACHE_ENTRY_COUNT - 1; i >= 0; i--)
+    free_entry_push(&frame->entries[i]);
+}
+
+/**
+ * Creates the caches which the page cache needs
+ */
+void pagecache_init(void) {
+  pagecache_entries_cache =
+      kmem_cache_create("pagecache_entries", sizeof(struct pagecache_entries),
+                        NULL, SLAB_NO_RECLAIM);
+  if (pagecache_entries_cache == NULL)
+    panic("pagecache_init");
+  free_entries_push_frame(&first_pagecache_entries);
+}
 
 /**
  * Just read a single block to a buffer. No fuss or anything.
@@ -105,6 +450,30 @@ static void pagecache_nvme_write(uint32_t block_index, const char *data) {
   nvme_write(block_index, PAGE_SIZE / nvme_block_size(), data);
 }
 
+/**
+ * Finds the entry which should be evicted from a queue. Entries which are
+ * locked or referenced are being used and skipped. Metadata entries are
+ * moved back to the head of am once. pagecache_entries_lock must be held.
+ *
+ * Returns NULL if no entry of the queue can be evicted.
+ */
+static struct pagecache_entry *queue_victim(struct pagecache_queue *queue) {
+  struct pagecache_entry *entry = queue->tail;
+  // Each entry is looked at most once
+  for (uint32_t i = queue->count; i > 0 && entry != NULL; i--) {
+    struct pagecache_entry *prev = entry->queue_prev;
+    if (entry->references == 0 && !spinlock_locked(&entry->lock)) {
+      if (queue != &am || !entry->metadata || entry->second_chance)
+        return entry;
+      entry->second_chance = true;
+      queue_remove(entry);
+      queue_push(&am, entry);
+    }
+    entry = prev;
+  }
+  return NULL;
+}
+
 /**
  * Steal a page from the page cache itself. This function must be called when
  * there is an active lock got on pagecache_entries_lock.
@@ -112,109 +481,61 @@ static void pagecache_nvme_write(uint32_t block_index, const char *data) {
  * Will return NULL if the memory is full. Returns the virtual address.
  */
 static void *pagecache_do_steal(void) {
-  if (next_eviction_victim.entry_frames == NULL)
-    panic("next_eviction_victim.entry_frame is null");
-  // How many time we looped around?
-  int wrap_around_counter = 0;
-  // Do the clock algorithm
-  while (true) {
-    // Move the pointer one forward
-    if (next_eviction_victim.entry_index == PAGECACHE_ENTRY_COUNT - 1) {
-      next_eviction_victim.entry_index = 0;
-      next_eviction_victim.entry_frames =
-          next_eviction_victim.entry_frames->next_entries;
-      if (next_eviction_victim.entry_frames == NULL) {
-        next_eviction_victim.entry_frames = &first_pagecache_entries;
-        // Wrap other way around
-        wrap_around_counter++;
-        if (wrap_around_counter > 2) {
-          // No free pages. We have given each page a second change at least one
-          return NULL;
-        }
-      }
-    } else {
-      next_eviction_victim.entry_frames++;
-    }
-    // We don't need locks here. We have a lock on pagecache_entries_lock
-    // which is a superlock
-    struct pagecache_entry *current_frame =
-        &next_eviction_victim.entry_frames
-             ->entries[next_eviction_victim.entry_index];
-    // Is this even valid?
-    if (!current_frame->valid)
-      continue;
-    // Did this page had its second chance?
-    if (current_frame->second_chance) { // found one!
-      current_frame->valid = false;
-      // Write back data
-      // TODO: This can be probably handled better in terms of the locks
-      pagecache_nvme_write(current_frame->disk_block, current_frame->cache);
-      // Done
-      return current_frame->cache;
-    }
-    current_frame->second_chance = true;
+  // Which queue should we evict from?
+  struct pagecache_entry *victim = NULL;
+  if (a1in.count > MAX_SAFE(cached_pages / PAGECACHE_A1IN_RATIO, 1U))
+    victim = queue_victim(&a1in);
+  if (victim == NULL)
+    victim = queue_victim(&am);
+  if (victim == NULL)
+    victim = queue_victim(&a1in);
+  if (victim == NULL) // everything is in use
+    return NULL;
+  if (victim->queue == &a1in)
+    ghost_add(victim->disk_block);
+  queue_remove(victim);
+  victim->valid = false;
+  hash_remove(victim);
+  free_entry_push(victim);
+  cached_pages--;
+  // Write back data if it is dirty. Clean pages are already on the disk.
+  // TODO: This can be probably handled better in terms of the locks
+  if (victim->dirty) {
+    dirty_list_remove(victim);
+    pagecache_nvme_write(victim->disk_block, victim->cache);
+    MEM_COUNTER_ADD(pagecache_writebacks, 1);
   }
+  MEM_COUNTER_ADD(pagecache_resident, -1);
+  MEM_COUNTER_ADD(pagecache_evictions, 1);
+  return victim->cache;
 }
 
 /**
- * Gets the page cache entry which corresponds with the given block.
- * The entry might be created if it does not exists and populated if needed.
- * The entry will be locked upon returning.
+ * Creates a valid entry for a block which is not in the cache. The data of
+ * the entry is not populated. pagecache_entries_lock must be held.
  *
- * This function might return NULL if the memory is filled.
+ * Returns NULL if the memory is filled.
  */
-static struct pagecache_entry *
-get_pagecache_entry_of_index(uint32_t block_index, bool populate) {
-  struct pagecache_entry *entry = NULL;
-  /**
-   * Should we populate this page at the very end just before returning?
-   * At first we assume that the page exists so we do not need to populate from
-   * the disk. However, if the page does not exists, we set this value to
-   * populate from the argument to argument at last.
-   */
-  bool should_populate = false;
-  // Lock the list to traverse it
-  spinlock_lock(&pagecache_entries_lock);
-
-  struct pagecache_entries *current_entries = &first_pagecache_entries;
-  struct pagecache_entry *free_entry = NULL;
-  while (current_entries != NULL) {
-    for (int i = 0; i < PAGECACHE_ENTRY_COUNT; i++) {
-      // Is this the block we are looking for?
-      if (current_entries->entries[i].valid &&
-          current_entries->entries[i].disk_block == block_index) {
-        entry = &current_entries->entries[i];
-        break;
-      }
-      // Is this block free?
-      if (!current_entries->entries[i].valid)
-        free_entry = &current_entries->entries[i];
-    }
-    // Get next list
-    current_entries = current_entries->next_entries;
-  }
-
-  // Did we find anything?
-  if (entry != NULL) {
-    spinlock_lock(&entry->lock);
-    entry->second_chance = true;
-    goto done;
-  }
-
+static struct pagecache_entry *pagecache_new_entry(uint32_t block_index,
+                                                   bool metadata) {
   // Is there a free entry for it?
+  struct pagecache_entry *free_entry = free_entries;
+  if (free_entry != NULL)
+    free_entries = free_entry->next;
   if (free_entry == NULL) {
     // We have to allocate a new free entry.
-    struct pagecache_entries *new_entries = kalloc_for_page_cache();
+    struct pagecache_entries *new_entries =
+        kmem_cache_alloc(pagecache_entries_cache);
     if (new_entries == NULL) // no free memory
-      goto done;
+      return NULL;
     memset(new_entries, 0, sizeof(struct pagecache_entries));
     // Put it in the list
-    current_entries = &first_pagecache_entries;
-    while (current_entries->next_entries != NULL)
-      current_entries = current_entries->next_entries;
-    current_entries->next_entries = new_entries;
-    // Use a free entry
-    free_entry = &new_entries->entries[0];
+    last_pagecache_entries->next_entries = new_entries;
+    last_pagecache_entries = new_entries;
+    // Use the first entry and keep the rest
+    free_entries_push_frame(new_entries);
+    free_entry = free_entries;
+    free_entries = free_entry->next;
   }
 
   // Try to allocate a page of memory for our entry
@@ -223,45 +544,331 @@ get_pagecache_entry_of_index(uint32_t block_index, bool populate) {
     // Out of memory :(
     // Can we repurpose of our pages?
     free_entry->cache = pagecache_do_steal();
-    if (free_entry->cache) // Well, shit
-      goto done;
+    if (free_entry->cache == NULL) { // Well, shit
+      free_entry_push(free_entry);
+      return NULL;
+    }
   }
+  MEM_COUNTER_ADD(pagecache_resident, 1);
   free_entry->valid = true;
   free_entry->disk_block = block_index;
+  free_entry->metadata = metadata;
   free_entry->second_chance = false;
-  spinlock_lock(&free_entry->lock);
-  entry = free_entry;
-  should_populate = populate;
+  free_entry->readahead = false;
+  hash_insert(free_entry);
+  cached_pages++;
+  // Blocks which are missed again soon after being evicted are hot
+  if (ghost_take(block_index)) {
+    MEM_COUNTER_ADD(pagecache_ghost_hits, 1);
+    queue_push(&am, free_entry);
+  } else if (metadata) {
+    queue_push(&am, free_entry);
+  } else {
+    queue_push(&a1in, free_entry);
+  }
+  return free_entry;
+}
+
+/**
+ * Finds the stream of a missed block and adapts its window. If no stream
+ * matches, the least recently used one is replaced with a new stream which
+ * does not read ahead. step is the number of disk blocks in a page.
+ * pagecache_entries_lock must be held.
+ */
+static struct readahead_stream *readahead_stream_of(uint32_t block_index,
+                                                    uint32_t step) {
+  struct readahead_stream *victim = &readahead_streams[0];
+  for (size_t i = 0; i < PAGECACHE_READAHEAD_STREAMS; i++) {
+    struct readahead_stream *stream = &readahead_streams[i];
+    if (stream->window != 0 && block_index >= stream->next_block &&
+        block_index < stream->next_block + stream->window * step) {
+      // Sequential
+      stream->window = MIN_SAFE(stream->window * 2,
+                                (uint32_t)PAGECACHE_READAHEAD_MAX);
+      stream->last_used = ++readahead_clock;
+      return stream;
+    }
+    if (stream->window != 0 && block_index >= stream->start &&
+        block_index < stream->next_block) {
+      // We read this ahead but it was evicted before being used
+      stream->window = MAX_SAFE(stream->window / 2, 1U);
+      stream->last_used = ++readahead_clock;
+      return stream;
+    }
+    if (stream->last_used < victim->last_used)
+      victim = stream;
+  }
+  victim->window = 1;
+  victim->last_used = ++readahead_clock;
+  return victim;
+}
+
+/**
+ * Creates the entries of the pages which should be read ahead of a missed
+ * entry. readahead[0] must be the missed entry and the new entries are stored
+ * after it and locked. Stops at the first page which is already cached and
+ * at the end of the disk. pagecache_entries_lock must be held.
+ *
+ * If more than two pages are read, a page for the PRP list of the NVMe
+ * command is allocated in prp_list. It cannot be allocated with kalloc while
+ * the entries are locked because kalloc might steal from us. The caller must
+ * free it after the read.
+ *
+ * Returns the number of entries in readahead including the missed one.
+ */
+static uint32_t readahead_prepare(struct pagecache_entry **readahead,
+                                  uint64_t **prp_list) {
+  const uint32_t step = PAGE_SIZE / nvme_block_size();
+  const uint32_t block_index = readahead[0]->disk_block;
+  struct readahead_stream *stream = readahead_stream_of(block_index, step);
+  const uint64_t disk_pages = (nvme_total_blocks() - block_index) / step;
+  uint32_t window = MIN_SAFE((uint64_t)stream->window, disk_pages);
+  *prp_list = NULL;
+  if (window > 2) {
+    *prp_list = kalloc_for_page_cache();
+    if (*prp_list == NULL) // two pages do not need a PRP list
+      window = 2;
+  }
+  uint32_t count = 1;
+  while (count < window) {
+    const uint32_t block = block_index + count * step;
+    if (hash_lookup(block) != NULL)
+      break;
+    struct pagecache_entry *entry = pagecache_new_entry(block, false);
+    if (entry == NULL)
+      break;
+    spinlock_lock(&entry->lock);
+    entry->readahead = true;
+    readahead[count++] = entry;
+  }
+  stream->start = block_index + step;
+  stream->next_block = block_index + count * step;
+  MEM_COUNTER_ADD(pagecache_readahead_pages, count - 1);
+  return count;
+}
+
+/**
+ * Gets the page cache entry which corresponds with the given block.
+ * The entry might be created if it does not exists and populated if needed.
+ * The entry will be referenced and locked upon returning.
+ *
+ * If populate is not set, the new entries are not read from the disk because
+ * the caller overwrites them. If metadata is set, the entry is marked as a
+ * metadata block.
+ *
+ * This function might return NULL if the memory is filled.
+ */
+static struct pagecache_entry *
+get_pagecache_entry_of_index(uint32_t block_index, bool populate,
+                             bool metadata) {
+  /**
+   * The entries which must be read from the disk at the very end just before
+   * returning. The first one is the requested entry and the rest are read
+   * ahead. At first we assume that the page exists so we do not need to
+   * populate anything.
+   */
+  struct pagecache_entry *to_read[PAGECACHE_READAHEAD_MAX];
+  uint32_t to_read_count = 0;
+  uint64_t *prp_list = NULL;
+  // Lock the list to look it up
+  spinlock_lock(&pagecache_entries_lock);
+  const uint64_t lookup_start = get_tsc();
+
+  // Is this block in the cache?
+  struct pagecache_entry *entry = hash_lookup(block_index);
+  MEM_COUNTER_ADD(pagecache_lookup_cycles, get_tsc() - lookup_start);
+  if (entry != NULL) {
+    MEM_COUNTER_ADD(pagecache_hits, 1);
+    spinlock_lock(&entry->lock);
+    entry->second_chance = false;
+    entry->metadata |= metadata;
+    // 2Q does not promote the pages of a1in on hits because they are mostly
+    // accessed a few times in a row. Metadata is always promoted.
+    if (entry->queue == &am || entry->metadata) {
+      queue_remove(entry);
+      queue_push(&am, entry);
+    }
+    if (entry->readahead) {
+      entry->readahead = false;
+      MEM_COUNTER_ADD(pagecache_readahead_hits, 1);
+    }
+    entry->references++;
+    goto done;
+  }
+
+  MEM_COUNTER_ADD(pagecache_misses, 1);
+  entry = pagecache_new_entry(block_index, metadata);
+  if (entry == NULL)
+    goto done;
+  spinlock_lock(&entry->lock);
+  entry->references++;
+  if (!populate) // No need to read the page because it is overwritten
+    goto done;
+  to_read[0] = entry;
+  to_read_count = readahead_prepare(to_read, &prp_list);
 
 // We are done with the list
 done:
   spinlock_unlock(&pagecache_entries_lock);
 
   // Read from the disk if needed
-  if (should_populate)
-    pagecache_nvme_read(block_index, entry->cache);
+  if (to_read_count != 0) {
+    void *frames[PAGECACHE_READAHEAD_MAX];
+    for (uint32_t i = 0; i < to_read_count; i++)
+      frames[i] = to_read[i]->cache;
+    if (!nvme_read_pages(block_index, frames, to_read_count, prp_list)) {
+      // Read the pages one by one to find the one which fails
+      const uint32_t step = PAGE_SIZE / nvme_block_size();
+      for (uint32_t i = 0; i < to_read_count; i++)
+        if (!nvme_read_pages(block_index + i * step, &frames[i], 1, NULL))
+          panic("pagecache: disk read failed");
+    }
+    if (prp_list != NULL)
+      kfree(prp_list);
+    // Only the requested entry stays locked
+    for (uint32_t i = 1; i < to_read_count; i++)
+      spinlock_unlock(&to_read[i]->lock);
+  }
 
   return entry;
 }
 
+/**
+ * Writes back the oldest dirty entry if it was dirtied at or before cutoff.
+ * Returns true if an entry was written back.
+ */
+static bool writeback_one(uint64_t cutoff) {
+  spinlock_lock(&pagecache_entries_lock);
+  struct pagecache_entry *entry = dirty_head;
+  if (entry == NULL || entry->dirtied_at > cutoff) {
+    spinlock_unlock(&pagecache_entries_lock);
+    return false;
+  }
+  // Mark it clean before writing it. If someone writes to it after we unlock
+  // the entry, it is dirtied again.
+  dirty_list_remove(entry);
+  spinlock_lock(&entry->lock);
+  spinlock_unlock(&pagecache_entries_lock);
+  pagecache_nvme_write(entry->disk_block, entry->cache);
+  spinlock_unlock(&entry->lock);
+  MEM_COUNTER_ADD(pagecache_writebacks, 1);
+  return true;
+}
+
+/**
+ * Are there too many dirty pages in the cache?
+ */
+static bool pagecache_too_dirty(void) {
+  spinlock_lock(&pagecache_entries_lock);
+  const bool result =
+      dirty_pages > MAX_SAFE(cached_pages / PAGECACHE_DIRTY_RATIO,
+                             (uint32_t)PAGECACHE_DIRTY_MIN);
+  spinlock_unlock(&pagecache_entries_lock);
+  return result;
+}
+
+/**
+ * Writes back every dirty page in the cache
+ */
+void pagecache_sync(void) {
+  while (writeback_one(UINT64_MAX))
+    ;
+}
+
+/**
+ * Writes back the pages which have been dirty for more than
+ * PAGECACHE_DIRTY_EXPIRE_MS. This is called from the scheduler loop and only
+ * does the work once every PAGECACHE_WRITEBACK_INTERVAL_MS.
+ */
+void pagecache_writeback_worker(void) {
+  const uint64_t now = rtc_now();
+  if (now < next_writeback)
+    return;
+  next_writeback = now + PAGECACHE_WRITEBACK_INTERVAL_MS;
+  if (now < PAGECACHE_DIRTY_EXPIRE_MS)
+    return;
+  while (writeback_one(now - PAGECACHE_DIRTY_EXPIRE_MS))
+    ;
+}
+
+/**
+ * Gets a reference to the cached page of a block. The page stays in the cache
+ * until the reference is dropped with pagecache_put, thus the caller can use
+ * the page (see pagecache_data) directly instead of copying it.
+ *
+ * If populate is not set, a page which is not cached is not read from the
+ * disk and the caller must overwrite all of it. The entry stays locked until
+ * pagecache_put in this case, thus nobody sees or writes back the old data of
+ * the frame in the meantime. metadata must be set if the block holds the
+ * metadata of the file system which is kept in the cache longer than the
+ * data.
+ *
+ * Returns NULL if the memory is filled. The caller must access the disk
+ * directly in this case.
+ */
+struct pagecache_entry *pagecache_get(uint32_t block_index, bool populate,
+                                      bool metadata) {
+  struct pagecache_entry *entry =
+      get_pagecache_entry_of_index(block_index, populate, metadata);
+  if (entry == NULL)
+    return NULL;
+  if (!populate) {
+    entry->overwriting = true;
+    return entry;
+  }
+  // The reference keeps the entry in the cache. The lock is only needed
+  // until the page is populated which is done by now.
+  spinlock_unlock(&entry->lock);
+  return entry;
+}
+
+/**
+ * Gets the data of a page which is referenced with pagecache_get
+ */
+void *pagecache_data(const struct pagecache_entry *entry) {
+  return entry->cache;
+}
+
+/**
+ * Drops a reference which is taken by pagecache_get. dirty must be set if
+ * the caller has written to the page. A page which is written without the
+ * lock is marked dirty here again, thus a writeback which ran in the middle
+ * of the write is redone.
+ */
+void pagecache_put(struct pagecache_entry *entry, bool dirty) {
+  // Unlock before taking pagecache_entries_lock to keep the lock order. Our
+  // reference keeps the entry in the cache until it is marked dirty.
+  if (entry->overwriting) {
+    entry->overwriting = false;
+    spinlock_unlock(&entry->lock);
+  }
+  spinlock_lock(&pagecache_entries_lock);
+  if (entry->references == 0)
+    panic("pagecache_put: unreferenced entry");
+  entry->references--;
+  if (dirty)
+    dirty_list_add(entry);
+  spinlock_unlock(&pagecache_entries_lock);
+  // Do not let the dirty pages fill up the cache
+  if (dirty)
+    while (pagecache_too_dirty())
+      if (!writeback_one(UINT64_MAX))
+        break;
+}
+
 /**
  * Either read a block from the disk and store it in cache or read the
  * block from the cache which is already in the memory.
  */
 void pagecache_read(uint32_t block_index, char *data) {
-  struct pagecache_entry *entry =
-      get_pagecache_entry_of_index(block_index, true);
+  struct pagecache_entry *entry = pagecache_get(block_index, true, false);
   if (entry == NULL) {
     // Just read the page from the disk. No passthrough
     pagecache_nvme_read(block_index, data);
     return;
   }
-  entry->second_chance = false;
-  // Copy back data. No zero copy and I see why Linux allows zero copy with
-  // direct IO only :(
   memcpy(data, entry->cache, PAGE_SIZE);
-  // We done with this entry and unlock it
-  spinlock_unlock(&entry->lock);
+  pagecache_put(entry, false);
 }
 
 /**
@@ -269,19 +876,14 @@ void pagecache_read(uint32_t block_index, char *data) {
  * to be written back later on.
  */
 void pagecache_write(uint32_t block_index, const char *data) {
-  struct pagecache_entry *entry =
-      get_pagecache_entry_of_index(block_index, false);
+  struct pagecache_entry *entry = pagecache_get(block_index, false, false);
   if (entry == NULL) {
     // Just write the page to the disk. No passthrough
     pagecache_nvme_write(block_index, data);
     return;
   }
-  entry->second_chance = false;
-  entry->dirty = true;
-  // Copy data to cache
   memcpy(entry->cache, data, PAGE_SIZE);
-  // We done with this entry and unlock it
-  spinlock_unlock(&entry->lock);
+  pagecache_put(entry, true);
 }
 
 /**
@@ -292,5 +894,7 @@ void *pagecache_steal(void) {
   spinlock_lock(&pagecache_entries_lock);
   void *result = pagecache_do_steal();
   spinlock_unlock(&pagecache_entries_lock);
+  if (result != NULL)
+    MEM_COUNTER_ADD(pagecache_steals, 1);
   return result;
 }
\ No newline at end of file
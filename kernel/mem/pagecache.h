@@ -3,6 +3,16 @@
 #include <stddef.h>
 #include <stdint.h>
 
+// A block in the page cache. Only pagecache.c knows what is in it.
+struct pagecache_entry;
+
+void pagecache_init(void);
+struct pagecache_entry *pagecache_get(uint32_t block_index, bool populate,
+                                      bool metadata);
+void *pagecache_data(const struct pagecache_entry *entry);
+void pagecache_put(struct pagecache_entry *entry, bool dirty);
 void pagecache_read(uint32_t block_index, char *data);
 void pagecache_write(uint32_t block_index, const char *data);
 void *pagecache_steal(void);
+void pagecache_sync(void);
+void pagecache_writeback_worker(void);
@@ -0,0 +1,388 @@
+#include "slab.h"
+#include "common/lib.h"
+#include "common/printf.h"
+
+/**
+ * The slab allocator. It sits on top of the buddy allocator and hands out
+ * objects which are smaller than a page (or not a multiple of page size).
+ *
+ * Each cache holds objects of the same size. Objects live in slabs which are
+ * blocks of 2^order pages. The metadata of each slab is stored in the page
+ * metadata (struct page_t) of the first page of the slab; every page of the
+ * slab points back to the cache via slab_cache. Free objects in a slab are
+ * linked together with a pointer stored in the object itself at
+ * freelist_offset. If the cache has a constructor, this pointer is stored just
+ * after the object in order to keep the constructed state of the object.
+ *
+ * Each core also keeps a small stack of free objects for each cache. Most of
+ * the allocations and frees are served from that stack without any shared lock
+ * and the slabs are only touched in batches.
+ *
+ * Useful pages:
+ * https://www.kernel.org/doc/gorman/html/understand/understand011.html
+ */
+
+/**
+ * Maximum number of caches which can exist in the system
+ */
+#define MAX_CACHES 32
+
+/**
+ * Maximum order of slabs. We try to keep the slabs small.
+ */
+#define SLAB_MAX_ORDER 3
+
+/**
+ * Smallest and biggest size classes of kmalloc. Each size class is a power of
+ * two. Bigger allocations are directly served from the buddy allocator.
+ */
+#define KMALLOC_MIN_SHIFT 4
+#define KMALLOC_MAX_SHIFT 11
+#define KMALLOC_CLASSES (KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1)
+
+/**
+ * All of the caches in the system. We don't allocate caches dynamically because
+ * there are only a handful of them.
+ */
+static struct {
+  struct kmem_cache caches[MAX_CACHES];
+  // Guards the name field of the caches
+  struct spinlock lock;
+} cache_list;
+
+/**
+ * The caches used in kmalloc. The ith cache has objects with the size of
+ * 2^(i + KMALLOC_MIN_SHIFT) bytes.
+ */
+static struct kmem_cache *kmalloc_caches[KMALLOC_CLASSES];
+
+/**
+ * Names of the kmalloc caches
+ */
+static const char *kmalloc_cache_names[KMALLOC_CLASSES] = {
+    "kmalloc-16",  "kmalloc-32",  "kmalloc-64",   "kmalloc-128",
+    "kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048",
+};
+
+/**
+ * Gets the pointer to the next free object which is stored in a free object
+ */
+static inline void **freelist_pointer(const struct kmem_cache *cache,
+                                      void *object) {
+  return (void **)((char *)object + cache->freelist_offset);
+}
+
+/**
+ * Gets the first page of the slab which the object is in
+ */
+static struct page_t *slab_of(const struct kmem_cache *cache,
+                              const void *object) {
+  // Slabs are blocks of buddy allocator thus they are aligned to their size
+  const uint64_t slab_size = (uint64_t)PAGE_SIZE << cache->order;
+  return page_of((void *)((uint64_t)object & ~(slab_size - 1)));
+}
+
+/**
+ * Adds a slab to the head of the partial slabs of a cache. Lock of the cache
+ * must be held.
+ */
+static void partial_list_push(struct kmem_cache *cache, struct page_t *slab) {
+  slab->prev = NULL;
+  slab->next = cache->partial_slabs;
+  if (cache->partial_slabs != NULL)
+    cache->partial_slabs->prev = slab;
+  cache->partial_slabs = slab;
+}
+
+/**
+ * Removes a slab from the partial slabs of a cache. Lock of the cache must be
+ * held.
+ */
+static void partial_list_remove(struct kmem_cache *cache,
+                                struct page_t *slab) {
+  if (slab->prev != NULL)
+    slab->prev->next = slab->next;
+  else
+    cache->partial_slabs = slab->next;
+  if (slab->next != NULL)
+    slab->next->prev = slab->prev;
+  slab->next = NULL;
+  slab->prev = NULL;
+}
+
+/**
+ * Allocates a new slab for a cache and constructs all of its objects. Returns
+ * NULL if we are out of memory. Lock of the cache must not be held because
+ * kalloc might steal from the page cache.
+ */
+static struct page_t *slab_create(struct kmem_cache *cache) {
+  void *memory;
+  if (cache->order == 0 && (cache->flags & SLAB_NO_RECLAIM))
+    memory = kalloc_for_page_cache();
+  else
+    memory = kalloc_pages(cache->order);
+  if (memory == NULL)
+    return NULL;
+  // Mark each page as a part of the slab
+  struct page_t *slab = page_of(memory);
+  for (uint64_t i = 0; i < (1ULL << cache->order); i++)
+    slab[i].slab_cache = cache;
+  // Construct the objects and link them together
+  slab->slab_freelist = NULL;
+  slab->slab_in_use = 0;
+  for (int i = cache->objects_per_slab - 1; i >= 0; i--) {
+    void *object = (char *)memory + i * cache->stride;
+    if (cache->constructor != NULL)
+      cache->constructor(object);
+    *freelist_pointer(cache, object) = slab->slab_freelist;
+    slab->slab_freelist = object;
+  }
+  return slab;
+}
+
+/**
+ * Gives back the pages of an empty slab to the buddy allocator. The slab must
+ * not be in any list.
+ */
+static void slab_destroy(struct kmem_cache *cache, struct page_t *slab) {
+  for (uint64_t i = 0; i < (1ULL << cache->order); i++)
+    slab[i].slab_cache = NULL;
+  slab->slab_freelist = NULL;
+  kfree_pages(page_address(slab), cache->order);
+}
+
+/**
+ * Moves a batch of free objects from the slabs into the per-CPU list. Lock of
+ * the cache must be held.
+ */
+static void cpu_cache_refill(struct kmem_cache *cache,
+                             struct kmem_cpu_cache *cpu_cache) {
+  while (cpu_cache->count < SLAB_CPU_CACHE_BATCH &&
+         cache->partial_slabs != NULL) {
+    struct page_t *slab = cache->partial_slabs;
+    if (slab->slab_in_use == 0)
+      cache->empty_slabs--;
+    // Take the objects of this slab
+    while (cpu_cache->count < SLAB_CPU_CACHE_BATCH &&
+           slab->slab_freelist != NULL) {
+      void *object = slab->slab_freelist;
+      slab->slab_freelist = *freelist_pointer(cache, object);
+      slab->slab_in_use++;
+      cpu_cache->objects[cpu_cache->count++] = object;
+    }
+    // Full slabs are not kept in any list
+    if (slab->slab_freelist == NULL)
+      partial_list_remove(cache, slab);
+  }
+}
+
+/**
+ * Returns an object to its slab. Returns a slab which must be destroyed after
+ * unlocking the cache or NULL. Lock of the cache must be held.
+ */
+static struct page_t *slab_free_object(struct kmem_cache *cache,
+                                       void *object) {
+  struct page_t *slab = slab_of(cache, object);
+  if (slab->slab_cache != cache)
+    panic("kmem_cache_free: wrong cache");
+  // A full slab becomes partial
+  if (slab->slab_freelist == NULL)
+    partial_list_push(cache, slab);
+  *freelist_pointer(cache, object) = slab->slab_freelist;
+  slab->slab_freelist = object;
+  slab->slab_in_use--;
+  if (slab->slab_in_use != 0)
+    return NULL;
+  // Keep one empty slab around to avoid going back and forth to buddy
+  // allocator. Destroy the rest.
+  if (cache->empty_slabs == 0) {
+    cache->empty_slabs++;
+    return NULL;
+  }
+  partial_list_remove(cache, slab);
+  cache->total_slabs--;
+  return slab;
+}
+
+/**
+ * Moves a batch of free objects from the per-CPU list back to the slabs. Lock
+ * of the cache must be held. Empty slabs which must be destroyed are stored in
+ * to_destroy which is a list linked with the next field.
+ */
+static void cpu_cache_drain(struct kmem_cache *cache,
+                            struct kmem_cpu_cache *cpu_cache,
+                            struct page_t **to_destroy) {
+  while (cpu_cache->count > SLAB_CPU_CACHE_SIZE - SLAB_CPU_CACHE_BATCH) {
+    struct page_t *slab =
+        slab_free_object(cache, cpu_cache->objects[--cpu_cache->count]);
+    if (slab != NULL) {
+      slab->next = *to_destroy;
+      *to_destroy = slab;
+    }
+  }
+}
+
+/**
+ * Creates a new cache of objects with the given size. The constructor might be
+ * NULL. Returns NULL if there is no free cache slot.
+ */
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+                                     void (*constructor)(void *),
+                                     uint32_t flags) {
+  if (size == 0 || size > ((uint64_t)PAGE_SIZE << SLAB_MAX_ORDER))
+    panic("kmem_cache_create: size");
+  // Find a free cache
+  struct kmem_cache *cache = NULL;
+  spinlock_lock(&cache_list.lock);
+  for (int i = 0; i < MAX_CACHES; i++) {
+    if (cache_list.caches[i].name == NULL) {
+      cache = &cache_list.caches[i];
+      cache->name = name;
+      break;
+    }
+  }
+  spinlock_unlock(&cache_list.lock);
+  if (cache == NULL)
+    return NULL;
+  // Objects are aligned to 8 bytes and must be able to hold the free list
+  // pointer.
+  cache->object_size = size;
+  cache->stride = (MAX_SAFE(size, sizeof(void *)) + 7) & ~7ULL;
+  cache->freelist_offset = 0;
+  if (constructor != NULL) { // do not override the constructed object
+    cache->freelist_offset = cache->stride;
+    cache->stride += sizeof(void *);
+  }
+  cache->constructor = constructor;
+  cache->flags = flags;
+  // Find the smallest slab which wastes at most 1/8 of its space
+  cache->order = 0;
+  while (cache->order < SLAB_MAX_ORDER) {
+    const uint64_t slab_size = (uint64_t)PAGE_SIZE << cache->order;
+    if (slab_size / cache->stride > 0 &&
+        slab_size % cache->stride <= slab_size / 8)
+      break;
+    cache->order++;
+  }
+  cache->objects_per_slab = ((uint64_t)PAGE_SIZE << cache->order) /
+                            cache->stride;
+  if (cache->objects_per_slab == 0)
+    panic("kmem_cache_create: object too big");
+  cache->partial_slabs = NULL;
+  cache->empty_slabs = 0;
+  cache->total_slabs = 0;
+  return cache;
+}
+
+/**
+ * Allocates an object from a cache. Returns NULL if we are out of memory.
+ */
+void *kmem_cache_alloc(struct kmem_cache *cache) {
+  void *object = NULL;
+  save_and_disable_interrupts();
+  struct kmem_cpu_cache *cpu_cache = &cache->cpu[get_processor_id()];
+  if (cpu_cache->count == 0) {
+    spinlock_lock(&cache->lock);
+    cpu_cache_refill(cache, cpu_cache);
+    spinlock_unlock(&cache->lock);
+  }
+  if (cpu_cache->count == 0) {
+    // No free objects in any slab. Create a new slab.
+    // Note: We must not hold any locks here because kalloc might call back
+    // into page cache which might allocate objects as well.
+    struct page_t *slab = slab_create(cache);
+    if (slab != NULL) {
+      spinlock_lock(&cache->lock);
+      cache->total_slabs++;
+      partial_list_push(cache, slab);
+      cache->empty_slabs++;
+      cpu_cache_refill(cache, cpu_cache);
+      spinlock_unlock(&cache->lock);
+    }
+  }
+  if (cpu_cache->count != 0)
+    object = cpu_cache->objects[--cpu_cache->count];
+  restore_interrupts();
+  return object;
+}
+
+/**
+ * Gives back an object to the cache which it was allocated from. The object
+ * must be in its constructed state if the cache has a constructor.
+ */
+void kmem_cache_free(struct kmem_cache *cache, void *object) {
+  struct page_t *to_destroy = NULL;
+  save_and_disable_interrupts();
+  struct kmem_cpu_cache *cpu_cache = &cache->cpu[get_processor_id()];
+  if (cpu_cache->count == SLAB_CPU_CACHE_SIZE) {
+    spinlock_lock(&cache->lock);
+    cpu_cache_drain(cache, cpu_cache, &to_destroy);
+    spinlock_unlock(&cache->lock);
+  }
+  cpu_cache->objects[cpu_cache->count++] = object;
+  restore_interrupts();
+  // Give back the empty slabs to the buddy allocator
+  while (to_destroy != NULL) {
+    struct page_t *next = to_destroy->next;
+    to_destroy->next = NULL;
+    slab_destroy(cache, to_destroy);
+    to_destroy = next;
+  }
+}
+
+/**
+ * Allocates size bytes of memory for kernel. Small allocations are served from
+ * the size class caches and big ones directly from the buddy allocator.
+ * Returns NULL if we are out of memory.
+ */
+void *kmalloc(size_t size) {
+  if (size == 0)
+    return NULL;
+  // Find the size class
+  int shift = KMALLOC_MIN_SHIFT;
+  while (shift <= KMALLOC_MAX_SHIFT && (1ULL << shift) < size)
+    shift++;
+  if (shift <= KMALLOC_MAX_SHIFT)
+    return kmem_cache_alloc(kmalloc_caches[shift - KMALLOC_MIN_SHIFT]);
+  // Big allocation
+  int order = 0;
+  while (((uint64_t)PAGE_SIZE << order) < size)
+    order++;
+  if (order >= PAGE_MAX_ORDER)
+    return NULL;
+  void *block = kalloc_pages(order);
+  // The order of the pages which come from the magazines or the split huge
+  // pages might be stale. kfree_obj frees the block with this order.
+  if (block != NULL)
+    page_of(block)->order = order;
+  return block;
+}
+
+/**
+ * Frees an object which was allocated by kmalloc or kmem_cache_alloc.
+ */
+void kfree_obj(void *object) {
+  if (object == NULL)
+    return;
+  struct page_t *page = page_of(object);
+  if (page->slab_cache != NULL) {
+    kmem_cache_free(page->slab_cache, object);
+    return;
+  }
+  // Big allocations are blocks of buddy allocator
+  if (V2P(object) % PAGE_SIZE != 0)
+    panic("kfree_obj: invalid object");
+  kfree_pages(object, page->order);
+}
+
+/**
+ * Creates the generic kmalloc caches
+ */
+void slab_init(void) {
+  for (int i = 0; i < KMALLOC_CLASSES; i++) {
+    kmalloc_caches[i] = kmem_cache_create(
+        kmalloc_cache_names[i], 1ULL << (i + KMALLOC_MIN_SHIFT), NULL, 0);
+    if (kmalloc_caches[i] == NULL)
+      panic("slab_init");
+  }
+}
\ No newline at end of file
@@ -0,0 +1,77 @@
+#pragma once
+#include "common/spinlock.h"
+#include "cpu/smp.h"
+#include "mem.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Maximum number of free objects which each core keeps for each cache
+ */
+#define SLAB_CPU_CACHE_SIZE 16
+
+/**
+ * Number of objects moved between a per-CPU free list and the slabs in each
+ * refill or drain.
+ */
+#define SLAB_CPU_CACHE_BATCH (SLAB_CPU_CACHE_SIZE / 2)
+
+/**
+ * Allocate the slabs of this cache without stealing from the page cache. Used
+ * by the page cache itself to avoid calling back into itself.
+ */
+#define SLAB_NO_RECLAIM (1 << 0)
+
+/**
+ * Free objects of a cache which are local to a CPU core
+ */
+struct kmem_cpu_cache {
+  // Free objects. Only the first count objects are valid.
+  void *objects[SLAB_CPU_CACHE_SIZE];
+  // Number of objects in this list
+  uint32_t count;
+};
+
+/**
+ * A cache of objects with the same size. Objects are carved out of slabs which
+ * are blocks of 2^order pages from the buddy allocator.
+ */
+struct kmem_cache {
+  // Name of this cache. NULL if this cache is not used.
+  const char *name;
+  // The size of each object which the user asked for
+  size_t object_size;
+  // The distance between two objects in a slab
+  size_t stride;
+  // Where the pointer to the next free object is stored in a free object
+  size_t freelist_offset;
+  // Called once on each object when its slab is created. Objects must be
+  // freed in the constructed state.
+  void (*constructor)(void *);
+  // SLAB_ flags
+  uint32_t flags;
+  // Each slab is 2^order pages
+  uint8_t order;
+  // Number of objects in each slab
+  uint16_t objects_per_slab;
+  // Guards the slab lists
+  struct spinlock lock;
+  // Slabs which have at least one free object
+  struct page_t *partial_slabs;
+  // Number of slabs in partial_slabs which have no allocated object
+  uint32_t empty_slabs;
+  // Total number of slabs allocated for this cache
+  uint64_t total_slabs;
+  // Free objects of each core
+  struct kmem_cpu_cache cpu[MAX_CORES];
+};
+
+void slab_init(void);
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+                                     void (*constructor)(void *),
+                                     uint32_t flags);
+void *kmem_cache_alloc(struct kmem_cache *cache);
+void kmem_cache_free(struct kmem_cache *cache, void *object);
+void *kmalloc(size_t size);
+void kfree_obj(void *object);
\ No newline at end of file
@@ -2,6 +2,7 @@
 #include "common/lib.h"
 #include "common/printf.h"
 #include "cpu/asm.h"
+#include "cpu/smp.h"
 
 /**
  * From a virtual address, get the index of PTE entry based on the level
@@ -15,15 +16,26 @@
  */
 #define PTE_GET_PHY_ADDRESS(addr) ((addr) >> 12)
 
+/**
+ * CPUID bit of PCID support
+ */
+#define CPUID_1_ECX_PCID (1U << 17)
+
 /**
  * Number of PTEs in a pagetable
  */
 #define PAGETABLE_PTE_COUNT 512
 
 /**
- * Gets the lower boundry of the page which we are trying to access.
+ * The first PML4 entry of the kernel half of the address space. Entries from
+ * this one to the end are shared between the kernel and all processes.
  */
-#define PAGE_ROUND_DOWN(a) ((a) & ~(PAGE_SIZE - 1))
+#define KERNEL_PML4_START (PAGETABLE_PTE_COUNT / 2)
+
+/**
+ * Gets the lower boundry of the huge page which we are trying to access.
+ */
+#define HUGE_PAGE_ROUND_DOWN(a) ((a) & ~(HUGE_PAGE_SIZE - 1))
 
 /**
  * Follow a PTE to the pagetable/frame it is pointing to.
@@ -34,12 +46,28 @@ static inline void *pte_follow(struct pte_t pte) {
   return (void *)((uint64_t)pte.address << 12);
 }
 
+/**
+ * Gets the physical address of the 4KB frame which va resolves to. pte is the
+ * leaf PTE of va which might be a huge page.
+ */
+static inline uint64_t pte_frame_address(struct pte_t pte, uint64_t va) {
+  uint64_t pa = (uint64_t)pte_follow(pte);
+  if (pte.huge_page)
+    pa += PAGE_ROUND_DOWN(va & (HUGE_PAGE_SIZE - 1));
+  return pa;
+}
+
 /**
  * The kernel pagetable which Limine sets up for us. This is in virtual
  * address space.
  */
 pagetable_t kernel_pagetable;
 
+/**
+ * True if the CPU supports PCIDs and CR4.PCIDE is set
+ */
+bool vmm_pcid_enabled;
+
 /**
  * kernel address which we got from limine
  */
@@ -69,22 +97,28 @@ static uint64_t io_memmap_current_address = 0xfffffffff0000000;
  *   21..29 -- 9 bits of level-2 index.
  *   12..20 -- 9 bits of level-1 index.
  *    0..11 -- 12 bits of byte offset within the page.
+ *
+ * The walk stops at leaf_level and returns the PTE of that level. If a huge
+ * page maps va before reaching leaf_level, the PTE of the huge page is
+ * returned instead.
  */
-static struct pte_t *walk(pagetable_t pagetable, uint64_t va, bool alloc,
-                          bool io) {
+static struct pte_t *walk_level(pagetable_t pagetable, uint64_t va, bool alloc,
+                                bool io, int leaf_level) {
   if ((!io && va >= VA_MAX) || va < VA_MIN)
     panic("walk");
 
-  for (int level = 3; level > 0; level--) {
+  for (int level = 3; level > leaf_level; level--) {
     struct pte_t *pte = &pagetable[PTE_INDEX_FROM_VA(va, level)];
     if (pte->present) { // if PTE is here, just point to it
+      if (pte->huge_page) // a huge page covers the va
+        return pte;
       pagetable = (pagetable_t)P2V(pte_follow(*pte));
     } else { // PTE does not exists...
       if (!alloc ||
-          (pagetable = (pagetable_t)kalloc()) == 0) // should we make one?
-        return 0;                                   // either OOM or N/A page
-      memset(pagetable, 0, PAGE_SIZE);              // zero the new pagetable
-      pte->present = 1;                             // now we have this page
+          (pagetable = (pagetable_t)kcalloc()) == 0) // should we make one?
+        return 0;                                    // either OOM or N/A page
+      MEM_COUNTER_ADD(pagetable_pages, 1);
+      pte->present = 1; // now we have this page
       // Just like xv6, we do some generous access bits on every page allocated.
       // The last PTE will take care of the actual access bits.
       pte->xd = 0;
@@ -94,49 +128,173 @@ static struct pte_t *walk(pagetable_t pagetable, uint64_t va, bool alloc,
     }
   }
 
-  return &pagetable[PTE_INDEX_FROM_VA(va, 0)];
+  return &pagetable[PTE_INDEX_FROM_VA(va, leaf_level)];
 }
 
 /**
- * Deep copy the pagetable (and not the frames) to another pagetable.
- *
- * TODO: I know that if we goto OOM state we won't free the frames used by
- * pagetables.
- */
-static int copy_pagetable(pagetable_t dst, const pagetable_t src, int level) {
-  // The first step is to copy the pagetable from src to dest (the PTEs)
-  memcpy(dst, src, PAGE_SIZE);
-  // Next check if this is the leaf (points to 4kb page)
-  if (level == 0)
-    return 0;
-  // Now check each entry in pagetable
+ * Return the address of the last level PTE of va. Might return the PTE of a
+ * huge page if va is mapped with a huge page. See walk_level.
+ */
+static struct pte_t *walk(pagetable_t pagetable, uint64_t va, bool alloc,
+                          bool io) {
+  return walk_level(pagetable, va, alloc, io, 0);
+}
+
+/**
+ * Gets the level 1 PTE which can map a huge page at va. Returns NULL if the
+ * PTE is already used (either by a page table or another huge page) or we
+ * are out of memory.
+ */
+static struct pte_t *huge_page_slot(pagetable_t pagetable, uint64_t va) {
+  struct pte_t *pte = walk_level(pagetable, va, true, false, 1);
+  if (pte == NULL || pte->present)
+    return NULL;
+  return pte;
+}
+
+/**
+ * Fills a level 1 PTE in order to map a huge page
+ */
+static void set_huge_page(struct pte_t *pte, uint64_t pa,
+                          pte_permissions permissions) {
+  pte->present = 1;
+  pte->huge_page = 1;
+  pte->rw = permissions.writable;
+  pte->xd = !permissions.executable;
+  pte->us = permissions.userspace;
+  pte->shared = permissions.shared;
+  pte->address = PTE_GET_PHY_ADDRESS(pa);
+}
+
+/**
+ * Fills a level 0 PTE in order to map a normal page. If cow is set, a
+ * writable page is mapped read only and is copied on the first write to it.
+ */
+static void set_page(struct pte_t *pte, uint64_t pa,
+                     pte_permissions permissions, bool cow) {
+  pte->present = 1;
+  pte->rw = permissions.writable && !cow;
+  pte->cow = permissions.writable && cow;
+  pte->xd = !permissions.executable;
+  pte->us = permissions.userspace;
+  pte->shared = permissions.shared;
+  pte->address = PTE_GET_PHY_ADDRESS(pa);
+}
+
+/**
+ * Gets the level 0 PTEs which map the pages from va up to the end of the page
+ * table of va, creating the page table if needed. The number of PTEs is
+ * written to count and is at most max_count. Each page table is walked from
+ * the root once instead of once per page. Returns NULL if we are out of
+ * memory. Panics if a huge page already maps va.
+ */
+static struct pte_t *walk_range(pagetable_t pagetable, uint64_t va,
+                                size_t max_count, size_t *count) {
+  struct pte_t *ptes = walk(pagetable, va, true, false);
+  if (ptes == NULL)
+    return NULL;
+  if (ptes->huge_page)
+    panic("walk_range: huge page");
+  *count = MIN_SAFE(max_count,
+                    PAGETABLE_PTE_COUNT - PTE_INDEX_FROM_VA(va, 0));
+  return ptes;
+}
+
+/**
+ * Splits a huge page into a page table of 512 normal pages with the same
+ * frames and permissions. Returns 0 on success, -1 if we are out of memory.
+ */
+static int split_huge_page(struct pte_t *pte) {
+  pagetable_t pagetable = (pagetable_t)kcalloc();
+  if (pagetable == NULL)
+    return -1;
+  MEM_COUNTER_ADD(pagetable_pages, 1);
   for (size_t i = 0; i < PAGETABLE_PTE_COUNT; i++) {
-    const struct pte_t pte_src = src[i];
-    if (pte_src.present && !pte_src.huge_page) {
-      // If this PTE is not a huge page, we should allocate a frame
-      // and copy the inner pagetable. Then we should recursively copy the
-      // content of the pagetable which this PTE is pointing at to the
-      // allocated frame.
-      pagetable_t dst_inner_pagetable = (pagetable_t)kalloc();
-      if (dst_inner_pagetable == NULL) // OOM!
-        return 1;
-      const pagetable_t src_inner_pagetable =
-          (pagetable_t)P2V(pte_follow(pte_src));
-      if (copy_pagetable(dst_inner_pagetable, src_inner_pagetable, level - 1) !=
-          0) // OOM!
-        return 1;
-    }
+    pagetable[i].present = 1;
+    pagetable[i].rw = pte->rw;
+    pagetable[i].xd = pte->xd;
+    pagetable[i].us = pte->us;
+    pagetable[i].shared = pte->shared;
+    pagetable[i].address = pte->address + i;
   }
+  // Just like walk, the middle levels have generous access bits
+  pte->huge_page = 0;
+  pte->rw = 1;
+  pte->xd = 0;
+  pte->us = 1;
+  pte->address = PTE_GET_PHY_ADDRESS(V2P(pagetable));
   return 0;
 }
 
 /**
- * We just save the limine_kernel_address_response to be later accessed.
+ * Gives a copy-on-write page (normal or huge) its own frame and makes it
+ * writable. The frame is only copied if another process still shares it.
+ * va is any address in the page and the pagetable of the PTE must be the
+ * installed one. Returns 0 on success, -1 if we are out of memory.
+ */
+static int cow_break(struct pte_t *pte, uint64_t va) {
+  const int order = pte->huge_page ? HUGE_PAGE_ORDER : 0;
+  void *frame = (void *)P2V(pte_follow(*pte));
+  if (kpage_shared(frame)) {
+    void *copy = kalloc_pages(order);
+    if (copy == NULL)
+      return -1;
+    memcpy(copy, frame, PAGE_SIZE << order);
+    kpage_put(frame, order);
+    pte->address = PTE_GET_PHY_ADDRESS(V2P(copy));
+  }
+  pte->rw = 1;
+  pte->cow = 0;
+  invlpg(va);
+  return 0;
+}
+
+/**
+ * Marks every page which is mapped in a pagetable as global. Global pages
+ * are not flushed from the TLB when CR3 is reloaded.
+ */
+static void set_global_recursive(pagetable_t pagetable, int level) {
+  for (size_t i = 0; i < PAGETABLE_PTE_COUNT; i++) {
+    struct pte_t *pte = &pagetable[i];
+    if (!pte->present)
+      continue;
+    if (level == 0 || pte->huge_page) // a leaf
+      pte->global = 1;
+    else
+      set_global_recursive((pagetable_t)P2V(pte_follow(*pte)), level - 1);
+  }
+}
+
+/**
+ * We save the limine_kernel_address_response to be later accessed. Then,
+ * the kernel half of the address space is made global. Every process shares
+ * the same kernel mappings, thus there is no need to flush them from the TLB
+ * when we switch between processes. PCIDs are enabled if the CPU supports
+ * them; The kernel pagetable uses PCID 0.
  */
 void vmm_init_kernel(
     const struct limine_kernel_address_response _kernel_address) {
   kernel_address = _kernel_address;
   kernel_pagetable = (pagetable_t)P2V(get_installed_pagetable());
+  for (size_t i = KERNEL_PML4_START; i < PAGETABLE_PTE_COUNT; i++)
+    if (kernel_pagetable[i].present)
+      set_global_recursive((pagetable_t)P2V(pte_follow(kernel_pagetable[i])),
+                           2);
+  // Make the kernel fault on writes to read only pages as well. Otherwise the
+  // kernel could write to a copy-on-write page of a process.
+  write_cr0(read_cr0() | CR0_WP);
+  // Toggling PGE flushes the whole TLB, including the old global entries
+  const uint64_t cr4 = read_cr4();
+  write_cr4(cr4 & ~CR4_PGE);
+  write_cr4(cr4 | CR4_PGE);
+  // PCIDE can only be set while the PCID in CR3 is zero
+  uint32_t eax, ebx, ecx, edx;
+  cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+  if ((ecx & CPUID_1_ECX_PCID) != 0 &&
+      (read_cr3() & CR3_PCID_MASK) == 0) {
+    write_cr4(read_cr4() | CR4_PCIDE);
+    vmm_pcid_enabled = true;
+  }
 }
 
 /**
@@ -156,7 +314,18 @@ uint64_t vmm_walkaddr(pagetable_t pagetable, uint64_t va, bool user) {
     return 0;
   if (pte->us != user)
     return 0;
-  return pte->address << 12;
+  return pte_frame_address(*pte, va);
+}
+
+/**
+ * Checks if the kernel can access the user page of va without faulting. If
+ * write is set, the page must be writable too.
+ */
+bool vmm_user_accessible(pagetable_t pagetable, uint64_t va, bool write) {
+  if (va < VA_MIN || va >= VA_MAX)
+    return false;
+  struct pte_t *pte = walk(pagetable, va, false, false);
+  return pte != NULL && pte->present && pte->us && (pte->rw || !write);
 }
 
 /**
@@ -175,31 +344,63 @@ int vmm_map_pages(pagetable_t pagetable, uint64_t va, uint64_t size,
     panic("vmm_map_pages: size not aligned");
   if (size == 0)
     panic("vmm_map_pages: size");
-  // Map each page individually
-  const uint64_t pages_to_map = size / PAGE_SIZE;
-  for (uint64_t i = 0; i < pages_to_map; i++) {
-    const uint64_t current_va = va + i * PAGE_SIZE;
-    const uint64_t current_pa = pa + i * PAGE_SIZE;
-    struct pte_t *pte = walk(pagetable, current_va, true, false);
-    if (pte == NULL)
-      return -1;      // OOM
-    if (pte->present) // this page already exists?
-      panic("vmm_map_pages: remap");
-    pte->present = 1; // make this page available
-    pte->rw = permissions.writable;
-    pte->xd = !permissions.executable;
-    pte->us = permissions.userspace;
-    pte->address = PTE_GET_PHY_ADDRESS(current_pa);
+  // Use huge pages if both addresses are aligned. Otherwise, fill the PTEs
+  // of each page table in one go.
+  for (uint64_t offset = 0; offset < size;) {
+    const uint64_t current_va = va + offset;
+    const uint64_t current_pa = pa + offset;
+    if (current_va % HUGE_PAGE_SIZE == 0 && current_pa % HUGE_PAGE_SIZE == 0 &&
+        size - offset >= HUGE_PAGE_SIZE) {
+      struct pte_t *pte = huge_page_slot(pagetable, current_va);
+      if (pte != NULL) {
+        set_huge_page(pte, current_pa, permissions);
+        offset += HUGE_PAGE_SIZE;
+        continue;
+      }
+    }
+    size_t count;
+    struct pte_t *ptes =
+        walk_range(pagetable, current_va, (size - offset) / PAGE_SIZE, &count);
+    if (ptes == NULL)
+      return -1; // OOM
+    for (size_t i = 0; i < count; i++) {
+      if (ptes[i].present) // this page already exists?
+        panic("vmm_map_pages: remap");
+      set_page(&ptes[i], current_pa + i * PAGE_SIZE, permissions, false);
+    }
+    offset += count * PAGE_SIZE;
   }
   return 0;
 }
 
+/**
+ * Tries to allocate a huge page at va. Returns 0 on success, -1 if there
+ * is no contiguous memory or va cannot be mapped with a huge page.
+ */
+static int vmm_allocate_huge(pagetable_t pagetable, uint64_t va,
+                             pte_permissions permissions, bool clear) {
+  struct pte_t *pte = huge_page_slot(pagetable, va);
+  if (pte == NULL)
+    return -1;
+  void *frame = kalloc_pages(HUGE_PAGE_ORDER);
+  if (frame == NULL)
+    return -1;
+  if (clear)
+    memset(frame, 0, HUGE_PAGE_SIZE);
+  set_huge_page(pte, V2P(frame), permissions);
+  return 0;
+}
+
 /**
  * Allocates pages in a page table. va must be page aligned and the size
  * must be devisable by page size. Returns 0 on success, -1 if walk() couldn't
  * allocate a needed pagetable page.
  *
- * If clear is set, the allocated page will be filled with zero, otherwise 2.
+ * If clear is set, the allocated page will be filled with zero, otherwise the
+ * content of the page is undefined and the caller must overwrite it.
+ *
+ * Each 2MB aligned part of the range is backed by a huge page if there is
+ * enough contiguous memory. Otherwise, normal pages are used.
  */
 int vmm_allocate(pagetable_t pagetable, uint64_t va, uint64_t size,
                  pte_permissions permissions, bool clear) {
@@ -211,32 +412,78 @@ int vmm_allocate(pagetable_t pagetable, uint64_t va, uint64_t size,
   if (size == 0)
     panic("vmm_allocate: size");
   // Allocate pages
-  const uint64_t pages_to_alloc = size / PAGE_SIZE;
-  for (uint64_t i = 0; i < pages_to_alloc; i++) {
-    const uint64_t current_va = va + i * PAGE_SIZE;
-    void *frame;
-    if (clear)
-      frame = kcalloc();
-    else
-      frame = kalloc();
-    if (frame == NULL)
-      return -1;
-    struct pte_t *pte = walk(pagetable, current_va, true, false);
-    if (pte == NULL)
-      return -1;      // OOM
-    if (pte->present) // this page already exists?
-      panic("vmm_allocate: remap");
-    pte->present = 1; // make this page available
-    pte->rw = permissions.writable;
-    pte->xd = !permissions.executable;
-    pte->us = permissions.userspace;
-    pte->address = PTE_GET_PHY_ADDRESS(V2P(frame));
-    // Clear the allocated page
-    memset(frame, 0, PAGE_SIZE);
+  for (uint64_t offset = 0; offset < size;) {
+    const uint64_t current_va = va + offset;
+    if (current_va % HUGE_PAGE_SIZE == 0 && size - offset >= HUGE_PAGE_SIZE &&
+        vmm_allocate_huge(pagetable, current_va, permissions, clear) == 0) {
+      offset += HUGE_PAGE_SIZE;
+      continue;
+    }
+    // Fill the PTEs of this page table up to the next huge page
+    size_t count;
+    struct pte_t *ptes =
+        walk_range(pagetable, current_va, (size - offset) / PAGE_SIZE, &count);
+    if (ptes == NULL)
+      return -1; // OOM
+    for (size_t i = 0; i < count; i++) {
+      if (ptes[i].present) // this page already exists?
+        panic("vmm_allocate: remap");
+      void *frame = clear ? kcalloc() : kalloc();
+      if (frame == NULL)
+        return -1;
+      set_page(&ptes[i], V2P(frame), permissions, false);
+    }
+    offset += count * PAGE_SIZE;
   }
   return 0;
 }
 
+/**
+ * Maps a frame which has other owners (see kpage_share) at va. The share of
+ * the caller is given to the page table and is dropped when the page is
+ * unmapped. Writable pages are mapped copy-on-write, thus the other owners
+ * never see the writes to this page. va must be page aligned. Returns 0 on
+ * success, -1 if walk() couldn't allocate a needed pagetable page.
+ */
+int vmm_map_shared(pagetable_t pagetable, uint64_t va, void *frame,
+                   pte_permissions permissions) {
+  if (vmm_map_frames(pagetable, va, &frame, 1, permissions, true) != 1)
+    return -1; // OOM
+  return 0;
+}
+
+/**
+ * Maps count frames (given by their kernel virtual addresses) at consecutive
+ * pages starting from va. Each page table is walked once and its PTEs are
+ * filled in a row. The page table owns the mapped frames and drops them when
+ * the pages are unmapped. If cow is set, writable pages are mapped
+ * copy-on-write just like vmm_map_shared. va must be page aligned.
+ *
+ * Returns the number of mapped frames, which is less than count if we are
+ * out of memory. The frames after the mapped ones still belong to the
+ * caller.
+ */
+size_t vmm_map_frames(pagetable_t pagetable, uint64_t va, void *const *frames,
+                      size_t count, pte_permissions permissions, bool cow) {
+  if (va % PAGE_SIZE != 0)
+    panic("vmm_map_frames: va not aligned");
+  size_t mapped = 0;
+  while (mapped < count) {
+    size_t batch;
+    struct pte_t *ptes = walk_range(pagetable, va + mapped * PAGE_SIZE,
+                                    count - mapped, &batch);
+    if (ptes == NULL)
+      break; // OOM
+    for (size_t i = 0; i < batch; i++) {
+      if (ptes[i].present) // this page already exists?
+        panic("vmm_map_frames: remap");
+      set_page(&ptes[i], V2P(frames[mapped + i]), permissions, cow);
+    }
+    mapped += batch;
+  }
+  return mapped;
+}
+
 /**
  * Maps a physical address which is used for IO.
  * Returns the virtual address which the region is mapped to.
@@ -268,6 +515,7 @@ void *vmm_io_memmap(uint64_t pa, uint64_t size) {
     pte->us = 0;      // no userspace
     pte->pwt = 1;     // IO pages should not be cached
     pte->pct = 1;     // Same thing
+    pte->global = 1;  // Kernel pages are global
     pte->address = PTE_GET_PHY_ADDRESS(current_pa);
   }
   return (void *)va;
@@ -275,35 +523,33 @@ void *vmm_io_memmap(uint64_t pa, uint64_t size) {
 
 /**
  * Create a pagetable for a program running in userspace.
- * This is done by at first deep copying the kernel pagetable and then mapping
- * the user stuff in the lower addresses. The memory layout is almost as same as
- * https://i.sstatic.net/Ufj7o.png
+ * This is done by at first sharing the kernel half of the kernel pagetable
+ * and then mapping the user stuff in the lower addresses. The memory layout is
+ * almost as same as https://i.sstatic.net/Ufj7o.png
+ *
+ * Only the PML4 entries of the kernel half are copied. They point to the same
+ * page-table pages as the kernel pagetable does, thus these pages are shared
+ * between all processes and must never be freed with the process.
  *
  * This method does not allocate pages for code, data and heap and only
- * allocates trap pages and the kernel address space. However, a single stack
- * page is allocated.
+ * allocates trap pages. The user stack is allocated by exec as well.
  */
 pagetable_t vmm_user_pagetable_new() {
   // Allocate a pagetable to be our result
-  pagetable_t pagetable = (pagetable_t)kalloc();
+  pagetable_t pagetable = (pagetable_t)kcalloc();
   if (pagetable == NULL)
     return NULL;
-  memset(pagetable, 0, PAGE_SIZE);
-  // Copy everything to new pagetable (original kernelspace to userspace)
-  if (copy_pagetable(pagetable, kernel_pagetable, 3) != 0)
-    return NULL;
-  // Create dedicated pages
-  void *user_stack = NULL, *int_stack = NULL, *syscall_stack = NULL;
-  if ((user_stack = kalloc()) == NULL)
-    goto failed;
+  MEM_COUNTER_ADD(pagetable_pages, 1);
+  // Share the kernel half of the address space
+  memcpy(&pagetable[KERNEL_PML4_START], &kernel_pagetable[KERNEL_PML4_START],
+         (PAGETABLE_PTE_COUNT - KERNEL_PML4_START) * sizeof(struct pte_t));
+  // Create dedicated pages. The user stack is allocated by exec.
+  void *int_stack = NULL, *syscall_stack = NULL;
   if ((int_stack = kalloc()) == NULL)
     goto failed;
   if ((syscall_stack = kalloc()) == NULL)
     goto failed;
   // Map pages
-  vmm_map_pages(
-      pagetable, USER_STACK_BOTTOM, PAGE_SIZE, V2P(user_stack),
-      (pte_permissions){.writable = 1, .executable = 0, .userspace = 1});
   vmm_map_pages(
       pagetable, INTSTACK_VIRTUAL_ADDRESS_BOTTOM, PAGE_SIZE, V2P(int_stack),
       (pte_permissions){.writable = 1, .executable = 0, .userspace = 0});
@@ -315,12 +561,12 @@ pagetable_t vmm_user_pagetable_new() {
   return pagetable;
 
 failed:
-  if (user_stack != NULL)
-    kfree(user_stack);
   if (int_stack != NULL)
     kfree(int_stack);
   if (syscall_stack != NULL)
     kfree(syscall_stack);
+  kfree(pagetable);
+  MEM_COUNTER_ADD(pagetable_pages, -1);
   return NULL;
 }
 
@@ -336,16 +582,15 @@ static void vmm_user_pagetable_free_recursive(pagetable_t pagetable,
   // We shall free the frame at last
   if (level == 0) {
     // Note: Pagetable here is not actually a pagetable; Instead,
-    // it's the data frame which the virtual address resolves to.
-    kfree(pagetable);
+    // it's the data frame which the virtual address resolves to. The frame
+    // might be shared with other processes.
+    kpage_put(pagetable, 0);
     return;
   }
   // Check each entry of the page table
   for (size_t i = 0; i < PAGETABLE_PTE_COUNT; i++) {
     const struct pte_t pte = pagetable[i];
     if (pte.present) {
-      if (pte.huge_page) // We don't deal with huge pages now
-        panic("vmm_user_pagetable_free_recursive: huge page");
       // Create the partial va address from steps
       // The va is inclusive. Low is inclusive but high is exclusive.
       const uint64_t current_va_low = initial_va | (i << (level * 9 + 12));
@@ -353,12 +598,20 @@ static void vmm_user_pagetable_free_recursive(pagetable_t pagetable,
           initial_va | ((i + 1) << (level * 9 + 12));
       // If the range of the va is outside the userspace addresses,
       // then we can safely just ignore this entry and its parents
-      // because they are in the kernel virtual space.
+      // because they are in the kernel virtual space. The kernel half is
+      // shared with the kernel pagetable and all other processes.
       // However, if even one of the ends are in the userspace range,
       // we shall descend into lower pages.
       if ((current_va_high >= VA_MAX && current_va_low >= VA_MAX) ||
           (current_va_high < VA_MIN && current_va_low < VA_MIN))
         continue;
+      // Huge pages are only created at level 1 by vmm_allocate
+      if (pte.huge_page) {
+        if (level != 1)
+          panic("vmm_user_pagetable_free_recursive: huge page");
+        kpage_put((void *)P2V(pte_follow(pte)), HUGE_PAGE_ORDER);
+        continue;
+      }
       // We shall descend lower
       const pagetable_t src_inner_pagetable = (pagetable_t)P2V(pte_follow(pte));
       vmm_user_pagetable_free_recursive(src_inner_pagetable, current_va_low,
@@ -367,75 +620,386 @@ static void vmm_user_pagetable_free_recursive(pagetable_t pagetable,
   }
   // Remove the pagetable as well
   kfree(pagetable);
+  MEM_COUNTER_ADD(pagetable_pages, -1);
+}
+
+/**
+ * Recursively frees the userspace frames of a page table except the kernel
+ * stacks. The page table pages which map the kernel stacks are kept and the
+ * rest of them are freed. The initial call must be like
+ * vmm_user_pagetable_free_recursive. Returns true if anything is kept in
+ * this page table.
+ */
+static bool vmm_user_pagetable_clear_recursive(pagetable_t pagetable,
+                                               const uint64_t initial_va,
+                                               int level) {
+  bool kept = false;
+  for (size_t i = 0; i < PAGETABLE_PTE_COUNT; i++) {
+    struct pte_t *pte = &pagetable[i];
+    if (!pte->present)
+      continue;
+    const uint64_t current_va_low = initial_va | (i << (level * 9 + 12));
+    const uint64_t current_va_high = initial_va | ((i + 1) << (level * 9 + 12));
+    // Skip the kernel address space
+    if ((current_va_high >= VA_MAX && current_va_low >= VA_MAX) ||
+        (current_va_high < VA_MIN && current_va_low < VA_MIN))
+      continue;
+    if (level == 0 || pte->huge_page) { // a frame
+      if (current_va_low == INTSTACK_VIRTUAL_ADDRESS_BOTTOM ||
+          current_va_low == SYSCALLSTACK_VIRTUAL_ADDRESS_BOTTOM) {
+        kept = true;
+        continue;
+      }
+      kpage_put((void *)P2V(pte_follow(*pte)),
+                pte->huge_page ? HUGE_PAGE_ORDER : 0);
+      *pte = (struct pte_t){0};
+      continue;
+    }
+    pagetable_t inner_pagetable = (pagetable_t)P2V(pte_follow(*pte));
+    if (vmm_user_pagetable_clear_recursive(inner_pagetable, current_va_low,
+                                           level - 1)) {
+      kept = true;
+      continue;
+    }
+    kfree(inner_pagetable);
+    MEM_COUNTER_ADD(pagetable_pages, -1);
+    *pte = (struct pte_t){0};
+  }
+  return kept;
+}
+
+/**
+ * Recursively counts the present frames in the userspace part of a page
+ * table. The initial call must be like vmm_user_pagetable_free_recursive.
+ */
+static uint64_t vmm_user_resident_pages_recursive(pagetable_t pagetable,
+                                                  const uint64_t initial_va,
+                                                  int level) {
+  uint64_t result = 0;
+  for (size_t i = 0; i < PAGETABLE_PTE_COUNT; i++) {
+    const struct pte_t pte = pagetable[i];
+    if (!pte.present)
+      continue;
+    const uint64_t current_va_low = initial_va | (i << (level * 9 + 12));
+    const uint64_t current_va_high = initial_va | ((i + 1) << (level * 9 + 12));
+    // Skip the kernel address space
+    if ((current_va_high >= VA_MAX && current_va_low >= VA_MAX) ||
+        (current_va_high < VA_MIN && current_va_low < VA_MIN))
+      continue;
+    if (level == 0)
+      result++;
+    else if (pte.huge_page)
+      result += 1ULL << (level * 9);
+    else
+      result += vmm_user_resident_pages_recursive(
+          (pagetable_t)P2V(pte_follow(pte)), current_va_low, level - 1);
+  }
+  return result;
+}
+
+/**
+ * Counts the frames which are mapped in the userspace part of a page table.
+ * This includes the user, interrupt and syscall stacks of the process.
+ */
+uint64_t vmm_user_resident_pages(pagetable_t pagetable) {
+  return vmm_user_resident_pages_recursive(pagetable, 0, 3);
 }
 
 /**
  * Frees all pages of a user program from a pagetable.
- * After that, the page table pages are also deleted.
+ * After that, the page table pages are also deleted. The page-table pages of
+ * the kernel half are shared and are not touched.
  */
 void vmm_user_pagetable_free(pagetable_t pagetable) {
-  // At first free the pages related to user stack, interrupt stack and
-  // syscall stack
-  uint64_t stack;
-  stack = vmm_walkaddr(pagetable, USER_STACK_BOTTOM, true);
-  if (stack == 0)
-    panic("vmm_user_pagetable_free: user stack");
-  kfree((void *)P2V(stack));
-  stack = vmm_walkaddr(pagetable, INTSTACK_VIRTUAL_ADDRESS_BOTTOM, false);
-  if (stack == 0)
+  // Sanity check the stacks. They are mapped between VA_MIN and VA_MAX thus
+  // they are freed with the rest of the user pages.
+  if (vmm_walkaddr(pagetable, INTSTACK_VIRTUAL_ADDRESS_BOTTOM, false) == 0)
     panic("vmm_user_pagetable_free: interrupt stack");
-  kfree((void *)P2V(stack));
-  stack = vmm_walkaddr(pagetable, SYSCALLSTACK_VIRTUAL_ADDRESS_BOTTOM, false);
-  if (stack == 0)
+  if (vmm_walkaddr(pagetable, SYSCALLSTACK_VIRTUAL_ADDRESS_BOTTOM, false) == 0)
     panic("vmm_user_pagetable_free: syscall stack");
-  kfree((void *)P2V(stack));
   // Now we have to recursively look at any page between VA_MAX and VA_MIN
   vmm_user_pagetable_free_recursive(pagetable, 0, 3);
 }
 
 /**
- * For an sbrk with positive delta it will allocate the new pages (if needed)
- * and return the new sbrk value to set in the PCB.
+ * Frees the userspace memory of a page table but keeps its interrupt and
+ * syscall stacks, thus the page table looks like a new one from
+ * vmm_user_pagetable_new and can be used for another process. The contents
+ * of the stacks are not cleared. The page table must not be installed.
+ */
+void vmm_user_pagetable_clear(pagetable_t pagetable) {
+  if (vmm_walkaddr(pagetable, INTSTACK_VIRTUAL_ADDRESS_BOTTOM, false) == 0)
+    panic("vmm_user_pagetable_clear: interrupt stack");
+  if (vmm_walkaddr(pagetable, SYSCALLSTACK_VIRTUAL_ADDRESS_BOTTOM, false) == 0)
+    panic("vmm_user_pagetable_clear: syscall stack");
+  vmm_user_pagetable_clear_recursive(pagetable, 0, 3);
+}
+
+/**
+ * Recursively shares the userspace frames of src with dst. Writable pages are
+ * made read only in both page tables and are marked copy-on-write, except the
+ * ones which are explicitly shared (see pte_t.shared). The user stack is
+ * shared just like the rest of the memory. The interrupt and syscall stacks
+ * are skipped because each process has its own kernel stacks. The initial
+ * call must be like vmm_user_pagetable_free_recursive. Returns 0 on success,
+ * -1 if we are out of memory.
  */
-uint64_t vmm_user_sbrk_allocate(pagetable_t pagetable, uint64_t old_sbrk,
-                                uint64_t delta) {
-  uint64_t new_sbrk = old_sbrk + delta;
-  old_sbrk = PAGE_ROUND_UP(old_sbrk);
-  for (uint64_t currently_allocating = old_sbrk;
-       currently_allocating < new_sbrk; currently_allocating += PAGE_SIZE) {
-    if (vmm_allocate(
-            pagetable, currently_allocating, PAGE_SIZE,
-            (pte_permissions){.writable = 1, .executable = 0, .userspace = 1},
-            true) < 0) {
-      // TODO: handle OOM
-      panic("sbrk: OOM");
-      break;
+static int vmm_user_pagetable_fork_recursive(pagetable_t dst, pagetable_t src,
+                                             const uint64_t initial_va,
+                                             int level) {
+  for (size_t i = 0; i < PAGETABLE_PTE_COUNT; i++) {
+    struct pte_t *src_pte = &src[i];
+    if (!src_pte->present)
+      continue;
+    const uint64_t current_va_low = initial_va | (i << (level * 9 + 12));
+    const uint64_t current_va_high = initial_va | ((i + 1) << (level * 9 + 12));
+    // Skip the kernel address space
+    if ((current_va_high >= VA_MAX && current_va_low >= VA_MAX) ||
+        (current_va_high < VA_MIN && current_va_low < VA_MIN))
+      continue;
+    if (level == 0 || src_pte->huge_page) { // a frame
+      if (current_va_low == INTSTACK_VIRTUAL_ADDRESS_BOTTOM ||
+          current_va_low == SYSCALLSTACK_VIRTUAL_ADDRESS_BOTTOM)
+        continue;
+      if (src_pte->rw && !src_pte->shared) {
+        src_pte->rw = 0;
+        src_pte->cow = 1;
+      }
+      kpage_share((void *)P2V(pte_follow(*src_pte)));
+      dst[i] = *src_pte;
+      continue;
+    }
+    // The page tables of the kernel stacks already exist in dst
+    struct pte_t *dst_pte = &dst[i];
+    if (!dst_pte->present) {
+      pagetable_t inner_pagetable = (pagetable_t)kcalloc();
+      if (inner_pagetable == NULL)
+        return -1;
+      MEM_COUNTER_ADD(pagetable_pages, 1);
+      dst_pte->present = 1;
+      dst_pte->xd = 0;
+      dst_pte->rw = 1;
+      dst_pte->us = 1;
+      dst_pte->address = PTE_GET_PHY_ADDRESS(V2P(inner_pagetable));
     }
+    if (vmm_user_pagetable_fork_recursive(
+            (pagetable_t)P2V(pte_follow(*dst_pte)),
+            (pagetable_t)P2V(pte_follow(*src_pte)), current_va_low,
+            level - 1) != 0)
+      return -1;
   }
-  return new_sbrk;
+  return 0;
+}
+
+/**
+ * Makes dst a copy-on-write copy of the userspace of src. Frames are not
+ * copied; Both page tables point to the same frames and the writable ones are
+ * copied on the first write to them. dst must be a new pagetable from
+ * vmm_user_pagetable_new and its kernel stacks are not touched.
+ *
+ * The writable pages of src become read only, thus the TLB of src must be
+ * flushed after this function, even if it fails. On failure, dst must be
+ * freed by the caller. Returns 0 on success, -1 if we are out of memory.
+ */
+int vmm_user_pagetable_fork(pagetable_t dst, pagetable_t src) {
+  return vmm_user_pagetable_fork_recursive(dst, src, 0, 3);
+}
+
+/**
+ * Handles a write to a present copy-on-write page. If the frame is still
+ * shared, the page gets a private copy of it; Otherwise, the page is simply
+ * made writable again. The pagetable must be the installed one. Returns 0 on
+ * success, -1 if va is not a copy-on-write page or we are out of memory.
+ */
+int vmm_user_cow_fault(pagetable_t pagetable, uint64_t va) {
+  if (va < VA_MIN || va >= VA_MAX)
+    return -1;
+  struct pte_t *pte = walk(pagetable, va, false, false);
+  if (pte == NULL || !pte->present || !pte->us || !pte->cow)
+    return -1;
+  return cow_break(pte, va);
+}
+
+/**
+ * A 2MB block which is faulted in page by page is promoted to a huge page
+ * once this many of its pages are present. Sparse blocks stay small.
+ */
+#define HUGE_PAGE_PROMOTE_PAGES 384
+
+/**
+ * Replaces the page table which maps the 2MB block at va with a huge page if
+ * the block is dense enough. The present pages are copied into the huge page
+ * and the rest of it is zeroed. Nothing is done if any present page is
+ * copy-on-write, shared or has other permissions than the given ones. The
+ * pagetable must be the installed one because the TLB is flushed.
+ */
+static void promote_huge_page(pagetable_t pagetable, uint64_t va,
+                              pte_permissions permissions) {
+  struct pte_t *pde = walk_level(pagetable, va, false, false, 1);
+  if (pde == NULL || !pde->present || pde->huge_page)
+    return;
+  const pagetable_t table = (pagetable_t)P2V(pte_follow(*pde));
+  size_t present = 0;
+  for (size_t i = 0; i < PAGETABLE_PTE_COUNT; i++) {
+    const struct pte_t pte = table[i];
+    if (!pte.present)
+      continue;
+    if (pte.cow || pte.shared || pte.rw != permissions.writable ||
+        pte.xd != !permissions.executable ||
+        kpage_shared((void *)P2V(pte_follow(pte))))
+      return;
+    present++;
+  }
+  if (present < HUGE_PAGE_PROMOTE_PAGES)
+    return;
+  char *frame = kalloc_pages(HUGE_PAGE_ORDER);
+  if (frame == NULL) // not enough contiguous memory, stay small
+    return;
+  for (size_t i = 0; i < PAGETABLE_PTE_COUNT; i++) {
+    if (table[i].present)
+      memcpy(frame + i * PAGE_SIZE, (void *)P2V(pte_follow(table[i])),
+             PAGE_SIZE);
+    else
+      memset(frame + i * PAGE_SIZE, 0, PAGE_SIZE);
+  }
+  *pde = (struct pte_t){0};
+  set_huge_page(pde, V2P(frame), permissions);
+  flush_tlb();
+  // Now the old pages and their page table can be freed
+  for (size_t i = 0; i < PAGETABLE_PTE_COUNT; i++)
+    if (table[i].present)
+      kpage_put((void *)P2V(pte_follow(table[i])), 0);
+  kfree(table);
+  MEM_COUNTER_ADD(pagetable_pages, -1);
+}
+
+/**
+ * Backs the page of va with a zeroed frame after a page fault. va must be in
+ * the region [region_start, region_end). If the 2MB aligned block of va is
+ * entirely in the region and most of its pages are present after this, the
+ * block is promoted to a huge page (see promote_huge_page). The first fault
+ * of a block never allocates a huge page, thus sparse buffers stay small.
+ * Returns 0 on success, -1 if we are out of memory.
+ */
+int vmm_allocate_on_fault(pagetable_t pagetable, uint64_t va,
+                          uint64_t region_start, uint64_t region_end,
+                          pte_permissions permissions) {
+  if (vmm_allocate(pagetable, PAGE_ROUND_DOWN(va), PAGE_SIZE, permissions,
+                   true) != 0)
+    return -1;
+  const uint64_t huge_page = HUGE_PAGE_ROUND_DOWN(va);
+  if (huge_page >= region_start && huge_page + HUGE_PAGE_SIZE <= region_end)
+    promote_huge_page(pagetable, huge_page, permissions);
+  return 0;
+}
+
+/**
+ * Maximum number of frames which vmm_user_unmap frees at once
+ */
+#define UNMAP_BATCH_SIZE 32
+
+/**
+ * If a batch of unmapped pages spans more pages than this, the whole TLB of
+ * the address space is flushed instead of invalidating each page.
+ */
+#define UNMAP_INVLPG_MAX 8
+
+/**
+ * The frames which are unmapped but not freed yet. They must not be freed
+ * before their TLB entries are invalidated.
+ */
+struct unmap_batch {
+  void *frames[UNMAP_BATCH_SIZE];
+  size_t count;
+  // The lowest and highest unmapped pages of this batch
+  uint64_t first_va, last_va;
+};
+
+/**
+ * Invalidates the TLB entries of the unmapped pages of a batch and drops
+ * their frames.
+ */
+static void unmap_batch_flush(struct unmap_batch *batch) {
+  if (batch->count == 0)
+    return;
+  if ((batch->last_va - batch->first_va) / PAGE_SIZE >= UNMAP_INVLPG_MAX)
+    flush_tlb();
+  else
+    for (uint64_t va = batch->first_va; va <= batch->last_va; va += PAGE_SIZE)
+      invlpg(va);
+  for (size_t i = 0; i < batch->count; i++)
+    kpage_put(batch->frames[i], 0);
+  batch->count = 0;
+}
+
+/**
+ * Unmaps the pages in [start, end) of a user pagetable and drops the frames.
+ * start and end must be page aligned. Huge pages which are partially unmapped
+ * are split into normal pages. Pages which were never touched are not
+ * allocated and are skipped. Each page table is walked from the root once and
+ * the frames are freed in batches after their TLB entries are invalidated.
+ * The pagetable must be the installed one because the TLB entries of the
+ * removed pages are invalidated with invlpg or a TLB flush.
+ */
+void vmm_user_unmap(pagetable_t pagetable, uint64_t start, uint64_t end) {
+  if (start % PAGE_SIZE != 0 || end % PAGE_SIZE != 0)
+    panic("vmm_user_unmap: not aligned");
+  struct unmap_batch batch = {.count = 0};
+  uint64_t va = start;
+  while (va < end) {
+    // Each step covers the part of the range in the page table of va
+    const uint64_t huge_page = HUGE_PAGE_ROUND_DOWN(va);
+    const uint64_t step_end = MIN_SAFE(huge_page + HUGE_PAGE_SIZE, end);
+    struct pte_t *pte = walk_level(pagetable, va, false, false, 1);
+    if (pte == NULL || !pte->present) { // never touched
+      va = step_end;
+      continue;
+    }
+    if (pte->huge_page) {
+      if (va == huge_page &&
+          step_end == huge_page + HUGE_PAGE_SIZE) { // free the whole huge page
+        pte->present = 0;
+        pte->huge_page = 0;
+        invlpg(huge_page);
+        kpage_put((void *)P2V(pte_follow(*pte)), HUGE_PAGE_ORDER);
+        va = step_end;
+        continue;
+      }
+      // Only a part of the huge page is deallocated. The normal pages of a
+      // split huge page are freed one by one, thus the huge page must not be
+      // shared with another process. The TLB entry of the huge page is
+      // invalidated with the pages which are unmapped below.
+      if ((pte->cow && cow_break(pte, huge_page) != 0) ||
+          split_huge_page(pte) != 0)
+        panic("vmm_user_unmap: OOM");
+    }
+    // Clear the PTEs of this page table in a row
+    struct pte_t *ptes = (pagetable_t)P2V(pte_follow(*pte));
+    for (; va < step_end; va += PAGE_SIZE) {
+      struct pte_t *leaf = &ptes[PTE_INDEX_FROM_VA(va, 0)];
+      if (!leaf->present)
+        continue;
+      leaf->present = 0;
+      if (batch.count == UNMAP_BATCH_SIZE)
+        unmap_batch_flush(&batch);
+      if (batch.count == 0)
+        batch.first_va = va;
+      batch.last_va = va;
+      batch.frames[batch.count++] = (void *)P2V(pte_follow(*leaf));
+    }
+  }
+  unmap_batch_flush(&batch);
 }
 
 /**
  * Deallocated memory in a range of [old_sbrk, old_sbrk - delta].
- * Will not partially remove allocated pages.
- * Will return the new sbrk value set to old_sbrk - delta. This function
- * will not fail unless the page table contains unallocated pages.
+ * Will not partially remove allocated pages. See vmm_user_unmap.
+ * Will return the new sbrk value set to old_sbrk - delta.
  */
 uint64_t vmm_user_sbrk_deallocate(pagetable_t pagetable, uint64_t old_sbrk,
                                   uint64_t delta) {
-  uint64_t new_sbrk = old_sbrk - delta;
-  old_sbrk = PAGE_ROUND_DOWN(old_sbrk);
-  for (uint64_t currently_deallocating = old_sbrk;
-       currently_deallocating > new_sbrk; currently_deallocating -= PAGE_SIZE) {
-    // Find the frame allocated
-    struct pte_t *pte = walk(pagetable, currently_deallocating, false, false);
-    if (pte == NULL)
-      panic("vmm_user_sbrk_deallocate: non-existant page");
-    // Mark it invalid in the page table
-    pte->present = 0;
-    // Delete the frame
-    kfree((void *)P2V(pte_follow(*pte)));
-  }
+  const uint64_t new_sbrk = old_sbrk - delta;
+  vmm_user_unmap(pagetable, PAGE_ROUND_UP(new_sbrk), PAGE_ROUND_UP(old_sbrk));
   return new_sbrk;
 }
 
@@ -456,7 +1020,7 @@ int vmm_memcpy(pagetable_t pagetable, uint64_t destination_virtual_address,
     struct pte_t *pte = walk(pagetable, va0, false, false);
     if (pte == 0 || !pte->present || pte->us != userspace || !pte->rw)
       return -1; // invalid page
-    uint64_t pa0 = P2V(pte_follow(*pte));
+    uint64_t pa0 = P2V(pte_frame_address(*pte, va0));
     uint64_t n = PAGE_SIZE - (destination_virtual_address - va0);
     if (n > len)
       n = len;
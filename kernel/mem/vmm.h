@@ -7,6 +7,16 @@
 #endif
 #include "mem.h"
 
+/**
+ * Size of a huge page which is mapped by a level 1 PTE (2MB)
+ */
+#define HUGE_PAGE_SIZE (1ULL << 21)
+
+/**
+ * The order of the block of the buddy allocator which backs a huge page
+ */
+#define HUGE_PAGE_ORDER 9
+
 /**
  * Max virtual address of a memory in a process. This is not The max actual
  * virtual address because Limine puts its stuff in there. So we go a little bit
@@ -18,16 +28,34 @@
  */
 #define VA_MIN (1ULL << 22)
 
+/**
+ * The range of the virtual address space which mmap places the mappings in.
+ * The heap can grow up to USER_MMAP_BASE.
+ */
+#define USER_MMAP_BASE (1ULL << 44)
+#define USER_MMAP_END (USER_MMAP_BASE + (1ULL << 43))
+
 /**
  * Where we should put the top of the stack in the virtual address space
  */
 #define USER_STACK_TOP (1ULL << 45)
 
 /**
- * Where we should put the bottom of the stack in the virtual address space
+ * The page at the top of the stack. It is mapped by exec to hold the
+ * arguments of the program. The rest of the stack is allocated on demand.
  */
 #define USER_STACK_BOTTOM (USER_STACK_TOP - PAGE_SIZE)
 
+/**
+ * Maximum size of the user stack and the lowest address which it can grow
+ * to. The page just below the limit is a guard page which is never mapped,
+ * thus a stack overflow kills the program instead of corrupting the memory
+ * below the stack.
+ */
+#define USER_STACK_MAX_SIZE (8 * 1024 * 1024)
+#define USER_STACK_LIMIT (USER_STACK_TOP - USER_STACK_MAX_SIZE)
+#define USER_STACK_GUARD (USER_STACK_LIMIT - PAGE_SIZE)
+
 /**
  * Interrupt stack virtual address. Used when userspace is switching to kernel
  * space to store the interrupt stack. Interrupt stack is one page only.
@@ -58,6 +86,9 @@ typedef struct {
   uint8_t executable : 1;
   // If 1, this is a userspace page
   uint8_t userspace : 1;
+  // If 1, the page stays shared with the children after fork instead of
+  // being copied on write. Used by the shared memory segments.
+  uint8_t shared : 1;
 } pte_permissions;
 
 /**
@@ -89,8 +120,14 @@ struct pte_t {
   uint64_t huge_page : 1;
   // Global page. We don't use them so we set this to zero.
   uint64_t global : 1;
+  // Ignored by CPU. We set it on the read only pages which are shared
+  // copy-on-write between processes and must be copied on the first write.
+  uint64_t cow : 1;
+  // Ignored by CPU. We set it on the writable pages which are shared between
+  // processes on purpose. Fork shares them as is instead of copy-on-write.
+  uint64_t shared : 1;
   // Ignored by CPU, can be used by us
-  uint64_t ignored2 : 3;
+  uint64_t ignored2 : 1;
   // The physical address of page or frame. 34-bits is enough for 16 GB of
   // memory. Who the fuck wants to run this shit on a PC with more than 16 GB of
   // memory?
@@ -111,18 +148,30 @@ _Static_assert(sizeof(struct pte_t) == 8, "Each PTE must be 8 bytes");
 typedef struct pte_t *pagetable_t;
 
 extern pagetable_t kernel_pagetable;
+extern bool vmm_pcid_enabled;
 
 void vmm_init_kernel(const struct limine_kernel_address_response);
 uint64_t vmm_walkaddr(pagetable_t pagetable, uint64_t va, bool user);
+bool vmm_user_accessible(pagetable_t pagetable, uint64_t va, bool write);
 int vmm_map_pages(pagetable_t pagetable, uint64_t va, uint64_t size,
                   uint64_t pa, pte_permissions permissions);
 int vmm_allocate(pagetable_t pagetable, uint64_t va, uint64_t size,
                  pte_permissions permissions, bool clear);
+int vmm_map_shared(pagetable_t pagetable, uint64_t va, void *frame,
+                   pte_permissions permissions);
+size_t vmm_map_frames(pagetable_t pagetable, uint64_t va, void *const *frames,
+                      size_t count, pte_permissions permissions, bool cow);
 void *vmm_io_memmap(uint64_t pa, uint64_t size);
 pagetable_t vmm_user_pagetable_new();
 void vmm_user_pagetable_free(pagetable_t pagetable);
-uint64_t vmm_user_sbrk_allocate(pagetable_t pagetable, uint64_t old_sbrk,
-                                uint64_t delta);
+void vmm_user_pagetable_clear(pagetable_t pagetable);
+int vmm_user_pagetable_fork(pagetable_t dst, pagetable_t src);
+int vmm_user_cow_fault(pagetable_t pagetable, uint64_t va);
+uint64_t vmm_user_resident_pages(pagetable_t pagetable);
+int vmm_allocate_on_fault(pagetable_t pagetable, uint64_t va,
+                          uint64_t region_start, uint64_t region_end,
+                          pte_permissions permissions);
+void vmm_user_unmap(pagetable_t pagetable, uint64_t start, uint64_t end);
 uint64_t vmm_user_sbrk_deallocate(pagetable_t pagetable, uint64_t old_sbrk,
                                   uint64_t delta);
 int vmm_memcpy(pagetable_t pagetable, uint64_t destination_virtual_address,
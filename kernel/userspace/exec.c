@@ -4,6 +4,7 @@
 #include "device/serial_port.h"
 #include "CrowFS/crowfs.h"
 #include "fs/device.h"
+#include "fs/filemap.h"
 #include "fs/fs.h"
 #include "include/exec.h"
 #include "include/file.h"
@@ -66,29 +67,81 @@ static pte_permissions flags2perm(int flags) {
 }
 
 /**
- * Loads a segment from the ELF file to the memory. The pages of the ELF file
- * must be already allocated.
+ * Number of pages of a segment which are gathered before mapping them at
+ * once. The frames are kept on the syscall stack, thus this must be small.
+ */
+#define LOAD_BATCH_SIZE 16
+
+/**
+ * Reads a page of a segment into a private frame and zeroes the bytes after
+ * the n bytes of file data. Returns NULL on error.
+ */
+static void *load_private_page(struct fs_inode *ip, uint64_t offset,
+                               uint64_t n) {
+  char *frame = kalloc();
+  if (frame == NULL)
+    return NULL;
+  if (fs_read(ip, frame, n, offset) != (int)n) {
+    kfree(frame);
+    return NULL;
+  }
+  memset(frame + n, 0, PAGE_SIZE - n);
+  return frame;
+}
+
+/**
+ * Drops the frames which are not mapped
+ */
+static void put_frames(void *const *frames, size_t count) {
+  for (size_t i = 0; i < count; i++)
+    kpage_put(frames[i], 0);
+}
+
+/**
+ * Maps the pages of a segment which contain the file data. Pages which only
+ * hold the file data come from the file page cache and are shared with every
+ * process running the same binary. Read only pages are mapped as is and
+ * writable pages are mapped copy-on-write.
+ *
+ * The page which holds the end of the file data of a segment with bss must
+ * have zeros after the file data. Such a page (and every page of a segment
+ * which is not page aligned in the file) gets a private frame which the file
+ * data is copied into. The rest of the bss is allocated on demand.
+ *
+ * The frames are gathered in batches which are mapped with vmm_map_frames.
+ * Shared and private frames are never mixed in a batch.
  */
 static int load_segment(pagetable_t pagetable, struct fs_inode *ip, uint64_t va,
-                        uint32_t offset, uint32_t sz) {
-  /**
-   * Note: You might wonder: Why we get the physical address instead of just
-   * using the virtual address if the page table is mapped? Well, in some cases
-   * (like .rodata or .text) the MMU maps that section as read only. Thus, we
-   * cannot write to that data. Instead, we can write to the physical address of
-   * the frame and that works just fine.
-   */
-  for (uint32_t i = 0; i < sz; i += PAGE_SIZE) {
-    uint64_t phyiscal_address = vmm_walkaddr(pagetable, va + i, true);
-    if (phyiscal_address == 0)
-      panic("load_segment: address should exist");
-    uint64_t n;
-    if (sz - i < PAGE_SIZE)
-      n = sz - i;
-    else
-      n = PAGE_SIZE;
-    if (fs_read(ip, (char *)P2V(phyiscal_address), n, offset + i) != (int)n)
+                        uint64_t offset, uint64_t sz, uint64_t memsz,
+                        pte_permissions permissions) {
+  void *frames[LOAD_BATCH_SIZE];
+  const uint64_t file_pages_size = PAGE_ROUND_UP(sz);
+  for (uint64_t i = 0; i < file_pages_size;) {
+    size_t count = 0;
+    bool shared = false;
+    for (; count < LOAD_BATCH_SIZE && i + count * PAGE_SIZE < file_pages_size;
+         count++) {
+      const uint64_t page = i + count * PAGE_SIZE;
+      const uint64_t n = MIN_SAFE(sz - page, (uint64_t)PAGE_SIZE);
+      const bool page_shared =
+          offset % PAGE_SIZE == 0 && (n == PAGE_SIZE || memsz == sz);
+      if (count != 0 && page_shared != shared)
+        break;
+      shared = page_shared;
+      frames[count] = shared ? filemap_get_page(ip, offset + page)
+                             : load_private_page(ip, offset + page, n);
+      if (frames[count] == NULL) {
+        put_frames(frames, count);
+        return -1;
+      }
+    }
+    const size_t mapped =
+        vmm_map_frames(pagetable, va + i, frames, count, permissions, shared);
+    if (mapped != count) {
+      put_frames(frames + mapped, count - mapped);
       return -1;
+    }
+    i += count * PAGE_SIZE;
   }
   return 0;
 }
@@ -132,16 +185,35 @@ uint64_t proc_exec(const char *path, const char *args[],
       goto bad;
     if (ph.vaddr % PAGE_SIZE != 0)
       goto bad;
-    // Load the segments in the memory
-    if (vmm_allocate(proc->pagetable, ph.vaddr, PAGE_ROUND_UP(ph.memsz),
-                     flags2perm(ph.flags), false) == -1)
+    // Load the pages which contain the file data in the memory. The pages
+    // after them (bss) are zero and allocated on the first access.
+    const uint64_t file_pages_size = PAGE_ROUND_UP(ph.filesz);
+    const uint64_t memory_pages_size = PAGE_ROUND_UP(ph.memsz);
+    if (load_segment(proc->pagetable, proc_inode, ph.vaddr, ph.off,
+                     ph.filesz, ph.memsz, flags2perm(ph.flags)) < 0)
       goto bad;
-    if (load_segment(proc->pagetable, proc_inode, ph.vaddr, ph.off, ph.filesz) <
-        0)
+    if (memory_pages_size > file_pages_size &&
+        proc_add_region(proc, ph.vaddr + file_pages_size,
+                        ph.vaddr + memory_pages_size,
+                        flags2perm(ph.flags)) == -1)
       goto bad;
     proc->initial_data_segment = MAX_SAFE(proc->initial_data_segment,
                                           ph.vaddr + PAGE_ROUND_UP(ph.memsz));
   }
+  // Reserve the user stack. Only its top page, which holds the arguments, is
+  // allocated here and the rest is allocated when the stack grows.
+  const pte_permissions stack_permissions = {
+      .writable = 1, .executable = 0, .userspace = 1};
+  if (vmm_allocate(proc->pagetable, USER_STACK_BOTTOM, PAGE_SIZE,
+                   stack_permissions, true) == -1)
+    goto bad;
+  proc->regions[STACK_REGION] = (struct memory_region){
+      .start = USER_STACK_LIMIT,
+      .end = USER_STACK_TOP,
+      .permissions = stack_permissions,
+      .used = true,
+  };
+
   // Write the arguments to the user stack
   uint64_t rsp = USER_STACK_TOP;
   uint64_t argument_pointers[MAX_ARGV] = {0};
@@ -205,6 +277,12 @@ uint64_t proc_exec(const char *path, const char *args[],
   // Setup the values for the sbrk syscall
   proc->initial_data_segment = PAGE_ROUND_UP(proc->initial_data_segment);
   proc->current_sbrk = proc->initial_data_segment;
+  proc->regions[HEAP_REGION] = (struct memory_region){
+      .start = proc->initial_data_segment,
+      .end = proc->initial_data_segment,
+      .permissions = {.writable = 1, .executable = 0, .userspace = 1},
+      .used = true,
+  };
 
   // We are fucking done!
   fs_close(proc_inode);
@@ -4,9 +4,15 @@
 #include "cpu/asm.h"
 #include "cpu/fpu.h"
 #include "cpu/smp.h"
+#include "cpu/traps.h"
 #include "device/rtc.h"
+#include "fs/filemap.h"
 #include "fs/fs.h"
+#include "include/mman.h"
+#include "mem/mem.h"
+#include "mem/pagecache.h"
 #include "userspace/exec.h"
+#include "userspace/shm.h"
 
 /**
  * The kernel stackpointer which we used just before we have switched to
@@ -29,6 +35,22 @@ static uint64_t next_pid = 1;
  */
 static struct process processes[MAX_PROCESSES];
 
+/**
+ * Number of PCIDs. PCID 0 is used by the kernel pagetable.
+ */
+#define PCID_COUNT 4096
+
+/**
+ * PCIDs are given to processes from 1 to PCID_COUNT - 1 when they are
+ * scheduled. When we run out of them, a new generation starts: The whole TLB
+ * is flushed and each process gets a new PCID the next time it runs. A
+ * process whose pcid_generation is not the current one has no valid PCID.
+ *
+ * The scheduler runs on one core only, thus these are not per core.
+ */
+static uint16_t next_pcid = 1;
+static uint64_t pcid_generation = 1;
+
 /**
  * Atomically get the next PID
  */
@@ -38,6 +60,8 @@ static inline uint64_t get_next_pid(void) {
 
 // defined in snippets.S
 extern void context_switch(uint64_t to_rsp, uint64_t *from_rsp);
+// defined in trampoline.S
+extern void fork_return(void);
 
 /**
  * Gets the current running process of this CPU core
@@ -50,6 +74,50 @@ struct process *my_process(void) { return cpu_local()->running_process; }
  */
 void my_process_unlock(void) { condvar_unlock(&my_process()->lock); };
 
+/**
+ * Gets a page table for a new process. A warm page table from the pool of
+ * this core is used if there is one. Otherwise, a new one is built. Returns
+ * NULL if we are out of memory.
+ */
+static pagetable_t process_pool_get(void) {
+  pagetable_t pagetable = NULL;
+  // The pool is local to this core. We only need to make sure that an
+  // interrupt handler does not use it while we are working with it.
+  save_and_disable_interrupts();
+  struct process_pool *pool = &cpu_local()->process_pool;
+  if (pool->count != 0)
+    pagetable = pool->pagetables[--pool->count];
+  restore_interrupts();
+  if (pagetable != NULL) {
+    MEM_COUNTER_ADD(process_pool_hits, 1);
+    return pagetable;
+  }
+  MEM_COUNTER_ADD(process_pool_misses, 1);
+  return vmm_user_pagetable_new();
+}
+
+/**
+ * Frees the memory of an exited process. Its page table is cleared and kept
+ * in the pool of this core if the pool is not full. Otherwise, the page table
+ * is freed. The page table must not be installed.
+ */
+static void process_pool_put(pagetable_t pagetable) {
+  struct process_pool *pool = &cpu_local()->process_pool;
+  if (__atomic_load_n(&pool->count, __ATOMIC_RELAXED) == PROCESS_POOL_SIZE) {
+    vmm_user_pagetable_free(pagetable);
+    return;
+  }
+  vmm_user_pagetable_clear(pagetable);
+  save_and_disable_interrupts();
+  if (pool->count != PROCESS_POOL_SIZE) {
+    pool->pagetables[pool->count++] = pagetable;
+    pagetable = NULL;
+  }
+  restore_interrupts();
+  if (pagetable != NULL) // filled in the meantime
+    vmm_user_pagetable_free(pagetable);
+}
+
 /**
  * Allocate a new process. Will return NULL on error.
  */
@@ -71,7 +139,7 @@ struct process *proc_allocate(void) {
   p->pid = get_next_pid();
   p->exit_status = -1;
   condvar_unlock(&p->lock); // we can do an early unlock here probably
-  p->pagetable = vmm_user_pagetable_new();
+  p->pagetable = process_pool_get();
   if (p->pagetable == NULL) { // well shit
     p->state = UNUSED;
     p->pid = 0;
@@ -79,6 +147,9 @@ struct process *proc_allocate(void) {
   }
   p->current_sbrk = 0;
   p->initial_data_segment = 0;
+  memset(p->regions, 0, sizeof(p->regions));
+  p->pcid = 0;
+  p->pcid_generation = 0; // no PCID yet
   memset(&p->additional_data, 0, sizeof(p->additional_data));
   return p;
 }
@@ -143,6 +214,18 @@ void proc_exit(int exit_code) {
     }
   }
 
+  // Close the mapped files and shared memory segments
+  for (size_t i = 0; i < MAX_MEMORY_REGIONS; i++) {
+    if (proc->regions[i].used && proc->regions[i].file != NULL) {
+      fs_close(proc->regions[i].file);
+      proc->regions[i].file = NULL;
+    }
+    if (proc->regions[i].used && proc->regions[i].shm != NULL) {
+      shm_put(proc->regions[i].shm);
+      proc->regions[i].shm = NULL;
+    }
+  }
+
   // Lock the process to avoid race
   condvar_lock(&proc->lock);
 
@@ -203,19 +286,417 @@ void *proc_sbrk(int64_t how_much) {
   void *before = (void *)p->current_sbrk;
 
   if (how_much > 0) { // allocating memory
-    p->current_sbrk =
-        vmm_user_sbrk_allocate(p->pagetable, p->current_sbrk, how_much);
+    // Pages are allocated on the first access. Just make the heap bigger.
+    if (p->current_sbrk + how_much > USER_MMAP_BASE)
+      return (void *)-1;
+    p->current_sbrk += how_much;
   } else if (how_much < 0) { // deallocating memory
-    if (p->initial_data_segment <= p->current_sbrk + how_much) {
+    if ((int64_t)(p->current_sbrk - p->initial_data_segment) < -how_much) {
       // Do not deallocate memory which is not allocated with sbrk
       how_much = p->initial_data_segment - p->current_sbrk;
     }
     p->current_sbrk =
         vmm_user_sbrk_deallocate(p->pagetable, p->current_sbrk, -how_much);
   }
+  p->regions[HEAP_REGION].end = PAGE_ROUND_UP(p->current_sbrk);
   return before;
 }
 
+/**
+ * Copies one of the kernel stack pages of a process to the same page of
+ * another process.
+ */
+static void copy_stack_page(struct process *dst, struct process *src,
+                            uint64_t va) {
+  const uint64_t dst_frame = vmm_walkaddr(dst->pagetable, va, false);
+  const uint64_t src_frame = vmm_walkaddr(src->pagetable, va, false);
+  if (dst_frame == 0 || src_frame == 0)
+    panic("copy_stack_page");
+  memcpy((void *)P2V(dst_frame), (const void *)P2V(src_frame), PAGE_SIZE);
+}
+
+/**
+ * Creates a copy of the running process. The memory of the child is shared
+ * with the parent and each writable page is copied when either of them
+ * writes to it. The child returns from the syscall just like the parent.
+ *
+ * Returns the PID of the child to the parent and 0 to the child. Returns -1
+ * on error.
+ */
+uint64_t proc_fork(void) {
+  struct process *parent = my_process();
+  struct process *child = proc_allocate();
+  if (child == NULL)
+    return -1;
+  // Share the memory. The parent pages might have become read only even if
+  // this fails.
+  const int result = vmm_user_pagetable_fork(child->pagetable,
+                                             parent->pagetable);
+  flush_tlb();
+  if (result != 0) {
+    vmm_user_pagetable_free(child->pagetable);
+    child->state = UNUSED;
+    child->pid = 0;
+    return -1;
+  }
+  // The saved registers on the syscall stack are copied. The user stack is
+  // copy-on-write like the rest of the memory. The interrupt stack is only
+  // used for the context of the child.
+  copy_stack_page(child, parent, SYSCALLSTACK_VIRTUAL_ADDRESS_BOTTOM);
+  child->initial_data_segment = parent->initial_data_segment;
+  child->current_sbrk = parent->current_sbrk;
+  memcpy(child->regions, parent->regions, sizeof(child->regions));
+  for (size_t i = 0; i < MAX_MEMORY_REGIONS; i++) {
+    if (child->regions[i].used && child->regions[i].file != NULL)
+      fs_dup(child->regions[i].file);
+    if (child->regions[i].used && child->regions[i].shm != NULL)
+      shm_dup(child->regions[i].shm);
+  }
+
+  // Open files are shared with the child
+  for (int i = 0; i < MAX_OPEN_FILES; i++) {
+    child->open_files[i] = parent->open_files[i];
+    if (child->open_files[i].type == FD_INODE)
+      fs_dup(child->open_files[i].structures.inode);
+  }
+  fs_dup(parent->working_directory);
+  child->working_directory = parent->working_directory;
+
+  // The FPU still holds the state of the parent because the kernel does not
+  // use it
+  child->additional_data.gs_base = parent->additional_data.gs_base;
+  fpu_save(child->additional_data.fpu_state);
+
+  // The child starts from fork_return
+  const struct process_context initial_context = {
+      .return_address = (uint64_t)fork_return,
+  };
+  vmm_memcpy(child->pagetable,
+             INTSTACK_VIRTUAL_ADDRESS_TOP - sizeof(struct process_context),
+             &initial_context, sizeof(initial_context), false);
+  child->resume_stack_pointer =
+      INTSTACK_VIRTUAL_ADDRESS_TOP - sizeof(struct process_context);
+  child->state = RUNNABLE; // now we can run this!
+  return child->pid;
+}
+
+/**
+ * Finds an unused memory region of a process. Returns NULL if every region
+ * is used.
+ */
+static struct memory_region *region_find_free(struct process *p) {
+  for (size_t i = 0; i < MAX_MEMORY_REGIONS; i++)
+    if (i != HEAP_REGION && i != STACK_REGION && !p->regions[i].used)
+      return &p->regions[i];
+  return NULL;
+}
+
+/**
+ * Adds a lazily allocated memory region to a process. start and end must be
+ * page aligned. Returns 0 on success, -1 if the process has no free region.
+ */
+int proc_add_region(struct process *p, uint64_t start, uint64_t end,
+                    pte_permissions permissions) {
+  struct memory_region *region = region_find_free(p);
+  if (region == NULL)
+    return -1;
+  *region = (struct memory_region){
+      .start = start,
+      .end = end,
+      .permissions = permissions,
+      .used = true,
+  };
+  return 0;
+}
+
+/**
+ * Maps the page of va from the file which backs a region. If write is set,
+ * the process gets its own copy of the page right away instead of faulting
+ * again on the copy-on-write page. Returns 0 on success, -1 on error.
+ */
+static int region_map_file_page(struct process *p,
+                                const struct memory_region *region,
+                                uint64_t va, bool write) {
+  const uint64_t page = va - va % PAGE_SIZE;
+  void *frame = filemap_get_page(region->file,
+                                 region->file_offset + (page - region->start));
+  if (frame == NULL)
+    return -1;
+  if (vmm_map_shared(p->pagetable, page, frame, region->permissions) == -1) {
+    kpage_put(frame, 0);
+    return -1;
+  }
+  if (write)
+    return vmm_user_cow_fault(p->pagetable, page);
+  return 0;
+}
+
+/**
+ * Finds a free range of the given size in the mmap area of a process.
+ * Returns 0 if there is no such range.
+ */
+static uint64_t mmap_find_gap(const struct process *p, uint64_t length) {
+  uint64_t start = USER_MMAP_BASE;
+  bool moved = true;
+  while (moved) { // move past each region which overlaps the range
+    moved = false;
+    for (size_t i = 0; i < MAX_MEMORY_REGIONS; i++) {
+      const struct memory_region *region = &p->regions[i];
+      if (region->used && region->start < start + length &&
+          start < region->end) {
+        start = region->end;
+        moved = true;
+      }
+    }
+  }
+  if (start + length > USER_MMAP_END)
+    return 0;
+  return start;
+}
+
+/**
+ * Maps a file in the memory of the running process. The pages come from the
+ * file page cache and are mapped on the first access to them, or in this call
+ * if MAP_POPULATE is set. Shared mappings must be read only because nothing
+ * is written back to the file. Writable private mappings are copy-on-write.
+ *
+ * Returns the address of the mapping or MAP_FAILED on error.
+ */
+void *proc_mmap(size_t length, int prot, int flags, int fd, uint64_t offset) {
+  struct process *p = my_process();
+  // Sanity checks
+  if (length == 0 || length > USER_MMAP_END - USER_MMAP_BASE ||
+      offset % PAGE_SIZE != 0)
+    return MAP_FAILED;
+  const bool shared = (flags & MAP_SHARED) != 0;
+  if (shared == ((flags & MAP_PRIVATE) != 0))
+    return MAP_FAILED;
+  if (shared && (prot & PROT_WRITE))
+    return MAP_FAILED;
+  if (fd < 0 || fd >= MAX_OPEN_FILES || p->open_files[fd].type != FD_INODE ||
+      !p->open_files[fd].readble)
+    return MAP_FAILED;
+  struct fs_inode *inode = p->open_files[fd].structures.inode;
+  if (inode->type != INODE_FILE)
+    return MAP_FAILED;
+  // Find a place for it
+  length = PAGE_ROUND_UP(length);
+  const uint64_t start = mmap_find_gap(p, length);
+  struct memory_region *region = region_find_free(p);
+  if (start == 0 || region == NULL)
+    return MAP_FAILED;
+  fs_dup(inode);
+  *region = (struct memory_region){
+      .start = start,
+      .end = start + length,
+      .file = inode,
+      .file_offset = offset,
+      .permissions = {.writable = (prot & PROT_WRITE) != 0,
+                      .executable = (prot & PROT_EXEC) != 0,
+                      .userspace = 1},
+      .used = true,
+  };
+  // Populating is just a hint. The rest of the pages are mapped on demand.
+  if (flags & MAP_POPULATE)
+    for (uint64_t va = start; va < region->end; va += PAGE_SIZE)
+      if (region_map_file_page(p, region, va, false) == -1)
+        break;
+  return (void *)start;
+}
+
+/**
+ * Unmaps the mappings of the mmap area in [address, address + length).
+ * Mappings which partially overlap the range are shrunk or split. Returns 0
+ * on success, -1 on error.
+ */
+int proc_munmap(uint64_t address, size_t length) {
+  struct process *p = my_process();
+  if (address % PAGE_SIZE != 0 || length == 0 || address < USER_MMAP_BASE ||
+      address >= USER_MMAP_END || length > USER_MMAP_END - address)
+    return -1;
+  const uint64_t end = PAGE_ROUND_UP(address + length);
+  // Splitting a region needs a free region. Check it before changing anything.
+  for (size_t i = 0; i < MAX_MEMORY_REGIONS; i++) {
+    const struct memory_region *region = &p->regions[i];
+    if (region->used && region->start < address && region->end > end &&
+        region_find_free(p) == NULL)
+      return -1;
+  }
+  for (size_t i = 0; i < MAX_MEMORY_REGIONS; i++) {
+    struct memory_region *region = &p->regions[i];
+    if (!region->used || region->end <= address || region->start >= end)
+      continue;
+    vmm_user_unmap(p->pagetable, MAX_SAFE(region->start, address),
+                   MIN_SAFE(region->end, end));
+    if (region->start < address && region->end > end) { // split
+      struct memory_region *tail = region_find_free(p);
+      *tail = *region;
+      tail->start = end;
+      tail->file_offset += end - region->start;
+      if (tail->file != NULL)
+        fs_dup(tail->file);
+      if (tail->shm != NULL)
+        shm_dup(tail->shm);
+      region->end = address;
+    } else if (region->start < address) { // keep the head
+      region->end = address;
+    } else if (region->end > end) { // keep the tail
+      region->file_offset += end - region->start;
+      region->start = end;
+    } else { // the whole region
+      if (region->file != NULL)
+        fs_close(region->file);
+      if (region->shm != NULL)
+        shm_put(region->shm);
+      region->used = false;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Maps a shared memory segment in the mmap area of the running process. The
+ * reference of the caller to the segment is given to the new region, or
+ * dropped on error. Returns the address of the mapping or MAP_FAILED.
+ */
+static void *shm_map_segment(struct process *p, struct shm_segment *segment) {
+  const uint64_t length = segment->page_count * PAGE_SIZE;
+  const uint64_t start = mmap_find_gap(p, length);
+  struct memory_region *region = region_find_free(p);
+  if (start == 0 || region == NULL) {
+    shm_put(segment);
+    return MAP_FAILED;
+  }
+  if (shm_map(p->pagetable, start, segment) == -1) {
+    vmm_user_unmap(p->pagetable, start, start + length);
+    shm_put(segment);
+    return MAP_FAILED;
+  }
+  *region = (struct memory_region){
+      .start = start,
+      .end = start + length,
+      .shm = segment,
+      .permissions = {.writable = 1, .executable = 0, .userspace = 1},
+      .used = true,
+  };
+  return (void *)start;
+}
+
+/**
+ * Creates a zeroed shared memory segment of at least size bytes and maps it
+ * in the running process. The address of the mapping is written to address.
+ * Other processes can map the segment with its ID until every process has
+ * unmapped it. The children of the process share the mapping as well.
+ *
+ * Returns the ID of the segment or -1 on error.
+ */
+int proc_shm_create(size_t size, void **address) {
+  struct shm_segment *segment = shm_create(size);
+  if (segment == NULL)
+    return -1;
+  const int id = segment->id;
+  void *start = shm_map_segment(my_process(), segment);
+  if (start == MAP_FAILED)
+    return -1;
+  *address = start;
+  return id;
+}
+
+/**
+ * Maps an existing shared memory segment in the running process. Returns the
+ * address of the mapping or MAP_FAILED on error.
+ */
+void *proc_shm_map(int id) {
+  struct shm_segment *segment = shm_get(id);
+  if (segment == NULL)
+    return MAP_FAILED;
+  return shm_map_segment(my_process(), segment);
+}
+
+/**
+ * Unmaps the shared memory segment which is mapped at address. The segment
+ * is freed when no process maps it. Returns 0 on success, -1 on error.
+ */
+int proc_shm_unmap(uint64_t address) {
+  struct process *p = my_process();
+  for (size_t i = 0; i < MAX_MEMORY_REGIONS; i++) {
+    const struct memory_region *region = &p->regions[i];
+    if (region->used && region->shm != NULL && region->start == address)
+      return proc_munmap(region->start, region->end - region->start);
+  }
+  return -1;
+}
+
+/**
+ * Handles a page fault of the running process at va. If va is in one of the
+ * memory regions of the process and the access is allowed, the page is
+ * backed by a zeroed frame. Writes to copy-on-write pages give the process
+ * its own copy of the page. The fault might come from kernel mode when a
+ * syscall accesses the memory of the program.
+ *
+ * Returns 0 if the fault is handled and the access can be retried. Otherwise
+ * returns -1.
+ */
+int proc_page_fault(uint64_t va, uint64_t error_code) {
+  struct process *p = my_process();
+  if (p == NULL)
+    return -1;
+  // The page exists. Only writes to copy-on-write pages are allowed.
+  if (error_code & PF_PRESENT) {
+    if (error_code & PF_WRITE)
+      return vmm_user_cow_fault(p->pagetable, va);
+    return -1;
+  }
+  for (size_t i = 0; i < MAX_MEMORY_REGIONS; i++) {
+    const struct memory_region *region = &p->regions[i];
+    if (!region->used || va < region->start || va >= region->end)
+      continue;
+    if ((error_code & PF_WRITE) && !region->permissions.writable)
+      return -1;
+    if ((error_code & PF_FETCH) && !region->permissions.executable)
+      return -1;
+    if (region->shm != NULL) // always mapped
+      return -1;
+    if (i == STACK_REGION) // grow the stack one page at a time
+      return vmm_allocate(p->pagetable, PAGE_ROUND_DOWN(va), PAGE_SIZE,
+                          region->permissions, true);
+    if (region->file != NULL)
+      return region_map_file_page(p, region, va, error_code & PF_WRITE);
+    return vmm_allocate_on_fault(p->pagetable, va, region->start, region->end,
+                                 region->permissions);
+  }
+  return -1;
+}
+
+/**
+ * Makes sure that the kernel can access [buffer, buffer + len) of the running
+ * process without faulting. The missing pages are faulted in just like the
+ * process touched them and copy-on-write pages are broken if write is set.
+ * Syscalls must call this before touching a user buffer because a fault in the
+ * middle of the kernel code can't be undone.
+ *
+ * Returns 0 if the buffer is accessible, -1 if it's not.
+ */
+int proc_fault_in(const void *buffer, size_t len, bool write) {
+  struct process *p = my_process();
+  const uint64_t start = (uint64_t)buffer;
+  if (len == 0)
+    return 0;
+  if (start < VA_MIN || start >= USER_STACK_TOP || len > USER_STACK_TOP - start)
+    return -1;
+  for (uint64_t va = PAGE_ROUND_DOWN(start); va < start + len;
+       va += PAGE_SIZE) {
+    if (vmm_user_accessible(p->pagetable, va, write))
+      continue;
+    uint64_t error_code = write ? PF_WRITE : 0;
+    if (vmm_walkaddr(p->pagetable, va, true) != 0)
+      error_code |= PF_PRESENT;
+    if (proc_page_fault(va, error_code) == -1)
+      return -1;
+  }
+  return 0;
+}
+
 /**
  * Sleep the current process for at least the number of milliseconds given as
  * the argument.
@@ -237,6 +718,25 @@ void sys_sleep(uint64_t msec) {
   condvar_unlock(&my_process()->lock);
 }
 
+/**
+ * Writes the number of resident pages of each process in the buffer. Each
+ * process is written in a line like "pid <pid>: <pages>". Returns the number
+ * of characters written.
+ */
+size_t proc_memory_report(char *buffer, size_t size) {
+  size_t written = 0;
+  for (size_t i = 0; i < MAX_PROCESSES; i++) {
+    condvar_lock(&processes[i].lock);
+    if (processes[i].state != UNUSED && processes[i].state != EXITED &&
+        processes[i].pagetable != NULL)
+      written += ksnprintf(buffer + written, size - written, "pid %lu: %lu\n",
+                           processes[i].pid,
+                           vmm_user_resident_pages(processes[i].pagetable));
+    condvar_unlock(&processes[i].lock);
+  }
+  return written;
+}
+
 /**
  * Setup the scheduler by creating a process which runs as the very program
  */
@@ -264,6 +764,31 @@ void scheduler_switch_back(void) {
   context_switch(kernel_stackpointer, &proc->resume_stack_pointer);
 }
 
+/**
+ * Installs the pagetable of a process. If PCIDs are enabled, the TLB entries
+ * of the process from its last run are kept.
+ */
+static void install_process_pagetable(struct process *p) {
+  if (!vmm_pcid_enabled) {
+    install_pagetable(V2P(p->pagetable));
+    return;
+  }
+  if (p->pcid_generation == pcid_generation) {
+    install_pagetable_pcid(V2P(p->pagetable), p->pcid, true);
+    return;
+  }
+  // Give a new PCID to this process
+  if (next_pcid == PCID_COUNT) { // start a new generation
+    pcid_generation++;
+    next_pcid = 1;
+    flush_tlb_all();
+  }
+  p->pcid = next_pcid++;
+  p->pcid_generation = pcid_generation;
+  // Flush whatever is left from the old owners of this PCID
+  install_pagetable_pcid(V2P(p->pagetable), p->pcid, false);
+}
+
 static void load_additional_data_if_needed(struct process *old,
                                            const struct process *new) {
   // In this case, we dont need to do anything. Everything is stored
@@ -289,6 +814,7 @@ void scheduler(void) {
     // turned off; enable them to avoid a deadlock if all
     // processes are waiting.
     sti();
+    bool ran_process = false;
     for (size_t i = 0; i < MAX_PROCESSES; i++) { // look for processes...
       condvar_lock(&processes[i].lock);          // lock them to inspect them...
       switch (processes[i].state) {
@@ -300,18 +826,19 @@ void scheduler(void) {
         cpu_local()->running_process = &processes[i];
         cpu_local()->last_running_process = &processes[i];
         // switch to its memory space...
-        install_pagetable(V2P(processes[i].pagetable));
+        install_process_pagetable(&processes[i]);
         // and run it...
         context_switch(processes[i].resume_stack_pointer, &kernel_stackpointer);
         cpu_local()->running_process = NULL;
+        ran_process = true;
         // until we return and we do everything again!
         break;
       case EXITED:
         // If the pagetable of this process is installed, unload it
         if (get_installed_pagetable() == V2P(processes[i].pagetable))
           install_pagetable(V2P(kernel_pagetable));
-        // Free the memory of the process
-        vmm_user_pagetable_free(processes[i].pagetable);
+        // Free the memory of the process and keep its page table warm
+        process_pool_put(processes[i].pagetable);
         processes[i].state = UNUSED;
         processes[i].pid = 0; // do not give false positive in wait
         processes[i].resume_stack_pointer = 0;
@@ -329,5 +856,10 @@ void scheduler(void) {
       }
       condvar_unlock(&processes[i].lock);
     }
+    // Write back the page cache pages which have been dirty for too long
+    pagecache_writeback_worker();
+    // Nothing to run. Use the time to zero some pages for later.
+    if (!ran_process)
+      kalloc_zero_idle_pages();
   }
 }
\ No newline at end of file
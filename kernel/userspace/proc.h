@@ -31,6 +31,67 @@ struct process_context {
  */
 #define MAX_OPEN_FILES 16
 
+/**
+ * Maximum number of memory regions which a process can have
+ */
+#define MAX_MEMORY_REGIONS 16
+
+/**
+ * The index of the heap in the memory regions of a process. The heap region
+ * grows and shrinks with sbrk.
+ */
+#define HEAP_REGION 0
+
+/**
+ * The index of the user stack in the memory regions of a process. The stack
+ * region covers the whole reserved stack and its pages are allocated one by
+ * one when the stack grows into them.
+ */
+#define STACK_REGION 1
+
+/**
+ * Number of warm page tables which each core keeps for new processes
+ */
+#define PROCESS_POOL_SIZE 4
+
+/**
+ * The page tables of the exited processes which are kept for new processes.
+ * Their userspace is cleared but their kernel half, kernel stacks and the
+ * page table pages of the stacks are kept, thus a new process can skip
+ * building them.
+ */
+struct process_pool {
+  // The warm page tables. Only the first count page tables are valid.
+  pagetable_t pagetables[PROCESS_POOL_SIZE];
+  // Number of page tables in this pool
+  uint32_t count;
+};
+
+/**
+ * A range of the virtual memory of a process which is not backed by frames
+ * until the process touches it. On the first access to each page, the page
+ * fault handler either allocates a zeroed frame for it or maps the page of
+ * the file which backs the region.
+ */
+struct memory_region {
+  // Start of the region. Inclusive and page aligned.
+  uint64_t start;
+  // End of the region. Exclusive and page aligned.
+  uint64_t end;
+  // The file which is mapped in this region or NULL for zeroed memory. The
+  // region holds a reference to the inode.
+  struct fs_inode *file;
+  // Offset of start in the file. Page aligned.
+  uint64_t file_offset;
+  // The shared memory segment which is mapped in this region or NULL. The
+  // region holds a reference to the segment and its pages are always mapped.
+  struct shm_segment *shm;
+  // Permissions of the pages in this region
+  pte_permissions permissions;
+  // Is this region used?
+  bool used;
+};
+
 /**
  * Process specific metadata which we restore just before switching to this
  * process
@@ -58,6 +119,12 @@ struct process {
   uint64_t initial_data_segment;
   // The value returned by sbrk(0)
   uint64_t current_sbrk;
+  // Lazily allocated memory regions of the process
+  struct memory_region regions[MAX_MEMORY_REGIONS];
+  // The PCID which tags the TLB entries of this process. Only valid if
+  // pcid_generation is equal to the current PCID generation.
+  uint16_t pcid;
+  uint64_t pcid_generation;
   // Current working directory inode
   struct fs_inode *working_directory;
   // Store some more specific process data here.
@@ -83,7 +150,18 @@ int proc_allocate_fd(void);
 void proc_exit(int exit_code) __attribute__((noreturn));
 int proc_wait(uint64_t pid);
 void *proc_sbrk(int64_t how_much);
+void *proc_mmap(size_t length, int prot, int flags, int fd, uint64_t offset);
+int proc_munmap(uint64_t address, size_t length);
+int proc_shm_create(size_t size, void **address);
+void *proc_shm_map(int id);
+int proc_shm_unmap(uint64_t address);
+uint64_t proc_fork(void);
+int proc_add_region(struct process *p, uint64_t start, uint64_t end,
+                    pte_permissions permissions);
+int proc_page_fault(uint64_t va, uint64_t error_code);
+int proc_fault_in(const void *buffer, size_t len, bool write);
 void sys_sleep(uint64_t msec);
+size_t proc_memory_report(char *buffer, size_t size);
 void scheduler_init(void);
 void scheduler_switch_back(void);
 void scheduler(void);
\ No newline at end of file
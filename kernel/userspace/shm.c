@@ -0,0 +1,136 @@
+#include "shm.h"
+#include "common/lib.h"
+#include "common/printf.h"
+#include "common/spinlock.h"
+#include "mem/mem.h"
+#include "mem/slab.h"
+
+/**
+ * Maximum number of shared memory segments in the system
+ */
+#define MAX_SHM_SEGMENTS 32
+
+/**
+ * List of all shared memory segments
+ */
+static struct {
+  struct shm_segment segments[MAX_SHM_SEGMENTS];
+  // The ID of the next segment
+  int next_id;
+  // Guards the list
+  struct spinlock lock;
+} shm_list = {.next_id = 1};
+
+/**
+ * Frees the frames of a segment
+ */
+static void shm_free_frames(void **frames, uint64_t page_count) {
+  for (uint64_t i = 0; i < page_count; i++)
+    if (frames[i] != NULL)
+      kpage_put(frames[i], 0);
+  kfree_obj(frames);
+}
+
+/**
+ * Creates a shared memory segment with the given size which is rounded up to
+ * pages. The frames are zeroed. The caller owns the only reference to the
+ * segment and must map it or drop it with shm_put. Returns NULL if there is
+ * no free segment or we are out of memory.
+ */
+struct shm_segment *shm_create(size_t size) {
+  if (size == 0 || size > SHM_MAX_SIZE)
+    return NULL;
+  const uint64_t page_count = PAGE_ROUND_UP(size) / PAGE_SIZE;
+  // Allocate the frames before taking the lock
+  void **frames = kmalloc(page_count * sizeof(void *));
+  if (frames == NULL)
+    return NULL;
+  memset(frames, 0, page_count * sizeof(void *));
+  for (uint64_t i = 0; i < page_count; i++) {
+    frames[i] = kcalloc();
+    if (frames[i] == NULL) {
+      shm_free_frames(frames, page_count);
+      return NULL;
+    }
+  }
+  // Find a free segment
+  spinlock_lock(&shm_list.lock);
+  for (size_t i = 0; i < MAX_SHM_SEGMENTS; i++) {
+    struct shm_segment *segment = &shm_list.segments[i];
+    if (segment->references != 0)
+      continue;
+    segment->id = shm_list.next_id++;
+    segment->page_count = page_count;
+    segment->frames = frames;
+    segment->references = 1;
+    spinlock_unlock(&shm_list.lock);
+    return segment;
+  }
+  spinlock_unlock(&shm_list.lock);
+  shm_free_frames(frames, page_count);
+  return NULL;
+}
+
+/**
+ * Finds a segment by its ID and takes a reference to it. Returns NULL if
+ * there is no such segment.
+ */
+struct shm_segment *shm_get(int id) {
+  spinlock_lock(&shm_list.lock);
+  for (size_t i = 0; i < MAX_SHM_SEGMENTS; i++) {
+    struct shm_segment *segment = &shm_list.segments[i];
+    if (segment->references != 0 && segment->id == id) {
+      segment->references++;
+      spinlock_unlock(&shm_list.lock);
+      return segment;
+    }
+  }
+  spinlock_unlock(&shm_list.lock);
+  return NULL;
+}
+
+/**
+ * Takes another reference to a segment
+ */
+void shm_dup(struct shm_segment *segment) {
+  spinlock_lock(&shm_list.lock);
+  segment->references++;
+  spinlock_unlock(&shm_list.lock);
+}
+
+/**
+ * Drops a reference to a segment. The segment and its frames are freed when
+ * the last reference is dropped. The frames which are still mapped in a page
+ * table are freed when they are unmapped.
+ */
+void shm_put(struct shm_segment *segment) {
+  spinlock_lock(&shm_list.lock);
+  if (segment->references == 0)
+    panic("shm_put: unused segment");
+  if (--segment->references != 0) {
+    spinlock_unlock(&shm_list.lock);
+    return;
+  }
+  void **frames = segment->frames;
+  const uint64_t page_count = segment->page_count;
+  segment->frames = NULL;
+  segment->page_count = 0;
+  spinlock_unlock(&shm_list.lock);
+  shm_free_frames(frames, page_count);
+}
+
+/**
+ * Maps every frame of a segment at va. The pages are writable and stay
+ * shared with the child processes after fork. Returns 0 on success, -1 if we
+ * are out of memory. On failure, the pages which are already mapped must be
+ * unmapped by the caller.
+ */
+int shm_map(pagetable_t pagetable, uint64_t va, struct shm_segment *segment) {
+  const pte_permissions permissions = {
+      .writable = 1, .executable = 0, .userspace = 1, .shared = 1};
+  const size_t mapped = vmm_map_frames(pagetable, va, segment->frames,
+                                       segment->page_count, permissions, false);
+  for (size_t i = 0; i < mapped; i++)
+    kpage_share(segment->frames[i]); // for the page table
+  return mapped == segment->page_count ? 0 : -1;
+}
\ No newline at end of file
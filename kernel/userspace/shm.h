@@ -0,0 +1,32 @@
+#pragma once
+#include "mem/vmm.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Biggest shared memory segment which can be created
+ */
+#define SHM_MAX_SIZE (64 * 1024 * 1024)
+
+/**
+ * A shared memory segment. It is a set of zeroed frames which are mapped in
+ * the processes which use the segment. The segment is freed when it is
+ * unmapped from every process.
+ */
+struct shm_segment {
+  // The ID which processes use to map this segment
+  int id;
+  // Number of pages in this segment
+  uint64_t page_count;
+  // The frames of the segment. The segment owns a share of each frame.
+  void **frames;
+  // Number of memory regions which map this segment. Zero if this segment
+  // is not used.
+  uint32_t references;
+};
+
+struct shm_segment *shm_create(size_t size);
+struct shm_segment *shm_get(int id);
+void shm_dup(struct shm_segment *segment);
+void shm_put(struct shm_segment *segment);
+int shm_map(pagetable_t pagetable, uint64_t va, struct shm_segment *segment);
\ No newline at end of file
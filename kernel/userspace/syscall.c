@@ -37,7 +37,7 @@ void syscall_init(void) {
  * The entry point of the syscall for each process.
  */
 uint64_t syscall_c(uint64_t syscall_number, uint64_t a1, uint64_t a2,
-                   uint64_t a3) {
+                   uint64_t a3, uint64_t a4, uint64_t a5) {
   switch (syscall_number) {
   case SYSCALL_READ:
     return sys_read((int)a1, (char *)a2, (size_t)a3);
@@ -74,6 +74,22 @@ uint64_t syscall_c(uint64_t syscall_number, uint64_t a1, uint64_t a2,
     return sys_chdir((const char *) a1);
   case SYSCALL_READDIR:
     return sys_readdir((int)a1, (void *)a2, (size_t)a3);
+  case SYSCALL_FORK:
+    return proc_fork();
+  case SYSCALL_MMAP:
+    return (uint64_t)proc_mmap((size_t)a1, (int)a2, (int)a3, (int)a4, a5);
+  case SYSCALL_MUNMAP:
+    return proc_munmap(a1, (size_t)a2);
+  case SYSCALL_SHM_CREATE:
+    return proc_shm_create((size_t)a1, (void **)a2);
+  case SYSCALL_SHM_MAP:
+    return (uint64_t)proc_shm_map((int)a1);
+  case SYSCALL_SHM_UNMAP:
+    return proc_shm_unmap(a1);
+  case SYSCALL_SYNC:
+    return sys_sync();
+  case SYSCALL_FSYNC:
+    return sys_fsync((int)a1);
 
   default:
     return -1;
@@ -0,0 +1,867 @@
+#include "include/file.h"
+#include "include/mman.h"
+#include "libc/stdio.h"
+#include "libc/stdlib.h"
+#include "libc/string.h"
+#include "libc/usyscalls.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Micro benchmarks of the kernel and libc. Run "bench" to see the list of
+ * benchmarks. Times are in milliseconds.
+ */
+
+#define PAGE_SIZE 4096
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// Defines this in global scope to avoid stack overflow
+static char meminfo_buffer[4096];
+
+/**
+ * Reads a counter from the meminfo device. Returns 0 if the counter does not
+ * exist.
+ */
+static uint64_t meminfo_counter(const char *name) {
+  int fd = open("meminfo", O_DEVICE | O_RDONLY);
+  if (fd < 0)
+    return 0;
+  int total = 0, n;
+  while ((n = read(fd, meminfo_buffer + total,
+                   sizeof(meminfo_buffer) - 1 - total)) > 0)
+    total += n;
+  close(fd);
+  meminfo_buffer[total] = '\0';
+  const char *line = strstr(meminfo_buffer, name);
+  if (line == NULL)
+    return 0;
+  // Skip ": ". Some counters do not fit in an int, thus atoi is not used.
+  uint64_t value = 0;
+  for (line += strlen(name) + 2; '0' <= *line && *line <= '9'; line++)
+    value = value * 10 + *line - '0';
+  return value;
+}
+
+/**
+ * Writes to random pages of a region and returns the time it took
+ */
+static uint64_t touch_pages(volatile char *region, uint64_t pages,
+                            int rounds) {
+  uint64_t start = time();
+  uint32_t seed = 12345;
+  for (int round = 0; round < rounds; round++) {
+    for (uint64_t i = 0; i < pages; i++) {
+      seed = seed * 1103515245 + 12345;
+      region[(seed % pages) * PAGE_SIZE]++;
+    }
+  }
+  return time() - start;
+}
+
+/**
+ * Compares a heap which is grown and touched page by page (normal pages) with
+ * a heap which is grown in one aligned sbrk (huge pages). Heap pages are
+ * allocated on the first touch and a 2MB block which is entirely in the heap
+ * at that time is backed by a huge page.
+ */
+static void bench_hugepage(int argc, char *argv[]) {
+  uint64_t megabytes = argc > 0 ? atoi(argv[0]) : 64;
+  const int rounds = 8;
+  const uint64_t size = megabytes * 1024 * 1024;
+  const uint64_t pages = size / PAGE_SIZE;
+
+  // Align the heap to 2MB to give both runs the same start
+  uint64_t top = (uint64_t)sbrk(0);
+  sbrk(((top + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1)) - top);
+
+  // Normal pages: grow the heap page by page and touch each new page
+  uint64_t pagetables_before = meminfo_counter("pagetable_pages");
+  uint64_t alloc_start = time();
+  char *region = sbrk(0);
+  for (uint64_t i = 0; i < pages; i++)
+    *(volatile char *)sbrk(PAGE_SIZE) = 0;
+  uint64_t alloc_time = time() - alloc_start;
+  uint64_t pagetables = meminfo_counter("pagetable_pages") - pagetables_before;
+  uint64_t touch_time = touch_pages(region, pages, rounds);
+  printf("4KB pages: grow %llums, random touch %llums, %llu page table pages\n",
+         alloc_time, touch_time, pagetables);
+  sbrk(-(int64_t)size);
+
+  // Huge pages: grow the heap in one go and then touch each page
+  pagetables_before = meminfo_counter("pagetable_pages");
+  alloc_start = time();
+  region = sbrk(size);
+  for (uint64_t i = 0; i < pages; i++)
+    ((volatile char *)region)[i * PAGE_SIZE] = 0;
+  alloc_time = time() - alloc_start;
+  pagetables = meminfo_counter("pagetable_pages") - pagetables_before;
+  touch_time = touch_pages(region, pages, rounds);
+  printf("2MB pages: grow %llums, random touch %llums, %llu page table pages\n",
+         alloc_time, touch_time, pagetables);
+  sbrk(-(int64_t)size);
+}
+
+// Buffers of the string benchmark
+#define STRING_BUFFER_SIZE (64 * 1024)
+static char string_source[STRING_BUFFER_SIZE], string_dest[STRING_BUFFER_SIZE];
+
+static void *bytewise_memcpy(void *dest, const void *src, size_t n) {
+  char *d = dest;
+  const char *s = src;
+  while (n-- > 0)
+    *d++ = *s++;
+  return dest;
+}
+
+static void *bytewise_memset(void *s, int c, size_t n) {
+  char *p = s;
+  while (n-- > 0)
+    *p++ = (char)c;
+  return s;
+}
+
+static size_t bytewise_strlen(const char *s) {
+  size_t n = 0;
+  while (s[n])
+    n++;
+  return n;
+}
+
+static int bytewise_strcmp(const char *p, const char *q) {
+  while (*p && *p == *q)
+    p++, q++;
+  return (uint8_t)*p - (uint8_t)*q;
+}
+
+/**
+ * Prints the throughput of a function which processed the given number of
+ * bytes in the given milliseconds
+ */
+static void print_throughput(const char *name, uint64_t bytes, uint64_t ms) {
+  if (ms == 0)
+    ms = 1;
+  printf("  %s: %llu MB/s\n", name, bytes / ms / 1000);
+}
+
+/**
+ * Compares the vectorized libc string functions with byte loops
+ */
+static void bench_string(int argc, char *argv[]) {
+  const uint64_t size = argc > 0 ? atoi(argv[0]) : 4096;
+  const int rounds = argc > 1 ? atoi(argv[1]) : 10000;
+  if (size == 0 || size >= STRING_BUFFER_SIZE) {
+    fprintf(stderr, "size must be between 1 and %d\n",
+            STRING_BUFFER_SIZE - 1);
+    return;
+  }
+  const uint64_t bytes = size * rounds;
+  memset(string_source, 'a', size);
+  memset(string_dest, 'a', size);
+  string_source[size] = '\0';
+  string_dest[size] = '\0';
+  printf("string functions use %s, %llu bytes x %d rounds\n",
+         string_functions_isa(), size, rounds);
+
+  uint64_t start = time();
+  for (int i = 0; i < rounds; i++)
+    memcpy(string_dest, string_source, size);
+  uint64_t vector_time = time() - start;
+  start = time();
+  for (int i = 0; i < rounds; i++)
+    bytewise_memcpy(string_dest, string_source, size);
+  uint64_t byte_time = time() - start;
+  printf("memcpy\n");
+  print_throughput("libc", bytes, vector_time);
+  print_throughput("byte loop", bytes, byte_time);
+
+  start = time();
+  for (int i = 0; i < rounds; i++)
+    memset(string_dest, 'a', size);
+  vector_time = time() - start;
+  start = time();
+  for (int i = 0; i < rounds; i++)
+    bytewise_memset(string_dest, 'a', size);
+  byte_time = time() - start;
+  printf("memset\n");
+  print_throughput("libc", bytes, vector_time);
+  print_throughput("byte loop", bytes, byte_time);
+
+  volatile size_t length = 0;
+  start = time();
+  for (int i = 0; i < rounds; i++)
+    length += strlen(string_source);
+  vector_time = time() - start;
+  start = time();
+  for (int i = 0; i < rounds; i++)
+    length += bytewise_strlen(string_source);
+  byte_time = time() - start;
+  printf("strlen\n");
+  print_throughput("libc", bytes, vector_time);
+  print_throughput("byte loop", bytes, byte_time);
+
+  volatile int result = 0;
+  start = time();
+  for (int i = 0; i < rounds; i++)
+    result += strcmp(string_source, string_dest);
+  vector_time = time() - start;
+  start = time();
+  for (int i = 0; i < rounds; i++)
+    result += bytewise_strcmp(string_source, string_dest);
+  byte_time = time() - start;
+  printf("strcmp\n");
+  print_throughput("libc", bytes, vector_time);
+  print_throughput("byte loop", bytes, byte_time);
+}
+
+// Live allocations of the malloc benchmark
+#define MALLOC_SLOTS 1024
+static char *malloc_slots[MALLOC_SLOTS];
+static size_t malloc_slot_sizes[MALLOC_SLOTS];
+
+/**
+ * Allocates and frees random sizes and checks that no allocation overwrites
+ * another one. Prints the number of operations per millisecond.
+ */
+static void bench_malloc(int argc, char *argv[]) {
+  const int operations = argc > 0 ? atoi(argv[0]) : 100000;
+  const size_t max_size = argc > 1 ? atoi(argv[1]) : 1024;
+  if (max_size == 0) {
+    fprintf(stderr, "max size must be positive\n");
+    return;
+  }
+  uint32_t seed = 12345;
+  int corruptions = 0;
+  const uint64_t heap_before = (uint64_t)sbrk(0);
+
+  uint64_t start = time();
+  for (int i = 0; i < operations; i++) {
+    seed = seed * 1103515245 + 12345;
+    const uint32_t slot = (seed >> 8) % MALLOC_SLOTS;
+    char *block = malloc_slots[slot];
+    if (block != NULL) {
+      // Check the first and the last byte which we wrote
+      const size_t size = malloc_slot_sizes[slot];
+      if (size > 0 && (block[0] != (char)slot || block[size - 1] != (char)slot))
+        corruptions++;
+      if (seed & 1) {
+        free(block);
+        malloc_slots[slot] = NULL;
+        continue;
+      }
+      // Resize it instead
+      const size_t new_size = (seed >> 16) % max_size + 1;
+      block = realloc(block, new_size);
+      if (block == NULL) {
+        fprintf(stderr, "realloc(%llu) failed\n", (uint64_t)new_size);
+        exit(1);
+      }
+      if (block[0] != (char)slot)
+        corruptions++;
+      malloc_slots[slot] = block;
+      malloc_slot_sizes[slot] = new_size;
+      block[0] = block[new_size - 1] = (char)slot;
+      continue;
+    }
+    const size_t size = (seed >> 16) % max_size + 1;
+    block = malloc(size);
+    if (block == NULL) {
+      fprintf(stderr, "malloc(%llu) failed\n", (uint64_t)size);
+      exit(1);
+    }
+    malloc_slots[slot] = block;
+    malloc_slot_sizes[slot] = size;
+    block[0] = block[size - 1] = (char)slot;
+  }
+  const uint64_t elapsed = time() - start;
+  const uint64_t heap_size = (uint64_t)sbrk(0) - heap_before;
+
+  for (size_t i = 0; i < MALLOC_SLOTS; i++) {
+    free(malloc_slots[i]);
+    malloc_slots[i] = NULL;
+  }
+  printf("%d operations with sizes up to %llu bytes in %llums (%llu ops/ms)\n",
+         operations, (uint64_t)max_size, elapsed,
+         operations / (elapsed == 0 ? 1 : elapsed));
+  printf("heap grew by %llu KB, %d corruptions\n", heap_size / 1024,
+         corruptions);
+}
+
+/**
+ * Does nothing. Used as the child process of the exec benchmark.
+ */
+static void bench_true(int argc, char *argv[]) {
+  (void)argc;
+  (void)argv;
+}
+
+/**
+ * Measures the time it takes to create a process and wait for it. Also
+ * prints how many of the processes got a warm page table from the process
+ * pool and the number of page table pages and frames which a new process
+ * uses.
+ * The code of the child is shared with the other instances of the binary,
+ * thus it does not count in the frames.
+ */
+static void bench_exec(int argc, char *argv[]) {
+  const int runs = argc > 0 ? atoi(argv[0]) : 100;
+  char *child_args[] = {"/bench", "true", NULL};
+
+  uint64_t hits_before = meminfo_counter("process_pool_hits");
+  uint64_t misses_before = meminfo_counter("process_pool_misses");
+  uint64_t start = time();
+  for (int i = 0; i < runs; i++) {
+    int pid = exec(child_args[0], child_args);
+    if (pid < 0) {
+      fprintf(stderr, "cannot exec %s\n", child_args[0]);
+      exit(1);
+    }
+    wait(pid);
+  }
+  uint64_t elapsed = time() - start;
+  printf("%d exec and wait in %llums (process pool: %llu hits, %llu "
+         "misses)\n",
+         runs, elapsed, meminfo_counter("process_pool_hits") - hits_before,
+         meminfo_counter("process_pool_misses") - misses_before);
+
+  // The child does not run until we yield in wait
+  uint64_t pagetables_before = meminfo_counter("pagetable_pages");
+  uint64_t free_before = meminfo_counter("free_pages");
+  int pid = exec(child_args[0], child_args);
+  uint64_t frames = free_before - meminfo_counter("free_pages");
+  uint64_t pagetables = meminfo_counter("pagetable_pages") - pagetables_before;
+  wait(pid);
+  printf("a new process uses %llu page table pages and %llu frames\n",
+         pagetables, frames);
+}
+
+/**
+ * Measures fork and wait with a parent which has a heap of the given size.
+ * The child either exits at once or writes to each page of the heap, which
+ * shows the cost of the copy-on-write faults.
+ */
+static void bench_fork(int argc, char *argv[]) {
+  const int runs = argc > 0 ? atoi(argv[0]) : 100;
+  const uint64_t megabytes = argc > 1 ? atoi(argv[1]) : 4;
+  const uint64_t pages = megabytes * 1024 * 1024 / PAGE_SIZE;
+  volatile char *heap = sbrk(pages * PAGE_SIZE);
+  if (heap == (char *)-1) {
+    fprintf(stderr, "cannot allocate %llu MB\n", megabytes);
+    exit(1);
+  }
+  for (uint64_t i = 0; i < pages; i++)
+    heap[i * PAGE_SIZE] = 1;
+
+  for (int touch = 0; touch <= 1; touch++) {
+    uint64_t start = time();
+    for (int i = 0; i < runs; i++) {
+      int pid = fork();
+      if (pid < 0) {
+        fprintf(stderr, "cannot fork\n");
+        exit(1);
+      }
+      if (pid == 0) { // child
+        if (touch)
+          for (uint64_t j = 0; j < pages; j++)
+            heap[j * PAGE_SIZE]++;
+        exit(0);
+      }
+      wait(pid);
+    }
+    uint64_t elapsed = time() - start;
+    printf("%d fork and wait with a %llu MB heap (%s) in %llums\n", runs,
+           megabytes, touch ? "child writes every page" : "child exits",
+           elapsed);
+  }
+  sbrk(-(int64_t)(pages * PAGE_SIZE));
+}
+
+/**
+ * Sums the bytes of a file, either by reading it in chunks or by mapping it.
+ * Returns the sum or -1 on error.
+ */
+static int64_t sum_file(const char *path, bool use_mmap) {
+  static unsigned char chunk[PAGE_SIZE];
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+  int64_t sum = 0;
+  if (use_mmap) {
+    int size = lseek(fd, 0, SEEK_END);
+    const unsigned char *file =
+        size > 0 ? mmap(size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (file == MAP_FAILED)
+      return -1;
+    for (int i = 0; i < size; i++)
+      sum += file[i];
+    munmap((void *)file, size);
+    return sum;
+  }
+  int n;
+  while ((n = read(fd, chunk, sizeof(chunk))) > 0)
+    for (int i = 0; i < n; i++)
+      sum += chunk[i];
+  close(fd);
+  return sum;
+}
+
+/**
+ * Compares reading a file with read and with mmap
+ */
+static void bench_mmap(int argc, char *argv[]) {
+  const char *path = argc > 0 ? argv[0] : "/sample.bmp";
+  const int rounds = argc > 1 ? atoi(argv[1]) : 10;
+  for (int use_mmap = 0; use_mmap <= 1; use_mmap++) {
+    int64_t sum = 0;
+    uint64_t start = time();
+    for (int i = 0; i < rounds; i++)
+      sum = sum_file(path, use_mmap);
+    uint64_t elapsed = time() - start;
+    if (sum < 0) {
+      fprintf(stderr, "cannot read %s\n", path);
+      exit(1);
+    }
+    printf("%s: %d rounds in %llums (sum %lld)\n", use_mmap ? "mmap" : "read",
+           rounds, elapsed, sum);
+  }
+}
+
+/**
+ * Reads a file into an untouched private mapping of the same file and writes
+ * an untouched shared mapping of it back to the file. The kernel has to fault
+ * in the mapping while it reads or writes the very same file.
+ */
+static void bench_mmap_self(int argc, char *argv[]) {
+  const char *path = "/mmap-self.bench";
+  const int pages = argc > 0 ? atoi(argv[0]) : 16;
+  static char chunk[PAGE_SIZE];
+  int fd = open(path, O_CREAT | O_RDWR | O_TRUNC);
+  if (fd < 0) {
+    fprintf(stderr, "cannot create %s\n", path);
+    exit(1);
+  }
+  for (int i = 0; i < pages; i++) {
+    memset(chunk, 'a' + i % 26, sizeof(chunk));
+    write(fd, chunk, sizeof(chunk));
+  }
+  const size_t size = (size_t)pages * PAGE_SIZE;
+  char *private = mmap(size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  char *shared = mmap(size, PROT_READ, MAP_SHARED, fd, 0);
+  if (private == MAP_FAILED || shared == MAP_FAILED) {
+    fprintf(stderr, "cannot map %s\n", path);
+    exit(1);
+  }
+  uint64_t start = time();
+  lseek(fd, 0, SEEK_SET);
+  const int read_bytes = read(fd, private, size);
+  lseek(fd, 0, SEEK_SET);
+  const int written_bytes = write(fd, shared, size);
+  const uint64_t elapsed = time() - start;
+  bool ok = read_bytes == (int)size && written_bytes == (int)size;
+  for (int i = 0; ok && i < pages; i++)
+    ok = private[i * PAGE_SIZE] == 'a' + i % 26 &&
+         shared[i * PAGE_SIZE] == 'a' + i % 26;
+  printf("%d pages read into and written from mappings of the same file in "
+         "%llums: %s\n",
+         pages, elapsed, ok ? "ok" : "wrong data");
+  munmap(private, size);
+  munmap(shared, size);
+  close(fd);
+  unlink(path);
+}
+
+/**
+ * Grows the page cache by writing a file in steps and reads the whole file
+ * back after each step. Prints the average cycles of a page cache lookup in
+ * each read pass, which should stay flat as the cache grows.
+ */
+static void bench_pagecache(int argc, char *argv[]) {
+  const int megabytes = argc > 0 ? atoi(argv[0]) : 128;
+  const int step = argc > 1 ? atoi(argv[1]) : 16;
+  const char *path = "/pagecache.bench";
+  static char chunk[PAGE_SIZE];
+  int fd = open(path, O_CREAT | O_RDWR | O_TRUNC);
+  if (fd < 0 || step <= 0) {
+    fprintf(stderr, "cannot create %s\n", path);
+    exit(1);
+  }
+  for (int size = step; size <= megabytes; size += step) {
+    // Grow the file
+    lseek(fd, 0, SEEK_END);
+    for (int i = 0; i < step * 1024 * 1024 / PAGE_SIZE; i++) {
+      if (write(fd, chunk, sizeof(chunk)) != sizeof(chunk)) {
+        fprintf(stderr, "cannot write %s\n", path);
+        close(fd);
+        unlink(path);
+        exit(1);
+      }
+    }
+    // Read it back, which should only hit the cache
+    const uint64_t lookups_before = meminfo_counter("pagecache_hits") +
+                                    meminfo_counter("pagecache_misses");
+    const uint64_t cycles_before = meminfo_counter("pagecache_lookup_cycles");
+    lseek(fd, 0, SEEK_SET);
+    while (read(fd, chunk, sizeof(chunk)) > 0)
+      ;
+    const uint64_t lookups = meminfo_counter("pagecache_hits") +
+                             meminfo_counter("pagecache_misses") -
+                             lookups_before;
+    const uint64_t cycles =
+        meminfo_counter("pagecache_lookup_cycles") - cycles_before;
+    printf("%d MB file, %llu cached pages: %llu lookups, %llu cycles per "
+           "lookup\n",
+           size, meminfo_counter("pagecache_resident"), lookups,
+           lookups == 0 ? 0 : cycles / lookups);
+  }
+  close(fd);
+  unlink(path);
+}
+
+/**
+ * Writes a file and prints how many of its pages are still dirty, then syncs
+ * it and prints how long the sync took. The writes should be throttled before
+ * most of the cache is dirty.
+ */
+static void bench_writeback(int argc, char *argv[]) {
+  const int megabytes = argc > 0 ? atoi(argv[0]) : 64;
+  const char *path = "/writeback.bench";
+  static char chunk[PAGE_SIZE];
+  int fd = open(path, O_CREAT | O_RDWR | O_TRUNC);
+  if (fd < 0) {
+    fprintf(stderr, "cannot create %s\n", path);
+    exit(1);
+  }
+  const uint64_t writebacks_before = meminfo_counter("pagecache_writebacks");
+  uint64_t start = time();
+  for (int i = 0; i < megabytes * 1024 * 1024 / PAGE_SIZE; i++) {
+    if (write(fd, chunk, sizeof(chunk)) != sizeof(chunk)) {
+      fprintf(stderr, "cannot write %s\n", path);
+      close(fd);
+      unlink(path);
+      exit(1);
+    }
+  }
+  const uint64_t write_elapsed = time() - start;
+  printf("wrote %d MB in %llums: %llu dirty of %llu cached pages, %llu "
+         "written back\n",
+         megabytes, write_elapsed, meminfo_counter("pagecache_dirty"),
+         meminfo_counter("pagecache_resident"),
+         meminfo_counter("pagecache_writebacks") - writebacks_before);
+  start = time();
+  fsync(fd);
+  printf("fsync took %llums, %llu dirty pages left\n", time() - start,
+         meminfo_counter("pagecache_dirty"));
+  close(fd);
+  unlink(path);
+}
+
+/**
+ * Reads a file from the start to the end and prints the throughput and how
+ * many pages were read ahead. The first run after boot reads from the disk.
+ */
+static void bench_readahead(int argc, char *argv[]) {
+  const char *path = argc > 0 ? argv[0] : "/bench";
+  const uint64_t misses_before = meminfo_counter("pagecache_misses");
+  const uint64_t pages_before = meminfo_counter("pagecache_readahead_pages");
+  const uint64_t hits_before = meminfo_counter("pagecache_readahead_hits");
+  static char chunk[PAGE_SIZE];
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "cannot open %s\n", path);
+    exit(1);
+  }
+  uint64_t bytes = 0;
+  int n;
+  uint64_t start = time();
+  while ((n = read(fd, chunk, sizeof(chunk))) > 0)
+    bytes += n;
+  const uint64_t elapsed = time() - start;
+  close(fd);
+  printf("read %llu KB in %llums (%llu KB/s)\n", bytes / 1024, elapsed,
+         elapsed == 0 ? 0 : bytes / elapsed * 1000 / 1024);
+  printf("%llu misses, %llu pages read ahead, %llu of them used\n",
+         meminfo_counter("pagecache_misses") - misses_before,
+         meminfo_counter("pagecache_readahead_pages") - pages_before,
+         meminfo_counter("pagecache_readahead_hits") - hits_before);
+}
+
+/**
+ * Gets the page cache hits and misses since the given values and updates them
+ */
+static void pagecache_lookups_since(uint64_t *hits, uint64_t *misses) {
+  const uint64_t new_hits = meminfo_counter("pagecache_hits");
+  const uint64_t new_misses = meminfo_counter("pagecache_misses");
+  *hits = new_hits - *hits;
+  *misses = new_misses - *misses;
+}
+
+/**
+ * Mixes path walks over a directory of small files with streaming a big file
+ * and prints the page cache hit rate of each. The big file should not fit in
+ * the memory, thus streaming it evicts pages. The path walks should keep
+ * hitting the cache nevertheless.
+ */
+static void bench_pagecache_mix(int argc, char *argv[]) {
+  const int megabytes = argc > 0 ? atoi(argv[0]) : 256;
+  const int rounds = argc > 1 ? atoi(argv[1]) : 4;
+  const char *stream_path = "/mix.bench";
+  char path[32];
+  static char chunk[PAGE_SIZE];
+  // Create the small files and the big file
+  mkdir("/mix");
+  for (int i = 0; i < 64; i++) {
+    snprintf(path, sizeof(path), "/mix/%d", i);
+    int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC);
+    if (fd < 0) {
+      fprintf(stderr, "cannot create %s\n", path);
+      exit(1);
+    }
+    write(fd, path, strlen(path));
+    close(fd);
+  }
+  int stream_fd = open(stream_path, O_CREAT | O_RDWR | O_TRUNC);
+  if (stream_fd < 0) {
+    fprintf(stderr, "cannot create %s\n", stream_path);
+    exit(1);
+  }
+  for (int i = 0; i < megabytes * 1024 * 1024 / PAGE_SIZE; i++)
+    write(stream_fd, chunk, sizeof(chunk));
+  sync();
+  const uint64_t ghost_hits_before = meminfo_counter("pagecache_ghost_hits");
+  for (int round = 0; round < rounds; round++) {
+    // Walk the paths
+    uint64_t hits = meminfo_counter("pagecache_hits");
+    uint64_t misses = meminfo_counter("pagecache_misses");
+    for (int i = 0; i < 64; i++) {
+      snprintf(path, sizeof(path), "/mix/%d", i);
+      int fd = open(path, O_RDONLY);
+      if (fd >= 0)
+        close(fd);
+    }
+    pagecache_lookups_since(&hits, &misses);
+    printf("round %d: path walks hit %llu of %llu, ", round, hits,
+           hits + misses);
+    // Stream the big file
+    hits = meminfo_counter("pagecache_hits");
+    misses = meminfo_counter("pagecache_misses");
+    lseek(stream_fd, 0, SEEK_SET);
+    while (read(stream_fd, chunk, sizeof(chunk)) > 0)
+      ;
+    pagecache_lookups_since(&hits, &misses);
+    printf("stream hit %llu of %llu\n", hits, hits + misses);
+  }
+  printf("%llu ghost hits\n",
+         meminfo_counter("pagecache_ghost_hits") - ghost_hits_before);
+  close(stream_fd);
+  unlink(stream_path);
+  for (int i = 0; i < 64; i++) {
+    snprintf(path, sizeof(path), "/mix/%d", i);
+    unlink(path);
+  }
+  unlink("/mix");
+}
+
+/**
+ * Touches each page of a working set and yields, for the given number of
+ * rounds. Used by both sides of the switch benchmark.
+ */
+static void yield_loop(int rounds, uint64_t pages) {
+  volatile char *working_set = sbrk(pages * PAGE_SIZE);
+  for (uint64_t i = 0; i < pages; i++)
+    working_set[i * PAGE_SIZE] = 0;
+  for (int round = 0; round < rounds; round++) {
+    for (uint64_t i = 0; i < pages; i++)
+      working_set[i * PAGE_SIZE]++;
+    yield();
+  }
+  sbrk(-(int64_t)(pages * PAGE_SIZE));
+}
+
+/**
+ * The child process of the switch benchmark
+ */
+static void bench_yield(int argc, char *argv[]) {
+  if (argc < 2)
+    return;
+  yield_loop(atoi(argv[0]), atoi(argv[1]));
+}
+
+/**
+ * Ping-pongs between this process and a child process with yield. Each side
+ * touches a working set of pages between the switches, thus the TLB entries
+ * which survive the switches show up in the result.
+ */
+static void bench_switch(int argc, char *argv[]) {
+  const int rounds = argc > 0 ? atoi(argv[0]) : 10000;
+  const int pages = argc > 1 ? atoi(argv[1]) : 64;
+  static char rounds_string[16], pages_string[16];
+  snprintf(rounds_string, sizeof(rounds_string), "%d", rounds);
+  snprintf(pages_string, sizeof(pages_string), "%d", pages);
+  char *child_args[] = {"/bench", "yield", rounds_string, pages_string, NULL};
+
+  int pid = exec(child_args[0], child_args);
+  if (pid < 0) {
+    fprintf(stderr, "cannot exec %s\n", child_args[0]);
+    exit(1);
+  }
+  uint64_t start = time();
+  yield_loop(rounds, pages);
+  uint64_t elapsed = time() - start;
+  wait(pid);
+  printf("%d round trips touching %d pages on each side in %llums (%llu "
+         "ns per switch)\n",
+         rounds, pages, elapsed, elapsed * 1000000 / (2 * (uint64_t)rounds));
+}
+
+/**
+ * Recurses with a kilobyte of stack in each call. Returns a checksum of the
+ * frames so the compiler keeps them.
+ */
+static uint64_t recurse(int depth) {
+  volatile char frame[1024];
+  frame[0] = (char)depth;
+  frame[sizeof(frame) - 1] = (char)depth;
+  if (depth == 0)
+    return frame[0];
+  return recurse(depth - 1) + frame[sizeof(frame) - 1];
+}
+
+/**
+ * Grows the stack by recursing and prints the frames which the stack uses
+ */
+static void bench_stack(int argc, char *argv[]) {
+  const int kilobytes = argc > 0 ? atoi(argv[0]) : 1024;
+  uint64_t free_before = meminfo_counter("free_pages");
+  uint64_t start = time();
+  uint64_t sum = recurse(kilobytes);
+  uint64_t elapsed = time() - start;
+  uint64_t frames = free_before - meminfo_counter("free_pages");
+  printf("recursed %d KB deep in %llums using %llu frames (sum %llu)\n",
+         kilobytes, elapsed, frames, sum);
+}
+
+/**
+ * The header of the shared memory segment of the shm benchmark. The data
+ * starts at the next page.
+ */
+struct shm_channel {
+  // Number of rounds which the producer has written
+  volatile uint64_t produced;
+  // Number of rounds which the consumer has read
+  volatile uint64_t consumed;
+};
+
+/**
+ * The consumer of the shm benchmark. It maps the segment with its ID and
+ * checks the data of each round.
+ */
+static void bench_shm_consumer(int argc, char *argv[]) {
+  if (argc < 3)
+    return;
+  const uint64_t bytes = atoi(argv[1]) * 1024 * 1024;
+  const int rounds = atoi(argv[2]);
+  struct shm_channel *channel = shm_map(atoi(argv[0]));
+  if (channel == MAP_FAILED) {
+    fprintf(stderr, "cannot map segment %s\n", argv[0]);
+    exit(1);
+  }
+  const unsigned char *data = (unsigned char *)channel + PAGE_SIZE;
+  for (int round = 0; round < rounds; round++) {
+    while (channel->produced == (uint64_t)round)
+      yield();
+    for (uint64_t i = 0; i < bytes; i++)
+      if (data[i] != (unsigned char)round) {
+        fprintf(stderr, "round %d: bad byte at %llu\n", round, i);
+        exit(1);
+      }
+    channel->consumed = round + 1;
+  }
+  shm_unmap(channel);
+}
+
+/**
+ * Passes buffers from this process to another one through a shared memory
+ * segment. The consumer is a new program which maps the segment by its ID.
+ */
+static void bench_shm(int argc, char *argv[]) {
+  const int megabytes = argc > 0 ? atoi(argv[0]) : 1;
+  const int rounds = argc > 1 ? atoi(argv[1]) : 100;
+  const uint64_t bytes = (uint64_t)megabytes * 1024 * 1024;
+  struct shm_channel *channel;
+  const int id = shm_create(PAGE_SIZE + bytes, (void **)&channel);
+  if (id < 0) {
+    fprintf(stderr, "cannot create a %d MB segment\n", megabytes);
+    exit(1);
+  }
+  unsigned char *data = (unsigned char *)channel + PAGE_SIZE;
+  static char id_string[16], megabytes_string[16], rounds_string[16];
+  snprintf(id_string, sizeof(id_string), "%d", id);
+  snprintf(megabytes_string, sizeof(megabytes_string), "%d", megabytes);
+  snprintf(rounds_string, sizeof(rounds_string), "%d", rounds);
+  char *child_args[] = {"/bench",         "shm-consumer", id_string,
+                        megabytes_string, rounds_string,  NULL};
+  int pid = exec(child_args[0], child_args);
+  if (pid < 0) {
+    fprintf(stderr, "cannot exec %s\n", child_args[0]);
+    exit(1);
+  }
+
+  uint64_t start = time();
+  for (int round = 0; round < rounds; round++) {
+    while (channel->consumed != (uint64_t)round)
+      yield();
+    memset(data, round, bytes);
+    channel->produced = round + 1;
+  }
+  while (channel->consumed != (uint64_t)rounds)
+    yield();
+  uint64_t elapsed = time() - start;
+  wait(pid);
+  shm_unmap(channel);
+  printf("%d rounds of %d MB through shared memory in %llums\n", rounds,
+         megabytes, elapsed);
+}
+
+/**
+ * List of all benchmarks
+ */
+static const struct {
+  const char *name;
+  const char *usage;
+  void (*run)(int argc, char *argv[]);
+} benchmarks[] = {
+    {"hugepage", "[megabytes]", bench_hugepage},
+    {"string", "[bytes] [rounds]", bench_string},
+    {"malloc", "[operations] [max size]", bench_malloc},
+    {"exec", "[runs]", bench_exec},
+    {"fork", "[runs] [megabytes]", bench_fork},
+    {"mmap", "[file] [rounds]", bench_mmap},
+    {"mmap-self", "[pages]", bench_mmap_self},
+    {"pagecache", "[megabytes] [step megabytes]", bench_pagecache},
+    {"writeback", "[megabytes]", bench_writeback},
+    {"readahead", "[file]", bench_readahead},
+    {"pagecache-mix", "[megabytes] [rounds]", bench_pagecache_mix},
+    {"true", "", bench_true},
+    {"switch", "[rounds] [pages]", bench_switch},
+    {"yield", "<rounds> <pages>", bench_yield},
+    {"shm", "[megabytes] [rounds]", bench_shm},
+    {"stack", "[kilobytes]", bench_stack},
+    {"shm-consumer", "<id> <megabytes> <rounds>", bench_shm_consumer},
+};
+
+#define BENCHMARKS_SIZE (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+int main(int argc, char *argv[]) {
+  if (argc >= 2) {
+    for (size_t i = 0; i < BENCHMARKS_SIZE; i++) {
+      if (strcmp(argv[1], benchmarks[i].name) == 0) {
+        benchmarks[i].run(argc - 2, argv + 2);
+        exit(0);
+      }
+    }
+  }
+  fprintf(stderr, "usage: bench <benchmark> [args...]\n");
+  for (size_t i = 0; i < BENCHMARKS_SIZE; i++)
+    fprintf(stderr, "  %s %s\n", benchmarks[i].name, benchmarks[i].usage);
+  exit(1);
+}
\ No newline at end of file
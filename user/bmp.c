@@ -1,6 +1,8 @@
 #include "include/fb.h"
 #include "include/file.h"
+#include "include/mman.h"
 #include "libc/stdio.h"
+#include "libc/string.h"
 #include "libc/usyscalls.h"
 #include <stdint.h>
 
@@ -9,6 +11,10 @@
 #define HEIGHT_OFFSET 0x0016
 #define BITS_PER_PIXEL_OFFSET 0x001C
 
+/**
+ * Reads the image by mapping the file in the memory. The header and the rows
+ * are read directly from the mapped pages of the file without any read calls.
+ */
 int read_image(const char *filename, uint8_t **pixels, uint32_t *width,
                uint32_t *height, uint32_t *bytes_per_pixel) {
   // Open the file for reading in binary mode
@@ -17,20 +23,25 @@ int read_image(const char *filename, uint8_t **pixels, uint32_t *width,
     puts("cannot open bmp file");
     return -1;
   }
+  // Map the whole file
+  int file_size = lseek(fd, 0, SEEK_END);
+  const uint8_t *file = mmap(file_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (file_size <= 0 || file == MAP_FAILED) {
+    puts("cannot map bmp file");
+    return -1;
+  }
   // Read data offset
   uint32_t dataOffset;
-  lseek(fd, DATA_OFFSET_OFFSET, SEEK_SET);
-  read(fd, &dataOffset, sizeof(dataOffset));
+  memcpy(&dataOffset, file + DATA_OFFSET_OFFSET, sizeof(dataOffset));
   // Read width
-  lseek(fd, WIDTH_OFFSET, SEEK_SET);
-  read(fd, width, sizeof(*width));
+  memcpy(width, file + WIDTH_OFFSET, sizeof(*width));
   // Read height
-  lseek(fd, HEIGHT_OFFSET, SEEK_SET);
-  read(fd, height, sizeof(*height));
+  memcpy(height, file + HEIGHT_OFFSET, sizeof(*height));
   // Read bits per pixel
   int16_t bits_per_pixel;
-  lseek(fd, BITS_PER_PIXEL_OFFSET, SEEK_SET);
-  read(fd, &bits_per_pixel, sizeof(bits_per_pixel));
+  memcpy(&bits_per_pixel, file + BITS_PER_PIXEL_OFFSET,
+         sizeof(bits_per_pixel));
   // Allocate a pixel array
   *bytes_per_pixel = ((uint32_t)bits_per_pixel) / 8;
 
@@ -49,15 +60,14 @@ int read_image(const char *filename, uint8_t **pixels, uint32_t *width,
   // point to the last row of our pixel array (unpadded)
   uint8_t *currentRowPointer = *pixels + ((*height - 1) * unpadded_row_size);
   for (uint32_t i = 0; i < *height; i++) {
-    // put file cursor in the next row from top to bottom
-    lseek(fd, dataOffset + (i * padded_row_size), SEEK_SET);
-    // read only unpaddedRowSize bytes (we can ignore the padding bytes)
-    read(fd, currentRowPointer, unpadded_row_size);
+    // copy only unpaddedRowSize bytes (we can ignore the padding bytes)
+    memcpy(currentRowPointer, file + dataOffset + (i * padded_row_size),
+           unpadded_row_size);
     // point to the next row (from bottom to top)
     currentRowPointer -= unpadded_row_size;
   }
 
-  close(fd);
+  munmap((void *)file, file_size);
   return 0;
 }
 
@@ -5,8 +5,7 @@
 #define BUFFER_SIZE 4096
 
 int main(int argc, char *argv[]) {
-  // Allocate a buffer on heap to avoid stack overflow
-  char *buffer = sbrk(BUFFER_SIZE);
+  char buffer[BUFFER_SIZE];
 
   for (int i = 1; i < argc; i++) { // For each argument...
     // Open the file...
@@ -1,93 +1,299 @@
+#include "stdio.h"
 #include "stdlib.h"
 #include "string.h"
 #include "usyscalls.h"
+#include <stdbool.h>
 #include <stdint.h>
 
-// Memory allocator by Kernighan and Ritchie,
-// The C programming Language, 2nd ed.  Section 8.7.
-// From https://github.com/mit-pdos/xv6-riscv/tree/riscv/user
+/**
+ * A size class allocator. Small requests are rounded up to one of the size
+ * classes and each size class has a free list of objects, thus allocating and
+ * freeing a small object is O(1). Objects of a size class which has no free
+ * object are bump allocated from a run of pages which is taken from sbrk.
+ * Small objects are never given back to the kernel.
+ *
+ * Large requests are rounded up to pages and take a block of pages directly
+ * from sbrk. Free large blocks are kept in an address ordered list where
+ * adjacent blocks are merged. If a free large block ends at the top of the
+ * heap, it is given back to the kernel with a negative sbrk.
+ *
+ * Each block is preceded by a header which tells its size and size class.
+ */
 
-typedef long Align;
+#define PAGE_SIZE 4096
+#define ALIGNMENT 16
+// Biggest request which is served from the size classes
+#define SMALL_MAX_SIZE 2048
+// Number of bytes which are taken from sbrk each time a run is empty
+#define RUN_SIZE (64 * 1024)
+// Free large blocks at the top of the heap which are at least this big are
+// given back to the kernel
+#define TRIM_THRESHOLD (128 * 1024)
+// The size class of large blocks
+#define LARGE_BLOCK 0xFFFFFFFF
+// Magic values to detect invalid and double frees
+#define BLOCK_MAGIC_USED 0xA110CA7E
+#define BLOCK_MAGIC_FREE 0xF4EEB10C
 
-union header {
-  struct {
-    union header *ptr;
-    size_t size;
-  } s;
-  Align x;
+#define ROUND_UP(x, align) (((x) + (align) - 1) & ~((size_t)(align) - 1))
+
+/**
+ * The header before each block
+ */
+struct block_header {
+  // Number of usable bytes after the header
+  size_t size;
+  // Index of the size class or LARGE_BLOCK
+  uint32_t size_class;
+  // BLOCK_MAGIC_USED or BLOCK_MAGIC_FREE
+  uint32_t magic;
 };
 
-typedef union header Header;
+_Static_assert(sizeof(struct block_header) == ALIGNMENT,
+               "block header must keep the alignment");
 
-static Header base;
-static Header *freep;
+/**
+ * A free small object. Stored in the usable bytes of the object.
+ */
+struct free_object {
+  struct free_object *next;
+};
 
-void free(void *ap) {
-  if (ap == NULL)
-    return;
-  
-  Header *bp, *p;
+/**
+ * A free large block. The list pointers are stored in the usable bytes.
+ */
+struct free_large_block {
+  struct block_header header;
+  struct free_large_block *next;
+  struct free_large_block *prev;
+};
 
-  bp = (Header *)ap - 1;
-  for (p = freep; !(bp > p && bp < p->s.ptr); p = p->s.ptr)
-    if (p >= p->s.ptr && (bp > p || bp < p->s.ptr))
-      break;
-  if (bp + bp->s.size == p->s.ptr) {
-    bp->s.size += p->s.ptr->s.size;
-    bp->s.ptr = p->s.ptr->s.ptr;
-  } else
-    bp->s.ptr = p->s.ptr;
-  if (p + p->s.size == bp) {
-    p->s.size += bp->s.size;
-    p->s.ptr = bp->s.ptr;
-  } else
-    p->s.ptr = bp;
-  freep = p;
+static const uint32_t size_classes[] = {
+    16,  32,  48,  64,  80,  96,   112,  128,  160,  192,  224,  256,
+    320, 384, 448, 512, 640, 768,  896,  1024, 1280, 1536, 1792, 2048,
+};
+
+#define SIZE_CLASS_COUNT (sizeof(size_classes) / sizeof(size_classes[0]))
+
+// Size class of each small size divided by ALIGNMENT. Filled on the first
+// call to malloc.
+static uint8_t size_class_of[SMALL_MAX_SIZE / ALIGNMENT + 1];
+static bool size_class_of_initialized;
+
+// Free objects of each size class
+static struct free_object *free_objects[SIZE_CLASS_COUNT];
+
+// The run which new small objects are bump allocated from
+static char *run_current, *run_end;
+
+// Free large blocks sorted by address
+static struct free_large_block *free_large_blocks;
+
+static inline struct block_header *header_of(void *ptr) {
+  return (struct block_header *)ptr - 1;
 }
 
-static Header *morecore(size_t nu) {
-  char *p;
-  Header *hp;
-
-  if (nu < 4096)
-    nu = 4096;
-  p = sbrk(nu * sizeof(Header));
-  if (p == (char *)-1)
-    return 0;
-  hp = (Header *)p;
-  hp->s.size = nu;
-  free((void *)(hp + 1));
-  return freep;
+static inline char *block_end(struct block_header *header) {
+  return (char *)(header + 1) + header->size;
 }
 
-void *malloc(size_t nbytes) {
-  Header *p, *prevp;
-  size_t nunits;
+static void size_class_init(void) {
+  uint32_t size_class = 0;
+  for (size_t i = 0; i <= SMALL_MAX_SIZE / ALIGNMENT; i++) {
+    while (size_classes[size_class] < i * ALIGNMENT)
+      size_class++;
+    size_class_of[i] = size_class;
+  }
+  size_class_of_initialized = true;
+}
+
+/**
+ * Gets more memory from the kernel. The returned memory is page aligned and
+ * size must be a multiple of pages. Returns NULL if we are out of memory.
+ */
+static char *heap_grow(size_t size) {
+  // Align the top of the heap to pages. Only the first call or a call after
+  // someone else has used sbrk might need this.
+  const uintptr_t top = (uintptr_t)sbrk(0);
+  const size_t padding = ROUND_UP(top, PAGE_SIZE) - top;
+  char *memory = sbrk(padding + size);
+  if (memory == (char *)-1)
+    return NULL;
+  return memory + padding;
+}
 
-  nunits = (nbytes + sizeof(Header) - 1) / sizeof(Header) + 1;
-  if ((prevp = freep) == 0) {
-    base.s.ptr = freep = prevp = &base;
-    base.s.size = 0;
+/**
+ * Allocates a small object from the bump allocator
+ */
+static void *run_allocate(uint32_t size_class) {
+  const size_t block_size =
+      sizeof(struct block_header) + size_classes[size_class];
+  if (run_end - run_current < (ptrdiff_t)block_size) {
+    if (sbrk(0) == run_end && run_end != NULL) {
+      // The heap is still contiguous with our run. Just make it bigger.
+      if (sbrk(RUN_SIZE) == (void *)-1)
+        return NULL;
+      run_end += RUN_SIZE;
+    } else {
+      // The rest of the old run is wasted
+      char *run = heap_grow(RUN_SIZE);
+      if (run == NULL)
+        return NULL;
+      run_current = run;
+      run_end = run + RUN_SIZE;
+    }
+    if (run_end - run_current < (ptrdiff_t)block_size) // should not happen
+      return NULL;
   }
-  for (p = prevp->s.ptr;; prevp = p, p = p->s.ptr) {
-    if (p->s.size >= nunits) {
-      if (p->s.size == nunits)
-        prevp->s.ptr = p->s.ptr;
-      else {
-        p->s.size -= nunits;
-        p += p->s.size;
-        p->s.size = nunits;
-      }
-      freep = prevp;
-      return (void *)(p + 1);
+  struct block_header *header = (struct block_header *)run_current;
+  run_current += block_size;
+  header->size = size_classes[size_class];
+  header->size_class = size_class;
+  return header + 1;
+}
+
+/**
+ * Removes a block from the free large blocks
+ */
+static void large_list_remove(struct free_large_block *block) {
+  if (block->prev != NULL)
+    block->prev->next = block->next;
+  else
+    free_large_blocks = block->next;
+  if (block->next != NULL)
+    block->next->prev = block->prev;
+}
+
+/**
+ * Splits a large block to keep only size usable bytes in it. The rest is
+ * returned as a free large block if it has at least one page.
+ */
+static void large_block_split(struct block_header *header, size_t size) {
+  if (header->size - size < PAGE_SIZE)
+    return;
+  struct block_header *rest =
+      (struct block_header *)((char *)(header + 1) + size);
+  rest->size = header->size - size - sizeof(struct block_header);
+  rest->size_class = LARGE_BLOCK;
+  rest->magic = BLOCK_MAGIC_USED;
+  header->size = size;
+  free(rest + 1);
+}
+
+/**
+ * Allocates a large block with at least the given number of usable bytes
+ */
+static void *large_allocate(size_t size) {
+  // Make the whole block a multiple of pages
+  size = ROUND_UP(size + sizeof(struct block_header), PAGE_SIZE) -
+         sizeof(struct block_header);
+  // First fit from the free blocks
+  for (struct free_large_block *block = free_large_blocks; block != NULL;
+       block = block->next) {
+    if (block->header.size >= size) {
+      large_list_remove(block);
+      block->header.magic = BLOCK_MAGIC_USED;
+      large_block_split(&block->header, size);
+      return &block->header + 1;
     }
-    if (p == freep)
-      if ((p = morecore(nunits)) == 0)
-        return 0;
   }
+  // Get more memory from the kernel
+  char *memory = heap_grow(size + sizeof(struct block_header));
+  if (memory == NULL)
+    return NULL;
+  struct block_header *header = (struct block_header *)memory;
+  header->size = size;
+  header->size_class = LARGE_BLOCK;
+  return header + 1;
+}
+
+/**
+ * Frees a large block. Merges it with its free neighbours and gives it back
+ * to the kernel if it's at the top of the heap.
+ */
+static void large_free(struct free_large_block *block) {
+  block->header.magic = BLOCK_MAGIC_FREE;
+  // Find the neighbours by address
+  struct free_large_block *prev = NULL, *next = free_large_blocks;
+  while (next != NULL && next < block) {
+    prev = next;
+    next = next->next;
+  }
+  // Merge with the next block
+  if (next != NULL && block_end(&block->header) == (char *)next) {
+    block->header.size += sizeof(struct block_header) + next->header.size;
+    next = next->next;
+  }
+  // Merge with the previous block
+  if (prev != NULL && block_end(&prev->header) == (char *)block) {
+    prev->header.size += sizeof(struct block_header) + block->header.size;
+    prev->next = next;
+    if (next != NULL)
+      next->prev = prev;
+    block = prev;
+  } else {
+    block->prev = prev;
+    block->next = next;
+    if (prev != NULL)
+      prev->next = block;
+    else
+      free_large_blocks = block;
+    if (next != NULL)
+      next->prev = block;
+  }
+  // Give the memory back if it's at the top of the heap
+  const size_t block_size = sizeof(struct block_header) + block->header.size;
+  if (block_size >= TRIM_THRESHOLD && block_end(&block->header) == sbrk(0)) {
+    large_list_remove(block);
+    sbrk(-(int64_t)block_size);
+  }
+}
+
+void free(void *ptr) {
+  if (ptr == NULL)
+    return;
+  struct block_header *header = header_of(ptr);
+  if (header->magic != BLOCK_MAGIC_USED) {
+    fprintf(stderr, "free: invalid pointer %p\n", ptr);
+    exit(1);
+  }
+  if (header->size_class == LARGE_BLOCK) {
+    large_free((struct free_large_block *)header);
+    return;
+  }
+  header->magic = BLOCK_MAGIC_FREE;
+  struct free_object *object = ptr;
+  object->next = free_objects[header->size_class];
+  free_objects[header->size_class] = object;
+}
+
+void *malloc(size_t nbytes) {
+  if (nbytes > SMALL_MAX_SIZE) {
+    void *block = large_allocate(nbytes);
+    if (block != NULL)
+      header_of(block)->magic = BLOCK_MAGIC_USED;
+    return block;
+  }
+  if (!size_class_of_initialized)
+    size_class_init();
+  const uint32_t size_class =
+      size_class_of[ROUND_UP(nbytes, ALIGNMENT) / ALIGNMENT];
+  void *object;
+  if (free_objects[size_class] != NULL) {
+    object = free_objects[size_class];
+    free_objects[size_class] = free_objects[size_class]->next;
+  } else {
+    object = run_allocate(size_class);
+    if (object == NULL)
+      return NULL;
+  }
+  header_of(object)->magic = BLOCK_MAGIC_USED;
+  return object;
 }
 
 void *calloc(size_t nmemb, size_t size) {
+  if (size != 0 && nmemb > SIZE_MAX / size) // overflow
+    return NULL;
   void *data = malloc(nmemb * size);
   if (data == NULL)
     return NULL;
@@ -95,6 +301,40 @@ void *calloc(size_t nmemb, size_t size) {
   return data;
 }
 
+/**
+ * Tries to resize a large block without moving it. Returns true on success.
+ */
+static bool large_resize(struct block_header *header, size_t size) {
+  size = ROUND_UP(size + sizeof(struct block_header), PAGE_SIZE) -
+         sizeof(struct block_header);
+  if (size <= header->size) { // shrink
+    large_block_split(header, size);
+    return true;
+  }
+  const size_t needed = size - header->size;
+  // Grow into the next block if it's free
+  for (struct free_large_block *block = free_large_blocks; block != NULL;
+       block = block->next) {
+    if ((char *)block > block_end(header))
+      break;
+    if ((char *)block == block_end(header) &&
+        sizeof(struct block_header) + block->header.size >= needed) {
+      large_list_remove(block);
+      header->size += sizeof(struct block_header) + block->header.size;
+      large_block_split(header, size);
+      return true;
+    }
+  }
+  // Grow the heap if we are at the top of it
+  if (block_end(header) == sbrk(0)) {
+    if (sbrk(needed) == (void *)-1)
+      return false;
+    header->size = size;
+    return true;
+  }
+  return false;
+}
+
 void *realloc(void *ptr, size_t size) {
   if (ptr == NULL)
     return malloc(size);
@@ -103,12 +343,18 @@ void *realloc(void *ptr, size_t size) {
     return NULL;
   }
 
-  Header *header = (Header *)ptr - 1;
-  if (size == header->s.size)
-    return ptr; // no resize
+  struct block_header *header = header_of(ptr);
+  if (size <= header->size && header->size_class != LARGE_BLOCK)
+    return ptr; // fits in the size class
+  if (header->size_class == LARGE_BLOCK && size > SMALL_MAX_SIZE &&
+      large_resize(header, size))
+    return ptr;
 
   void *new_data = malloc(size);
+  if (new_data == NULL)
+    return NULL;
   // Copy the minimum from the size before and requested size
-  memcpy(new_data, ptr, size < header->s.size ? size : header->s.size);
+  memcpy(new_data, ptr, size < header->size ? size : header->size);
+  free(ptr);
   return new_data;
-}
+}
\ No newline at end of file
@@ -7,44 +7,372 @@
 #include "string.h"
 #include "ctype.h"
 #include "stdlib.h"
+#include <immintrin.h>
+#include <stdbool.h>
 #include <stdint.h>
 
-void *memcpy(void *dest, const void *src, size_t n) {
-  uint8_t *pdest = (uint8_t *)dest;
-  const uint8_t *psrc = (const uint8_t *)src;
+/**
+ * memcpy, memset, memmove, strlen, strcmp and strchr are vectorized. SSE2 is
+ * always available on x86-64 and the kernel saves the SSE registers on
+ * context switch, thus it is used as the baseline. The AVX2 versions are used
+ * if the CPU supports AVX2 and the kernel has enabled the AVX state (OSXSAVE
+ * and XCR0). The implementation is selected on the first call.
+ *
+ * The rest of the libc is compiled without SSE; Only these functions enable
+ * SSE2/AVX2 with the target attribute.
+ *
+ * The string functions read whole aligned vectors which contain the string.
+ * An aligned vector never crosses a page boundary thus we never touch an
+ * unmapped page. strcmp cannot align both strings, so it only reads a whole
+ * vector when it does not cross a page boundary.
+ */
 
-  for (size_t i = 0; i < n; i++) {
-    pdest[i] = psrc[i];
+#define PAGE_SIZE 4096
+
+// CPUID bits
+#define CPUID_1_ECX_OSXSAVE (1U << 27)
+#define CPUID_1_ECX_AVX (1U << 28)
+#define CPUID_7_EBX_AVX2 (1U << 5)
+// XCR0 bits of SSE and AVX state
+#define XCR0_SSE_AVX 0x6
+
+/**
+ * A set of implementations of the vectorized functions
+ */
+struct string_functions {
+  void *(*memcpy)(void *, const void *, size_t);
+  void *(*memset)(void *, int, size_t);
+  void *(*memmove)(void *, const void *, size_t);
+  size_t (*strlen)(const char *);
+  int (*strcmp)(const char *, const char *);
+  char *(*strchr)(const char *, char);
+};
+
+static void copy_bytes_forward(uint8_t *dest, const uint8_t *src, size_t n) {
+  for (size_t i = 0; i < n; i++)
+    dest[i] = src[i];
+}
+
+static void copy_bytes_backward(uint8_t *dest, const uint8_t *src, size_t n) {
+  for (size_t i = n; i > 0; i--)
+    dest[i - 1] = src[i - 1];
+}
+
+/**
+ * Copies from the start to the end. Safe for overlapping buffers if dest is
+ * before src because the last vector is loaded before anything is stored.
+ */
+__attribute__((target("sse2"))) static void *
+memcpy_sse2(void *dest, const void *src, size_t n) {
+  uint8_t *d = dest;
+  const uint8_t *s = src;
+  if (n < 16) {
+    copy_bytes_forward(d, s, n);
+    return dest;
+  }
+  uint8_t *const last = d + n - 16;
+  const __m128i tail = _mm_loadu_si128((const __m128i *)(s + n - 16));
+  for (; n > 16; n -= 16, d += 16, s += 16)
+    _mm_storeu_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+  _mm_storeu_si128((__m128i *)last, tail);
+  return dest;
+}
+
+__attribute__((target("sse2"))) static void *memset_sse2(void *s, int c,
+                                                         size_t n) {
+  uint8_t *p = s;
+  if (n < 16) {
+    for (size_t i = 0; i < n; i++)
+      p[i] = (uint8_t)c;
+    return s;
   }
+  const __m128i value = _mm_set1_epi8((char)c);
+  for (size_t i = 0; i + 16 < n; i += 16)
+    _mm_storeu_si128((__m128i *)(p + i), value);
+  _mm_storeu_si128((__m128i *)(p + n - 16), value);
+  return s;
+}
 
+__attribute__((target("sse2"))) static void *
+memmove_sse2(void *dest, const void *src, size_t n) {
+  // Forward copy is safe if dest is before src or there is no overlap
+  if ((uintptr_t)dest - (uintptr_t)src >= n)
+    return memcpy_sse2(dest, src, n);
+  // Copy from the end to the start. Load the first vector before anything is
+  // stored.
+  uint8_t *d = dest;
+  const uint8_t *s = src;
+  if (n < 16) {
+    copy_bytes_backward(d, s, n);
+    return dest;
+  }
+  const __m128i head = _mm_loadu_si128((const __m128i *)s);
+  for (; n > 16; n -= 16)
+    _mm_storeu_si128((__m128i *)(d + n - 16),
+                     _mm_loadu_si128((const __m128i *)(s + n - 16)));
+  _mm_storeu_si128((__m128i *)d, head);
   return dest;
 }
 
-void *memset(void *s, int c, size_t n) {
-  uint8_t *p = (uint8_t *)s;
+__attribute__((target("sse2"))) static size_t strlen_sse2(const char *s) {
+  const __m128i zero = _mm_setzero_si128();
+  const uintptr_t offset = (uintptr_t)s % 16;
+  const char *p = s - offset;
+  // Ignore the bytes before the string in the first vector
+  const __m128i chunk = _mm_load_si128((const __m128i *)p);
+  uint32_t mask =
+      (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, zero)) >> offset;
+  if (mask != 0)
+    return __builtin_ctz(mask);
+  for (;;) {
+    p += 16;
+    mask = _mm_movemask_epi8(
+        _mm_cmpeq_epi8(_mm_load_si128((const __m128i *)p), zero));
+    if (mask != 0)
+      return p + __builtin_ctz(mask) - s;
+  }
+}
 
-  for (size_t i = 0; i < n; i++) {
-    p[i] = (uint8_t)c;
+__attribute__((target("sse2"))) static int strcmp_sse2(const char *p,
+                                                        const char *q) {
+  const __m128i zero = _mm_setzero_si128();
+  for (;;) {
+    if ((uintptr_t)p % PAGE_SIZE <= PAGE_SIZE - 16 &&
+        (uintptr_t)q % PAGE_SIZE <= PAGE_SIZE - 16) {
+      const __m128i a = _mm_loadu_si128((const __m128i *)p);
+      const __m128i b = _mm_loadu_si128((const __m128i *)q);
+      // Stop at the first different byte or the null terminator
+      const uint32_t mask =
+          (_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) ^ 0xFFFF) |
+          _mm_movemask_epi8(_mm_cmpeq_epi8(a, zero));
+      if (mask != 0) {
+        const int i = __builtin_ctz(mask);
+        return (uint8_t)p[i] - (uint8_t)q[i];
+      }
+      p += 16;
+      q += 16;
+    } else { // close to a page boundary
+      if (*p == 0 || *p != *q)
+        return (uint8_t)*p - (uint8_t)*q;
+      p++;
+      q++;
+    }
   }
+}
 
+__attribute__((target("sse2"))) static char *strchr_sse2(const char *s,
+                                                         char c) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i needle = _mm_set1_epi8(c);
+  const uintptr_t offset = (uintptr_t)s % 16;
+  const char *p = s - offset;
+  __m128i chunk = _mm_load_si128((const __m128i *)p);
+  uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_or_si128(
+                      _mm_cmpeq_epi8(chunk, needle),
+                      _mm_cmpeq_epi8(chunk, zero))) >>
+                  offset;
+  p = s;
+  while (mask == 0) {
+    p += 16 - (uintptr_t)p % 16;
+    chunk = _mm_load_si128((const __m128i *)p);
+    mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, needle),
+                                          _mm_cmpeq_epi8(chunk, zero)));
+  }
+  // Either the character or the null terminator
+  p += __builtin_ctz(mask);
+  return *p == c ? (char *)p : NULL;
+}
+
+/**
+ * The AVX2 versions are the same as SSE2 ones but with 32 byte vectors
+ */
+__attribute__((target("avx2"))) static void *
+memcpy_avx2(void *dest, const void *src, size_t n) {
+  uint8_t *d = dest;
+  const uint8_t *s = src;
+  if (n < 32)
+    return memcpy_sse2(dest, src, n);
+  uint8_t *const last = d + n - 32;
+  const __m256i tail = _mm256_loadu_si256((const __m256i *)(s + n - 32));
+  for (; n > 32; n -= 32, d += 32, s += 32)
+    _mm256_storeu_si256((__m256i *)d, _mm256_loadu_si256((const __m256i *)s));
+  _mm256_storeu_si256((__m256i *)last, tail);
+  _mm256_zeroupper();
+  return dest;
+}
+
+__attribute__((target("avx2"))) static void *memset_avx2(void *s, int c,
+                                                         size_t n) {
+  uint8_t *p = s;
+  if (n < 32)
+    return memset_sse2(s, c, n);
+  const __m256i value = _mm256_set1_epi8((char)c);
+  for (size_t i = 0; i + 32 < n; i += 32)
+    _mm256_storeu_si256((__m256i *)(p + i), value);
+  _mm256_storeu_si256((__m256i *)(p + n - 32), value);
+  _mm256_zeroupper();
   return s;
 }
 
-void *memmove(void *dest, const void *src, size_t n) {
-  uint8_t *pdest = (uint8_t *)dest;
-  const uint8_t *psrc = (const uint8_t *)src;
+__attribute__((target("avx2"))) static void *
+memmove_avx2(void *dest, const void *src, size_t n) {
+  if ((uintptr_t)dest - (uintptr_t)src >= n)
+    return memcpy_avx2(dest, src, n);
+  uint8_t *d = dest;
+  const uint8_t *s = src;
+  if (n < 32)
+    return memmove_sse2(dest, src, n);
+  const __m256i head = _mm256_loadu_si256((const __m256i *)s);
+  for (; n > 32; n -= 32)
+    _mm256_storeu_si256((__m256i *)(d + n - 32),
+                        _mm256_loadu_si256((const __m256i *)(s + n - 32)));
+  _mm256_storeu_si256((__m256i *)d, head);
+  _mm256_zeroupper();
+  return dest;
+}
 
-  if (src > dest) {
-    for (size_t i = 0; i < n; i++) {
-      pdest[i] = psrc[i];
+__attribute__((target("avx2"))) static size_t strlen_avx2(const char *s) {
+  const __m256i zero = _mm256_setzero_si256();
+  const uintptr_t offset = (uintptr_t)s % 32;
+  const char *p = s - offset;
+  uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+                      _mm256_load_si256((const __m256i *)p), zero)) >>
+                  offset;
+  while (mask == 0) {
+    p += 32;
+    mask = _mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(_mm256_load_si256((const __m256i *)p), zero));
+    if (mask != 0) {
+      _mm256_zeroupper();
+      return p + __builtin_ctz(mask) - s;
     }
-  } else if (src < dest) {
-    for (size_t i = n; i > 0; i--) {
-      pdest[i - 1] = psrc[i - 1];
+  }
+  _mm256_zeroupper();
+  return __builtin_ctz(mask);
+}
+
+__attribute__((target("avx2"))) static int strcmp_avx2(const char *p,
+                                                        const char *q) {
+  const __m256i zero = _mm256_setzero_si256();
+  for (;;) {
+    if ((uintptr_t)p % PAGE_SIZE <= PAGE_SIZE - 32 &&
+        (uintptr_t)q % PAGE_SIZE <= PAGE_SIZE - 32) {
+      const __m256i a = _mm256_loadu_si256((const __m256i *)p);
+      const __m256i b = _mm256_loadu_si256((const __m256i *)q);
+      const uint32_t mask =
+          ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b)) |
+          (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, zero));
+      if (mask != 0) {
+        _mm256_zeroupper();
+        const int i = __builtin_ctz(mask);
+        return (uint8_t)p[i] - (uint8_t)q[i];
+      }
+      p += 32;
+      q += 32;
+    } else {
+      if (*p == 0 || *p != *q) {
+        _mm256_zeroupper();
+        return (uint8_t)*p - (uint8_t)*q;
+      }
+      p++;
+      q++;
     }
   }
+}
 
-  return dest;
+__attribute__((target("avx2"))) static char *strchr_avx2(const char *s,
+                                                         char c) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i needle = _mm256_set1_epi8(c);
+  const uintptr_t offset = (uintptr_t)s % 32;
+  const char *p = s - offset;
+  __m256i chunk = _mm256_load_si256((const __m256i *)p);
+  uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(
+                      _mm256_cmpeq_epi8(chunk, needle),
+                      _mm256_cmpeq_epi8(chunk, zero))) >>
+                  offset;
+  p = s;
+  while (mask == 0) {
+    p += 32 - (uintptr_t)p % 32;
+    chunk = _mm256_load_si256((const __m256i *)p);
+    mask = _mm256_movemask_epi8(_mm256_or_si256(
+        _mm256_cmpeq_epi8(chunk, needle), _mm256_cmpeq_epi8(chunk, zero)));
+  }
+  _mm256_zeroupper();
+  p += __builtin_ctz(mask);
+  return *p == c ? (char *)p : NULL;
+}
+
+static const struct string_functions sse2_functions = {
+    .memcpy = memcpy_sse2,
+    .memset = memset_sse2,
+    .memmove = memmove_sse2,
+    .strlen = strlen_sse2,
+    .strcmp = strcmp_sse2,
+    .strchr = strchr_sse2,
+};
+
+static const struct string_functions avx2_functions = {
+    .memcpy = memcpy_avx2,
+    .memset = memset_avx2,
+    .memmove = memmove_avx2,
+    .strlen = strlen_avx2,
+    .strcmp = strcmp_avx2,
+    .strchr = strchr_avx2,
+};
+
+/**
+ * Returns true if we can use the AVX2 instructions. The CPU must support them
+ * and the OS must have enabled the AVX state in XCR0.
+ */
+static bool avx2_usable(void) {
+  uint32_t eax, ebx, ecx, edx;
+  __asm__ volatile("cpuid"
+                   : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
+                   : "a"(0), "c"(0));
+  if (eax < 7)
+    return false;
+  __asm__ volatile("cpuid"
+                   : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
+                   : "a"(1), "c"(0));
+  if ((ecx & CPUID_1_ECX_OSXSAVE) == 0 || (ecx & CPUID_1_ECX_AVX) == 0)
+    return false;
+  uint32_t xcr0_low, xcr0_high;
+  __asm__ volatile("xgetbv" : "=a"(xcr0_low), "=d"(xcr0_high) : "c"(0));
+  if ((xcr0_low & XCR0_SSE_AVX) != XCR0_SSE_AVX)
+    return false;
+  __asm__ volatile("cpuid"
+                   : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
+                   : "a"(7), "c"(0));
+  return (ebx & CPUID_7_EBX_AVX2) != 0;
+}
+
+// The selected implementation. NULL until the first call.
+static const struct string_functions *string_functions;
+
+static inline const struct string_functions *get_string_functions(void) {
+  if (string_functions == NULL)
+    string_functions = avx2_usable() ? &avx2_functions : &sse2_functions;
+  return string_functions;
+}
+
+/**
+ * Returns the name of the instruction set which the string functions use
+ */
+const char *string_functions_isa(void) {
+  return get_string_functions() == &avx2_functions ? "avx2" : "sse2";
+}
+
+void *memcpy(void *dest, const void *src, size_t n) {
+  return get_string_functions()->memcpy(dest, src, n);
+}
+
+void *memset(void *s, int c, size_t n) {
+  return get_string_functions()->memset(s, c, n);
+}
+
+void *memmove(void *dest, const void *src, size_t n) {
+  return get_string_functions()->memmove(dest, src, n);
 }
 
 int memcmp(const void *s1, const void *s2, size_t n) {
@@ -84,9 +412,7 @@ char *strncpy(char *dst, const char *src, size_t n) {
 }
 
 int strcmp(const char *p, const char *q) {
-  while (*p && *p == *q)
-    p++, q++;
-  return (uint8_t)*p - (uint8_t)*q;
+  return get_string_functions()->strcmp(p, q);
 }
 
 int strncmp(const char *s1, const char *s2, size_t n) {
@@ -119,19 +445,10 @@ int strncasecmp(const char *s1, const char *s2, size_t n) {
   return (0);
 }
 
-size_t strlen(const char *s) {
-  size_t n;
-
-  for (n = 0; s[n]; n++)
-    ;
-  return n;
-}
+size_t strlen(const char *s) { return get_string_functions()->strlen(s); }
 
 char *strchr(const char *s, char c) {
-  for (; *s; s++)
-    if (*s == c)
-      return (char *)s;
-  return 0;
+  return get_string_functions()->strchr(s, c);
 }
 
 char *strrchr(const char *p, char ch) {
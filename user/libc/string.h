@@ -15,4 +15,5 @@ size_t strlen(const char *s);
 char *strchr(const char *s, char c);
 char *strrchr(const char *s, char c);
 char *strstr(const char *haystack, const char *needle);
-char *strdup(const char *s);
\ No newline at end of file
+char *strdup(const char *s);
+const char *string_functions_isa(void);
\ No newline at end of file
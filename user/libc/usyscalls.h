@@ -20,6 +20,14 @@ int unlink(const char *);
 int mkdir(const char *);
 int chdir(const char *);
 int readdir(int fd, void *buffer, size_t len);
+int fork(void);
+void *mmap(size_t length, int prot, int flags, int fd, uint64_t offset);
+int munmap(void *address, size_t length);
+int shm_create(size_t size, void **address);
+void *shm_map(int id);
+int shm_unmap(void *address);
+int sync(void);
+int fsync(int fd);
 
 // Yield the program and give the time slice to another program
 static inline void yield(void) { __asm__ volatile("int 0x80"); }
\ No newline at end of file
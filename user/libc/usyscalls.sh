@@ -2,11 +2,14 @@
 echo '#include "include/syscall.h"'
 echo ".section .text"
 echo ".intel_syntax noprefix" # fuck AT&T
-for syscall in "read" "write" "open" "close" "sbrk" "exec" "exit" "wait" "lseek" "time" "sleep" "ioctl" "rename" "unlink" "mkdir" "chdir" "readdir"; do
+for syscall in "read" "write" "open" "close" "sbrk" "exec" "exit" "wait" "lseek" "time" "sleep" "ioctl" "rename" "unlink" "mkdir" "chdir" "readdir" "fork" "mmap" "munmap" "shm_create" "shm_map" "shm_unmap" "sync" "fsync"; do
 	echo ".globl $syscall"
 	echo ".type $syscall, @function"
 	echo "$syscall:"
 	echo "  mov rax, SYSCALL_${syscall^^}" # syscall number from syscall.h
+    # The fourth argument is passed in rcx but syscall overwrites rcx with
+    # the return address. The kernel expects it in r10 just like Linux.
+    echo "  mov r10, rcx"
     # The syscall arguments must be in the rdi, rsi and rdx which is the
     # registers used to pass arguments to this function as well!
     # This means that we can just call syscall because the rdi, rsi and rdx
@@ -0,0 +1,28 @@
+#include "include/file.h"
+#include "libc/stdio.h"
+#include "libc/usyscalls.h"
+
+#define BUFFER_SIZE 4096
+
+int main() {
+  char buffer[BUFFER_SIZE];
+
+  int fd = open("meminfo", O_DEVICE | O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "cannot open meminfo device: %d\n", fd);
+    exit(1);
+  }
+  int n;
+  while ((n = read(fd, buffer, BUFFER_SIZE)) > 0) {
+    if (write(stdout, buffer, n) != n) {
+      fprintf(stderr, "write error to stdout\n");
+      exit(1);
+    }
+  }
+  if (n < 0) {
+    fprintf(stderr, "read error on meminfo device: %d\n", n);
+    exit(1);
+  }
+  close(fd);
+  exit(0);
+}
\ No newline at end of file
@@ -0,0 +1,126 @@
+#include "libc/stdio.h"
+#include "libc/stdlib.h"
+#include "libc/string.h"
+#include "libc/usyscalls.h"
+#include <stdint.h>
+
+/**
+ * Checks the vectorized string functions of libc against simple byte loops
+ * with different sizes and alignments. Strings are also placed right before
+ * the end of the heap to make sure that no function reads the unmapped page
+ * after them.
+ */
+
+#define PAGE_SIZE 4096
+#define BUFFER_SIZE 1024
+#define MAX_SIZE 300
+#define MAX_ALIGNMENT 33
+
+static uint8_t source[BUFFER_SIZE], dest[BUFFER_SIZE], expected[BUFFER_SIZE];
+static int failures;
+static uint32_t seed = 12345;
+
+static uint8_t random_byte(void) {
+  seed = seed * 1103515245 + 12345;
+  return seed >> 16;
+}
+
+static void randomize(uint8_t *buffer) {
+  for (int i = 0; i < BUFFER_SIZE; i++)
+    buffer[i] = random_byte();
+}
+
+static void check(int ok, const char *function, int size, int src_offset,
+                  int dest_offset) {
+  if (ok)
+    return;
+  if (failures++ < 10)
+    printf("%s failed: size=%d src_offset=%d dest_offset=%d\n", function,
+           size, src_offset, dest_offset);
+}
+
+static int sign(int x) { return (x > 0) - (x < 0); }
+
+static int reference_strcmp(const char *p, const char *q) {
+  while (*p && *p == *q)
+    p++, q++;
+  return (uint8_t)*p - (uint8_t)*q;
+}
+
+static void test_memory(void) {
+  for (int n = 0; n < MAX_SIZE; n++) {
+    for (int src = 0; src < MAX_ALIGNMENT; src++) {
+      for (int dst = 0; dst < MAX_ALIGNMENT; dst++) {
+        // memcpy
+        randomize(source);
+        randomize(dest);
+        for (int i = 0; i < BUFFER_SIZE; i++)
+          expected[i] =
+              i >= dst && i < dst + n ? source[src + i - dst] : dest[i];
+        memcpy(dest + dst, source + src, n);
+        check(memcmp(dest, expected, BUFFER_SIZE) == 0, "memcpy", n, src, dst);
+        // memset
+        for (int i = dst; i < dst + n; i++)
+          expected[i] = (uint8_t)src;
+        memset(dest + dst, src, n);
+        check(memcmp(dest, expected, BUFFER_SIZE) == 0, "memset", n, src, dst);
+        // memmove in the same buffer, both directions
+        randomize(dest);
+        for (int i = 0; i < BUFFER_SIZE; i++)
+          expected[i] = dest[i];
+        if (dst > src)
+          for (int i = n; i > 0; i--)
+            expected[dst + i - 1] = expected[src + i - 1];
+        else
+          for (int i = 0; i < n; i++)
+            expected[dst + i] = expected[src + i];
+        memmove(dest + dst, dest + src, n);
+        check(memcmp(dest, expected, BUFFER_SIZE) == 0, "memmove", n, src, dst);
+      }
+    }
+  }
+}
+
+static void test_strings(char *page_end) {
+  for (int n = 0; n < MAX_SIZE; n++) {
+    // A string which ends at the last byte of the heap
+    char *s = page_end - n - 1;
+    for (int i = 0; i < n; i++)
+      s[i] = 'a' + i % 26;
+    s[n] = '\0';
+    check(strlen(s) == (size_t)n, "strlen", n, 0, 0);
+    check(strchr(s, '\0') == s + n, "strchr", n, 0, 0);
+    check(strchr(s, '#') == NULL, "strchr", n, 0, 0);
+    if (n > 0)
+      check(strchr(s, s[n - 1]) == s + (n - 1) % 26, "strchr", n, 0, 0);
+    for (int offset = 0; offset < MAX_ALIGNMENT * 2; offset++) {
+      char *t = (char *)dest + offset;
+      for (int i = 0; i <= n; i++)
+        t[i] = s[i];
+      check(strlen(t) == (size_t)n, "strlen", n, 0, offset);
+      check(strcmp(s, t) == 0, "strcmp", n, 0, offset);
+      if (n == 0)
+        continue;
+      t[n / 2] = (char)(random_byte() | 1);
+      check(sign(strcmp(s, t)) == sign(reference_strcmp(s, t)), "strcmp", n,
+            0, offset);
+      check(sign(strcmp(t, s)) == sign(reference_strcmp(t, s)), "strcmp", n,
+            0, offset);
+    }
+  }
+}
+
+int main() {
+  printf("string functions use %s\n", string_functions_isa());
+  test_memory();
+  // Make the heap end at a page boundary. The page after it is not mapped.
+  uint64_t top = (uint64_t)sbrk(0);
+  sbrk(((top + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1)) - top + PAGE_SIZE);
+  test_strings(sbrk(0));
+  if (failures != 0) {
+    printf("%d failures\n", failures);
+    exit(1);
+  }
+  printf("all tests passed\n");
+  exit(0);
+}
\ No newline at end of file